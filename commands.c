@@ -518,6 +518,17 @@ const owl_cmd commands_to_init[]
 	      "int a popwin.  If -d is specified, does not authenticate\n"
 	      "the lookup request.\n"),
   
+  OWLCMD_ARGS("logsearch", owl_command_logsearch, OWL_CTX_INTERACTIVE,
+	      "search the message store",
+	      "logsearch [-s sender] [-c class] [-i instance]\n"
+	      "          [-a YYYY-MM-DD] [-b YYYY-MM-DD] [word ...]",
+	      "Shows the logged messages in the message store (see the\n"
+	      "'logstore' variable) from the given sender, class and\n"
+	      "instance, sent on or after the date given with -a and\n"
+	      "before the date given with -b, whose bodies contain every\n"
+	      "word given.  Matching ignores case.  A sender without a\n"
+	      "realm matches that user in any realm.\n"),
+
   OWLCMD_ARGS("filter", owl_command_filter, OWL_CTX_ANY,
 	      "create a message filter",
 	      "filter <name> [ -c fgcolor ] [ -b bgcolor ] [ <expression> ... ]",
@@ -647,6 +658,7 @@ const owl_cmd commands_to_init[]
 	      "show keymaps\n"
 	      "show keymap <keymap>\n"
 	      "show license\n"
+	      "show logging\n"
 	      "show quickstart\n"
 	      "show startup\n"
 	      "show status\n"
@@ -666,6 +678,7 @@ const owl_cmd commands_to_init[]
 	      "Show filter <filter> will show the definition of a particular\n"
 	      "     filter.\n\n"
 	      "Show startup will display the custom startup config\n\n"
+	      "Show logging will show how far logging has fallen behind.\n\n"
 	      "Show zpunts will show the active zpunt filters.\n\n"
 	      "Show keymaps will list the names of all keymaps.\n"
 	      "Show keymap <keymap> will show the key bindings in a keymap.\n\n"
@@ -1365,6 +1378,64 @@ done:
   return NULL;
 }
 
+/* Parse 'date' as YYYY-MM-DD, local time, into *t */
+static int owl_command_parse_date(const char *date, time_t *t)
+{
+  struct tm tm;
+  const char *end;
+
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(date, "%Y-%m-%d", &tm);
+  if (!end || *end) return 0;
+  tm.tm_isdst = -1;
+  *t = mktime(&tm);
+  return *t != (time_t)-1;
+}
+
+char *owl_command_logsearch(int argc, const char *const *argv, const char *buff)
+{
+  const char *sender = NULL, *class = NULL, *instance = NULL;
+  time_t after = 0, before = 0;
+  char opt;
+  int i;
+  const char **tmp_argv = g_new(const char *, argc);
+
+  for (i = 0; i < argc; i++)
+    tmp_argv[i] = argv[i];
+
+  optind = 0;
+  while ((opt = getopt(argc, (char **)tmp_argv, "s:c:i:a:b:")) != -1) {
+    switch (opt) {
+      case 's':
+        sender = optarg;
+        break;
+      case 'c':
+        class = optarg;
+        break;
+      case 'i':
+        instance = optarg;
+        break;
+      case 'a':
+      case 'b':
+        if (!owl_command_parse_date(optarg, opt == 'a' ? &after : &before)) {
+          owl_function_error("Bad date '%s'; use YYYY-MM-DD", optarg);
+          goto done;
+        }
+        break;
+      default:
+        owl_function_makemsg("Bad arguments for %s", argv[0]);
+        goto done;
+    }
+  }
+
+  owl_logstore_search(sender, class, instance, after, before,
+                      tmp_argv + optind, argc - optind);
+
+done:
+  g_free(tmp_argv);
+  return NULL;
+}
+
 char *owl_command_smartfilter(int argc, const char *const *argv, const char *buff)
 {
   char *filtname = NULL;
@@ -2236,6 +2307,8 @@ char *owl_command_show(int argc, const char *const *argv, const char *buff)
     owl_function_status();
   } else if (!strcmp(argv[1], "license")) {
     owl_function_show_license();
+  } else if (!strcmp(argv[1], "logging")) {
+    owl_function_show_logging();
   } else if (!strcmp(argv[1], "quickstart")) {
     owl_function_show_quickstart();
   } else if (!strcmp(argv[1], "startup")) {
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <unistd.h>
 #include "owl.h"
 
 owl_filter *owl_filter_new_fromstring(const char *name, const char *string)
@@ -14,13 +15,20 @@ owl_filter *owl_filter_new_fromstring(const char *name, const char *string)
   return f;
 }
 
+static unsigned int owl_filter_next_id = 0;
+
 owl_filter *owl_filter_new(const char *name, int argc, const char *const *argv)
 {
   owl_filter *f;
 
   f = g_new(owl_filter, 1);
 
+  f->id=++owl_filter_next_id;
   f->name=g_strdup(name);
+  f->program=NULL;
+  f->proglen=0;
+  f->pure=0;
+  f->puregen=0;
   f->fgcolor=OWL_COLOR_DEFAULT;
   f->bgcolor=OWL_COLOR_DEFAULT;
 
@@ -56,6 +64,8 @@ owl_filter *owl_filter_new(const char *name, int argc, const char *const *argv)
     return NULL;
   }
 
+  f->program = owl_filterelement_compile(f->root, &f->proglen);
+
   return f;
 }
 
@@ -157,6 +167,11 @@ err:
   return NULL;
 }
 
+unsigned int owl_filter_get_id(const owl_filter *f)
+{
+  return(f->id);
+}
+
 const char *owl_filter_get_name(const owl_filter *f)
 {
   return(f->name);
@@ -170,6 +185,7 @@ SV *owl_filter_to_sv(const owl_filter *f)
 void owl_filter_set_fgcolor(owl_filter *f, int color)
 {
   f->fgcolor=color;
+  owl_global_filters_changed(&g);
 }
 
 int owl_filter_get_fgcolor(const owl_filter *f)
@@ -180,6 +196,7 @@ int owl_filter_get_fgcolor(const owl_filter *f)
 void owl_filter_set_bgcolor(owl_filter *f, int color)
 {
   f->bgcolor=color;
+  owl_global_filters_changed(&g);
 }
 
 int owl_filter_get_bgcolor(const owl_filter *f)
@@ -187,18 +204,192 @@ int owl_filter_get_bgcolor(const owl_filter *f)
   return(f->bgcolor);
 }
 
+/* Returns 1 if results of 'f' may be remembered on each message until
+ * the set of filters changes.
+ */
+static int owl_filter_is_pure(const owl_filter *f, unsigned int gen)
+{
+  owl_filter *cache = (owl_filter *)f;
+
+  if (f->puregen != gen) {
+    cache->pure = owl_filterelement_is_pure(f->root, 0);
+    cache->puregen = gen;
+  }
+  return f->pure;
+}
+
+/* Fill in the caches matching 'f' would otherwise fill in as it went.
+ * Returns 1 if 'f' is pure, in which case matching it afterwards writes
+ * to nothing but the message, and 0 otherwise.
+ */
+int owl_filter_prepare(const owl_filter *f)
+{
+  if (!owl_filter_is_pure(f, owl_global_get_filter_generation(&g)))
+    return 0;
+  owl_filterelement_prepare(f->root);
+  return 1;
+}
+
 /* return 1 if the message matches the given filter, otherwise
  * return 0.
  */
 int owl_filter_message_match(const owl_filter *f, const owl_message *m)
 {
+  unsigned int gen;
   int ret;
+
   if(!f->root) return 0;
-  ret = owl_filterelement_match(f->root, m);
+
+  gen = owl_global_get_filter_generation(&g);
+  if (!owl_filter_is_pure(f, gen))
+    return owl_filterelement_run(f->program, f->proglen, m);
+
+  if (owl_message_get_filter_memo(m, f, gen, &ret))
+    return ret;
+  ret = owl_filterelement_run(f->program, f->proglen, m);
+  owl_message_set_filter_memo(m, f, gen, ret);
   return ret;
 }
 
 
+/* Returns a newly allocated set (see owl_filterelement_candidates) of
+ * the positions of messages in 'ml' which may match 'f'.  If *exact
+ * is set on return, every message in the set matches and no further
+ * evaluation is needed.  The caller must free the set.
+ */
+unsigned long *owl_filter_candidates(const owl_filter *f, const owl_messagelist *ml, int *exact)
+{
+  unsigned long *set;
+  int words = OWL_MSGSET_WORDS(owl_messagelist_get_size(ml));
+
+  set = g_new(unsigned long, words ? words : 1);
+  *exact = owl_filterelement_candidates(f->root, ml, set, 0);
+  return set;
+}
+
+/* A run of positions in a message list matched by one worker. */
+typedef struct _owl_filter_chunk { /* noproto */
+  const owl_filter *filter;
+  const owl_messagelist *ml;
+  unsigned long *set;
+  int start, end;
+  GMutex *mutex;
+  GCond *cond;
+  int *pending;
+} owl_filter_chunk;
+
+static GThreadPool *owl_filter_pool = NULL;
+
+static void owl_filter_refine_chunk(gpointer data, gpointer user_data)
+{
+  owl_filter_chunk *chunk = data;
+  int i;
+
+  for (i = chunk->start; i < chunk->end; i++) {
+    if (!OWL_MSGSET_HAS(chunk->set, i)) continue;
+    if (!owl_filter_message_match(chunk->filter,
+                                  owl_messagelist_get_element(chunk->ml, i)))
+      OWL_MSGSET_DEL(chunk->set, i);
+  }
+
+  g_mutex_lock(chunk->mutex);
+  if (--*chunk->pending == 0)
+    g_cond_signal(chunk->cond);
+  g_mutex_unlock(chunk->mutex);
+}
+
+static int owl_filter_num_workers(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n < 1) return 1;
+  if (n > OWL_FILTER_MAX_WORKERS) return OWL_FILTER_MAX_WORKERS;
+  return n;
+}
+
+/* Split the matching done by owl_filter_refine_candidates over a pool
+ * of threads.  Each chunk covers whole words of the set, so no two
+ * threads write to the same word.  Returns 0, having done nothing, if
+ * the pool could not be started.
+ */
+static int owl_filter_refine_parallel(const owl_filter *f, const owl_messagelist *ml, unsigned long *set, int workers)
+{
+  GError *error = NULL;
+  owl_filter_chunk *chunks;
+  GMutex *mutex;
+  GCond *cond;
+  int size, words, per, nchunks, pending, i;
+
+  if (!owl_filter_pool) {
+    owl_filter_pool = g_thread_pool_new(owl_filter_refine_chunk, NULL,
+                                        workers, FALSE, &error);
+    if (error) {
+      owl_function_debugmsg("owl_filter_refine_parallel: %s", error->message);
+      g_error_free(error);
+      owl_filter_pool = NULL;
+      return 0;
+    }
+  }
+
+  size = owl_messagelist_get_size(ml);
+  words = OWL_MSGSET_WORDS(size);
+  /* Several chunks per worker, so a slow chunk does not hold up the rest */
+  nchunks = workers * 4;
+  per = (words + nchunks - 1) / nchunks;
+  nchunks = (words + per - 1) / per;
+
+  mutex = g_mutex_new();
+  cond = g_cond_new();
+  chunks = g_new(owl_filter_chunk, nchunks);
+  pending = nchunks;
+  for (i = 0; i < nchunks; i++) {
+    chunks[i].filter = f;
+    chunks[i].ml = ml;
+    chunks[i].set = set;
+    chunks[i].start = i * per * OWL_MSGSET_BITS;
+    chunks[i].end = MIN(size, (i + 1) * per * OWL_MSGSET_BITS);
+    chunks[i].mutex = mutex;
+    chunks[i].cond = cond;
+    chunks[i].pending = &pending;
+  }
+  for (i = 0; i < nchunks; i++)
+    g_thread_pool_push(owl_filter_pool, &chunks[i], NULL);
+
+  g_mutex_lock(mutex);
+  while (pending > 0)
+    g_cond_wait(cond, mutex);
+  g_mutex_unlock(mutex);
+
+  g_free(chunks);
+  g_cond_free(cond);
+  g_mutex_free(mutex);
+  return 1;
+}
+
+/* Remove from 'set', as returned by owl_filter_candidates, every
+ * message of 'ml' which does not match 'f'.  Long lists are matched by
+ * several threads at once unless perl can be reached from 'f', in
+ * which case they are matched here in order.
+ */
+void owl_filter_refine_candidates(const owl_filter *f, const owl_messagelist *ml, unsigned long *set)
+{
+  int i, j, workers;
+
+  j = owl_messagelist_get_size(ml);
+  workers = owl_filter_num_workers();
+  if (j >= OWL_FILTER_PARALLEL_THRESHOLD && workers > 1 &&
+      owl_filter_prepare(f) &&
+      owl_filter_refine_parallel(f, ml, set, workers))
+    return;
+
+  for (i = 0; i < j; i++) {
+    if (!OWL_MSGSET_HAS(set, i)) continue;
+    if (!owl_filter_message_match(f, owl_messagelist_get_element(ml, i)))
+      OWL_MSGSET_DEL(set, i);
+  }
+}
+
+
 char* owl_filter_print(const owl_filter *f)
 {
   GString *out = g_string_new("");
@@ -264,6 +455,7 @@ void owl_filter_delete(owl_filter *f)
     owl_filterelement_cleanup(f->root);
     g_free(f->root);
   }
+  g_free(f->program);
   if (f->name)
     g_free(f->name);
   g_free(f);
@@ -1,51 +1,68 @@
 #include "owl.h"
 
-static const char * owl_filterelement_get_field(const owl_message *m, const char * field)
+static const char *const owl_filterelement_fields[] = {
+  "class", "instance", "sender", "recipient", "body", "opcode",
+  "realm", "type", "hostname", "deleted", "direction", "login",
+};
+
+/* Resolve a field name to an OWL_FILTER_FIELD_* id.  Anything not
+ * built in is a message attribute. */
+static int owl_filterelement_field_id(const char *field)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS(owl_filterelement_fields); i++) {
+    if (!strcasecmp(field, owl_filterelement_fields[i]))
+      return i;
+  }
+  return OWL_FILTER_FIELD_ATTRIBUTE;
+}
+
+static const char *owl_filterelement_get_field(const owl_message *m, int fieldid, const char *attr)
 {
   const char *match;
-  if (!strcasecmp(field, "class")) {
-    match=owl_message_get_class(m);
-  } else if (!strcasecmp(field, "instance")) {
-    match=owl_message_get_instance(m);
-  } else if (!strcasecmp(field, "sender")) {
-    match=owl_message_get_sender(m);
-  } else if (!strcasecmp(field, "recipient")) {
-    match=owl_message_get_recipient(m);
-  } else if (!strcasecmp(field, "body")) {
-    match=owl_message_get_body(m);
-  } else if (!strcasecmp(field, "opcode")) {
-    match=owl_message_get_opcode(m);
-  } else if (!strcasecmp(field, "realm")) {
-    match=owl_message_get_realm(m);
-  } else if (!strcasecmp(field, "type")) {
-    match=owl_message_get_type(m);
-  } else if (!strcasecmp(field, "hostname")) {
-    match=owl_message_get_hostname(m);
-  } else if (!strcasecmp(field, "deleted")) {
-    match=owl_message_is_delete(m) ? "true" : "false";
-  } else if (!strcasecmp(field, "direction")) {
+
+  switch (fieldid) {
+  case OWL_FILTER_FIELD_CLASS:
+    return owl_message_get_class(m);
+  case OWL_FILTER_FIELD_INSTANCE:
+    return owl_message_get_instance(m);
+  case OWL_FILTER_FIELD_SENDER:
+    return owl_message_get_sender(m);
+  case OWL_FILTER_FIELD_RECIPIENT:
+    return owl_message_get_recipient(m);
+  case OWL_FILTER_FIELD_BODY:
+    return owl_message_get_body(m);
+  case OWL_FILTER_FIELD_OPCODE:
+    return owl_message_get_opcode(m);
+  case OWL_FILTER_FIELD_REALM:
+    return owl_message_get_realm(m);
+  case OWL_FILTER_FIELD_TYPE:
+    return owl_message_get_type(m);
+  case OWL_FILTER_FIELD_HOSTNAME:
+    return owl_message_get_hostname(m);
+  case OWL_FILTER_FIELD_DELETED:
+    return owl_message_is_delete(m) ? "true" : "false";
+  case OWL_FILTER_FIELD_DIRECTION:
     if (owl_message_is_direction_out(m)) {
-      match="out";
+      return "out";
     } else if (owl_message_is_direction_in(m)) {
-      match="in";
+      return "in";
     } else if (owl_message_is_direction_none(m)) {
-      match="none";
-    } else {
-      match="";
+      return "none";
     }
-  } else if (!strcasecmp(field, "login")) {
+    return "";
+  case OWL_FILTER_FIELD_LOGIN:
     if (owl_message_is_login(m)) {
-      match="login";
+      return "login";
     } else if (owl_message_is_logout(m)) {
-      match="logout";
-    } else {
-      match="none";
+      return "logout";
     }
-  } else {
-    match = owl_message_get_attribute_value(m,field);
-    if(match == NULL) match = "";
+    return "none";
   }
 
+  match = owl_message_get_attribute_value_interned(m, attr);
+  if (match == NULL) match = "";
   return match;
 }
 
@@ -61,14 +78,29 @@ static int owl_filterelement_match_true(const owl_filterelement *fe, const owl_m
 
 static int owl_filterelement_match_re(const owl_filterelement *fe, const owl_message *m)
 {
-  const char * val = owl_filterelement_get_field(m, fe->field);
+  const char * val = owl_filterelement_get_field(m, fe->fieldid, fe->attr);
   return !owl_regex_compare(&(fe->re), val, NULL, NULL);
 }
 
+/* Return the filter a filter reference names, looking it up again only
+ * when the set of filters has changed since the last lookup.
+ */
+static const owl_filter *owl_filterelement_get_target(const owl_filterelement *fe)
+{
+  owl_filterelement *cache = (owl_filterelement *)fe;
+  unsigned int gen = owl_global_get_filter_generation(&g);
+
+  if (fe->targetgen != gen) {
+    cache->target = owl_global_get_filter(&g, fe->field);
+    cache->targetgen = gen;
+  }
+  return fe->target;
+}
+
 static int owl_filterelement_match_filter(const owl_filterelement *fe, const owl_message *m)
 {
   const owl_filter *subfilter;
-  subfilter=owl_global_get_filter(&g, fe->field);
+  subfilter=owl_filterelement_get_target(fe);
   if (!subfilter) {
     /* the filter does not exist, maybe because it was deleted.
      * Default to not matching
@@ -192,6 +224,10 @@ void owl_filterelement_create(owl_filterelement *fe) {
   fe->left = fe->right = NULL;
   fe->match_message = NULL;
   fe->print_elt = NULL;
+  fe->fieldid = OWL_FILTER_FIELD_ATTRIBUTE;
+  fe->attr = NULL;
+  fe->target = NULL;
+  fe->targetgen = 0;
   owl_regex_init(&(fe->re));
 }
 
@@ -219,6 +255,9 @@ int owl_filterelement_create_re(owl_filterelement *fe, const char *field, const
     fe->field = NULL;
     return (-1);
   }
+  fe->fieldid = owl_filterelement_field_id(field);
+  if (fe->fieldid == OWL_FILTER_FIELD_ATTRIBUTE)
+    fe->attr = g_intern_string(field);
   fe->match_message = owl_filterelement_match_re;
   fe->print_elt = owl_filterelement_print_re;
   return 0;
@@ -281,6 +320,150 @@ int owl_filterelement_match(const owl_filterelement *fe, const owl_message *m)
   return fe->match_message(fe, m);
 }
 
+/* Count the instructions needed to compile 'fe'. */
+static int owl_filterelement_program_size(const owl_filterelement *fe)
+{
+  int n = 0;
+
+  if (!fe || !fe->match_message) return 1;
+  if (fe->match_message == owl_filterelement_match_group)
+    return owl_filterelement_program_size(fe->left);
+  if (fe->match_message == owl_filterelement_match_and ||
+      fe->match_message == owl_filterelement_match_or)
+    n = owl_filterelement_program_size(fe->right);
+  if (fe->left)
+    n += owl_filterelement_program_size(fe->left);
+  return n + 1;
+}
+
+static void owl_filterelement_emit(const owl_filterelement *fe, owl_filter_insn *prog, int *pc)
+{
+  owl_filter_insn *insn;
+
+  if (!fe || !fe->match_message || fe->match_message == owl_filterelement_match_false) {
+    insn = &prog[(*pc)++];
+    insn->op = OWL_FILTER_OP_FALSE;
+  } else if (fe->match_message == owl_filterelement_match_group) {
+    owl_filterelement_emit(fe->left, prog, pc);
+  } else if (fe->match_message == owl_filterelement_match_not) {
+    owl_filterelement_emit(fe->left, prog, pc);
+    insn = &prog[(*pc)++];
+    insn->op = OWL_FILTER_OP_NOT;
+  } else if (fe->match_message == owl_filterelement_match_and ||
+             fe->match_message == owl_filterelement_match_or) {
+    /* lhs; jump past rhs if the result is already known; rhs */
+    owl_filterelement_emit(fe->left, prog, pc);
+    insn = &prog[(*pc)++];
+    insn->op = fe->match_message == owl_filterelement_match_and ?
+      OWL_FILTER_OP_JUMP_IF_FALSE : OWL_FILTER_OP_JUMP_IF_TRUE;
+    owl_filterelement_emit(fe->right, prog, pc);
+    insn->arg = *pc;
+  } else {
+    insn = &prog[(*pc)++];
+    insn->fe = fe;
+    if (fe->match_message == owl_filterelement_match_true) {
+      insn->op = OWL_FILTER_OP_TRUE;
+    } else if (fe->match_message == owl_filterelement_match_re) {
+      insn->op = OWL_FILTER_OP_RE;
+      insn->arg = fe->fieldid;
+    } else if (fe->match_message == owl_filterelement_match_filter) {
+      insn->op = OWL_FILTER_OP_FILTER;
+    } else {
+      insn->op = OWL_FILTER_OP_PERL;
+    }
+  }
+}
+
+/* Compile the tree rooted at 'fe' into a flat program, which remains
+ * valid for as long as the tree does.  The caller must free the
+ * returned array; its length is stored in *len.
+ */
+owl_filter_insn *owl_filterelement_compile(const owl_filterelement *fe, int *len)
+{
+  owl_filter_insn *prog;
+  int pc = 0;
+
+  prog = g_new0(owl_filter_insn, owl_filterelement_program_size(fe));
+  owl_filterelement_emit(fe, prog, &pc);
+  *len = pc;
+  return prog;
+}
+
+/* Run a program built by owl_filterelement_compile against 'm'. */
+int owl_filterelement_run(const owl_filter_insn *prog, int len, const owl_message *m)
+{
+  const owl_filter_insn *insn;
+  const char *val;
+  int pc = 0, result = 0;
+
+  while (pc < len) {
+    insn = &prog[pc++];
+    switch (insn->op) {
+    case OWL_FILTER_OP_FALSE:
+      result = 0;
+      break;
+    case OWL_FILTER_OP_TRUE:
+      result = 1;
+      break;
+    case OWL_FILTER_OP_RE:
+      val = owl_filterelement_get_field(m, insn->arg, insn->fe->attr);
+      result = !owl_regex_compare(&(insn->fe->re), val, NULL, NULL);
+      break;
+    case OWL_FILTER_OP_FILTER:
+      result = owl_filterelement_match_filter(insn->fe, m);
+      break;
+    case OWL_FILTER_OP_PERL:
+      result = owl_filterelement_match_perl(insn->fe, m);
+      break;
+    case OWL_FILTER_OP_NOT:
+      result = !result;
+      break;
+    case OWL_FILTER_OP_JUMP_IF_FALSE:
+      if (!result) pc = insn->arg;
+      break;
+    case OWL_FILTER_OP_JUMP_IF_TRUE:
+      if (result) pc = insn->arg;
+      break;
+    }
+  }
+  return result;
+}
+
+/* Returns 1 if the result of 'fe' depends only on the message and the
+ * current set of filters, ie. no perl function can be reached from it.
+ */
+int owl_filterelement_is_pure(const owl_filterelement *fe, int depth)
+{
+  const owl_filter *f;
+
+  if (!fe || !fe->match_message) return 1;
+  if (fe->match_message == owl_filterelement_match_perl) return 0;
+  if (fe->match_message == owl_filterelement_match_filter) {
+    if (depth >= OWL_FILTER_MAX_DEPTH) return 0;
+    f = owl_filterelement_get_target(fe);
+    return !f || owl_filterelement_is_pure(f->root, depth+1);
+  }
+  return owl_filterelement_is_pure(fe->left, depth) &&
+    owl_filterelement_is_pure(fe->right, depth);
+}
+
+/* Resolve every filter reference reachable from 'fe', and fill in the
+ * purity of each filter so reached.  Only call this on a pure element.
+ */
+void owl_filterelement_prepare(const owl_filterelement *fe)
+{
+  const owl_filter *f;
+
+  if (!fe || !fe->match_message) return;
+  if (fe->match_message == owl_filterelement_match_filter) {
+    f = owl_filterelement_get_target(fe);
+    if (f) owl_filter_prepare(f);
+    return;
+  }
+  owl_filterelement_prepare(fe->left);
+  owl_filterelement_prepare(fe->right);
+}
+
 static int fe_visiting = 0;
 static int fe_visited  = 1;
 
@@ -322,6 +505,77 @@ int _owl_filterelement_is_toodeep(const owl_filterelement *fe, owl_dict *seen)
   return rv;
 }
 
+static void owl_filterelement_msgset_fill(unsigned long *set, int n)
+{
+  int words = OWL_MSGSET_WORDS(n);
+
+  memset(set, 0xff, words * sizeof(unsigned long));
+  if (n % OWL_MSGSET_BITS)
+    set[words - 1] = (1UL << (n % OWL_MSGSET_BITS)) - 1;
+}
+
+/* Store in 'set' the positions in 'ml' of the messages which may
+ * match 'fe', using the list's indexes where possible.  'set' must
+ * hold OWL_MSGSET_WORDS(n) words for a list of n messages.
+ *
+ * Returns 1 if the set is exact, or 0 if it is only a superset and
+ * each candidate must still be checked with owl_filterelement_match.
+ */
+int owl_filterelement_candidates(const owl_filterelement *fe, const owl_messagelist *ml, unsigned long *set, int depth)
+{
+  int i, n, words, idx, exact;
+  unsigned long *rset;
+  const owl_filter *f;
+
+  n = owl_messagelist_get_size(ml);
+  words = OWL_MSGSET_WORDS(n);
+  memset(set, 0, words * sizeof(unsigned long));
+
+  if (!fe || !fe->match_message || fe->match_message == owl_filterelement_match_false) {
+    return 1;
+  } else if (fe->match_message == owl_filterelement_match_true) {
+    owl_filterelement_msgset_fill(set, n);
+    return 1;
+  } else if (fe->match_message == owl_filterelement_match_re) {
+    idx = owl_messagelist_get_index_for_field(fe->field);
+    if (idx >= 0 && owl_messagelist_index_match(ml, idx, &(fe->re), set) == 0)
+      return 1;
+  } else if (fe->match_message == owl_filterelement_match_filter) {
+    f = owl_filterelement_get_target(fe);
+    /* a missing filter matches nothing */
+    if (!f) return 1;
+    if (depth < OWL_FILTER_MAX_DEPTH)
+      return owl_filterelement_candidates(f->root, ml, set, depth+1);
+  } else if (fe->match_message == owl_filterelement_match_group) {
+    return owl_filterelement_candidates(fe->left, ml, set, depth);
+  } else if (fe->match_message == owl_filterelement_match_not) {
+    if (owl_filterelement_candidates(fe->left, ml, set, depth)) {
+      for (i = 0; i < words; i++)
+        set[i] = ~set[i];
+      if (n % OWL_MSGSET_BITS)
+        set[words - 1] &= (1UL << (n % OWL_MSGSET_BITS)) - 1;
+      return 1;
+    }
+  } else if (fe->match_message == owl_filterelement_match_and ||
+             fe->match_message == owl_filterelement_match_or) {
+    rset = g_new(unsigned long, words ? words : 1);
+    exact = owl_filterelement_candidates(fe->left, ml, set, depth);
+    exact = owl_filterelement_candidates(fe->right, ml, rset, depth) && exact;
+    for (i = 0; i < words; i++) {
+      if (fe->match_message == owl_filterelement_match_and)
+        set[i] &= rset[i];
+      else
+        set[i] |= rset[i];
+    }
+    g_free(rset);
+    return exact;
+  }
+
+  /* perl filters and unindexed fields: every message is a candidate */
+  owl_filterelement_msgset_fill(set, n);
+  return 0;
+}
+
 void owl_filterelement_cleanup(owl_filterelement *fe)
 {
   if (fe->field) g_free(fe->field);
@@ -6,6 +6,8 @@
 void owl_fmtext_init_null(owl_fmtext *f)
 {
   f->buff = g_string_new("");
+  f->runs = g_array_new(FALSE, FALSE, sizeof(int));
+  f->lines = g_array_new(FALSE, FALSE, sizeof(int));
 }
 
 /* Clear the data from an fmtext, but don't deallocate memory. This
@@ -13,6 +15,8 @@ void owl_fmtext_init_null(owl_fmtext *f)
 void owl_fmtext_clear(owl_fmtext *f)
 {
   g_string_truncate(f->buff, 0);
+  g_array_set_size(f->runs, 0);
+  g_array_set_size(f->lines, 0);
 }
 
 int owl_fmtext_is_format_char(gunichar c)
@@ -21,6 +25,81 @@ int owl_fmtext_is_format_char(gunichar c)
   if ((c & ~(OWL_FMTEXT_UC_ALLCOLOR_MASK)) == OWL_FMTEXT_UC_COLOR_BASE) return 1;
   return 0;
 }
+
+/* Internal function.  Append the formatting character 'c' to 'f'. */
+static void _owl_fmtext_append_format(owl_fmtext *f, gunichar c)
+{
+  int offset = f->buff->len;
+
+  g_array_append_val(f->runs, offset);
+  g_string_append_unichar(f->buff, c);
+}
+
+/* Internal function.  Append 'len' bytes of 'text' to 'f', noting
+ * any newlines and formatting characters it already has.  The latter
+ * are rare, so let memchr look for their start byte. */
+static void _owl_fmtext_append_text(owl_fmtext *f, const char *text, gssize len)
+{
+  const char *p, *start, *end;
+  int offset;
+
+  if (len < 0) len = strlen(text);
+  offset = f->buff->len;
+  g_string_append_len(f->buff, text, len);
+
+  start = f->buff->str + offset;
+  end = f->buff->str + f->buff->len;
+  for (p = memchr(start, '\n', end - start); p; p = memchr(p + 1, '\n', end - (p + 1))) {
+    offset = p - f->buff->str;
+    g_array_append_val(f->lines, offset);
+  }
+  for (p = memchr(start, OWL_FMTEXT_UC_STARTBYTE_UTF8, end - start);
+       p;
+       p = memchr(p + 1, OWL_FMTEXT_UC_STARTBYTE_UTF8, end - (p + 1))) {
+    if (owl_fmtext_is_format_char(g_utf8_get_char(p))) {
+      offset = p - f->buff->str;
+      g_array_append_val(f->runs, offset);
+    }
+  }
+}
+
+/* Internal function.  Return the index in the sorted 'offsets' of the
+ * first one at or after byte 'offset'. */
+static guint _owl_fmtext_find_offset(const GArray *offsets, int offset)
+{
+  guint lo = 0, hi = offsets->len, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (g_array_index(offsets, int, mid) < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Internal function.  Return the index in f->runs of the first
+ * formatting character at or after byte 'offset'. */
+static guint _owl_fmtext_find_run(const owl_fmtext *f, int offset)
+{
+  return _owl_fmtext_find_offset(f->runs, offset);
+}
+
+/* Internal function.  Append the entries of 'in' in [start, stop),
+ * moved by 'shift', to 'out'. */
+static void _owl_fmtext_copy_offsets(GArray *out, const GArray *in, int start, int stop, int shift)
+{
+  guint i;
+  int offset;
+
+  for (i = _owl_fmtext_find_offset(in, start); i < in->len; i++) {
+    offset = g_array_index(in, int, i);
+    if (offset >= stop) break;
+    offset += shift;
+    g_array_append_val(out, offset);
+  }
+}
 /* append text to the end of 'f' with attribute 'attr' and color
  * 'color'
  */
@@ -34,18 +113,18 @@ void owl_fmtext_append_attr(owl_fmtext *f, const char *text, char attr, short fg
 
   /* Set attributes */
   if (a)
-    g_string_append_unichar(f->buff, OWL_FMTEXT_UC_ATTR | attr);
+    _owl_fmtext_append_format(f, OWL_FMTEXT_UC_ATTR | attr);
   if (fg)
-    g_string_append_unichar(f->buff, OWL_FMTEXT_UC_FGCOLOR | fgcolor);
+    _owl_fmtext_append_format(f, OWL_FMTEXT_UC_FGCOLOR | fgcolor);
   if (bg)
-    g_string_append_unichar(f->buff, OWL_FMTEXT_UC_BGCOLOR | bgcolor);
+    _owl_fmtext_append_format(f, OWL_FMTEXT_UC_BGCOLOR | bgcolor);
 
-  g_string_append(f->buff, text);
+  _owl_fmtext_append_text(f, text, -1);
 
   /* Reset attributes */
-  if (bg) g_string_append_unichar(f->buff, OWL_FMTEXT_UC_BGDEFAULT);
-  if (fg) g_string_append_unichar(f->buff, OWL_FMTEXT_UC_FGDEFAULT);
-  if (a)  g_string_append_unichar(f->buff, OWL_FMTEXT_UC_ATTR | OWL_FMTEXT_UC_ATTR);
+  if (bg) _owl_fmtext_append_format(f, OWL_FMTEXT_UC_BGDEFAULT);
+  if (fg) _owl_fmtext_append_format(f, OWL_FMTEXT_UC_FGDEFAULT);
+  if (a)  _owl_fmtext_append_format(f, OWL_FMTEXT_UC_ATTR | OWL_FMTEXT_UC_ATTR);
 }
 
 /* Append normal, uncolored text 'text' to 'f' */
@@ -113,16 +192,18 @@ static void _owl_fmtext_update_attributes(gunichar c, char *attr, short *fgcolor
   }
 }
 
-/* Internal function. Scan for attribute characters. */
+/* Internal function. Apply the attribute characters before 'start'. */
 static void _owl_fmtext_scan_attributes(const owl_fmtext *f, int start, char *attr, short *fgcolor, short *bgcolor)
 {
-  const char *p;
-  p = strchr(f->buff->str, OWL_FMTEXT_UC_STARTBYTE_UTF8);
-  while (p && p < f->buff->str + start) {
-    _owl_fmtext_update_attributes(g_utf8_get_char(p), attr, fgcolor, bgcolor);
-    p = strchr(p+1, OWL_FMTEXT_UC_STARTBYTE_UTF8);
+  guint i;
+  int offset;
+
+  for (i = 0; i < f->runs->len; i++) {
+    offset = g_array_index(f->runs, int, i);
+    if (offset >= start) break;
+    _owl_fmtext_update_attributes(g_utf8_get_char(f->buff->str + offset), attr, fgcolor, bgcolor);
   }
-}  
+}
 
 /* Internal function.  Append text from 'in' between index 'start'
  * inclusive and 'stop' exclusive, to the end of 'f'. This function
@@ -137,18 +218,21 @@ static void _owl_fmtext_append_fmtext(owl_fmtext *f, const owl_fmtext *in, int s
   _owl_fmtext_scan_attributes(in, start, &attr, &fgcolor, &bgcolor);
 
   if (attr != OWL_FMTEXT_ATTR_NONE)
-    g_string_append_unichar(f->buff, OWL_FMTEXT_UC_ATTR | attr);
+    _owl_fmtext_append_format(f, OWL_FMTEXT_UC_ATTR | attr);
   if (fgcolor != OWL_COLOR_DEFAULT)
-    g_string_append_unichar(f->buff, OWL_FMTEXT_UC_FGCOLOR | fgcolor);
+    _owl_fmtext_append_format(f, OWL_FMTEXT_UC_FGCOLOR | fgcolor);
   if (bgcolor != OWL_COLOR_DEFAULT)
-    g_string_append_unichar(f->buff, OWL_FMTEXT_UC_BGCOLOR | bgcolor);
+    _owl_fmtext_append_format(f, OWL_FMTEXT_UC_BGCOLOR | bgcolor);
 
+  /* Copy the text, and where its formatting characters and newlines are */
+  _owl_fmtext_copy_offsets(f->runs, in->runs, start, stop, f->buff->len - start);
+  _owl_fmtext_copy_offsets(f->lines, in->lines, start, stop, f->buff->len - start);
   g_string_append_len(f->buff, in->buff->str+start, stop-start);
 
   /* Reset attributes */
-  g_string_append_unichar(f->buff, OWL_FMTEXT_UC_BGDEFAULT);
-  g_string_append_unichar(f->buff, OWL_FMTEXT_UC_FGDEFAULT);
-  g_string_append_unichar(f->buff, OWL_FMTEXT_UC_ATTR | OWL_FMTEXT_UC_ATTR);
+  _owl_fmtext_append_format(f, OWL_FMTEXT_UC_BGDEFAULT);
+  _owl_fmtext_append_format(f, OWL_FMTEXT_UC_FGDEFAULT);
+  _owl_fmtext_append_format(f, OWL_FMTEXT_UC_ATTR | OWL_FMTEXT_UC_ATTR);
 }
 
 /* append fmtext 'in' to 'f' */
@@ -201,6 +285,7 @@ static void _owl_fmtext_curs_waddstr(const owl_fmtext *f, WINDOW *w, int do_sear
   char *s, *p;
   char attr;
   short fg, bg, pair = 0;
+  guint i;
   
   if (w==NULL) {
     owl_function_debugmsg("Hit a null window in owl_fmtext_curs_waddstr.");
@@ -216,62 +301,58 @@ static void _owl_fmtext_curs_waddstr(const owl_fmtext *f, WINDOW *w, int do_sear
   pair = owl_fmtext_get_colorpair(fg, bg);
   _owl_fmtext_wcolor_set(w, pair);
 
-  /* Find next possible format character. */
-  p = strchr(s, OWL_FMTEXT_UC_STARTBYTE_UTF8);
-  while(p) {
-    if (owl_fmtext_is_format_char(g_utf8_get_char(p))) {
-      /* Deal with all text from last insert to here. */
-      char tmp;
-   
-      tmp = p[0];
-      p[0] = '\0';
-      if (do_search && owl_global_is_search_active(&g)) {
-	/* Search is active, so highlight search results. */
-	int start, end;
-	while (owl_regex_compare(owl_global_get_search_re(&g), s, &start, &end) == 0) {
-	  /* Prevent an infinite loop matching the empty string. */
-	  if (end == 0)
-	    break;
-
-	  /* Found search string, highlight it. */
-
-	  waddnstr(w, s, start);
-
-	  _owl_fmtext_wattrset(w, attr ^ OWL_FMTEXT_ATTR_REVERSE);
-	  _owl_fmtext_wcolor_set(w, pair);
-	  
-	  waddnstr(w, s + start, end - start);
-
-	  _owl_fmtext_wattrset(w, attr);
-	  _owl_fmtext_wcolor_set(w, pair);
-
-	  s += end;
-	}
-      }
-      /* Deal with remaining part of string. */
-      waddstr(w, s);
-      p[0] = tmp;
-
-      /* Deal with new attributes. Process all consecutive formatting
-       * characters, and then apply defaults where relevant. */
-      while (owl_fmtext_is_format_char(g_utf8_get_char(p))) {
-	_owl_fmtext_update_attributes(g_utf8_get_char(p), &attr, &fg, &bg);
-	p = g_utf8_next_char(p);
+  /* Go from one run of formatting characters to the next. */
+  i = 0;
+  while (i < f->runs->len) {
+    /* Deal with all text from last insert to here. */
+    char tmp;
+
+    p = f->buff->str + g_array_index(f->runs, int, i);
+    tmp = p[0];
+    p[0] = '\0';
+    if (do_search && owl_global_is_search_active(&g)) {
+      /* Search is active, so highlight search results. */
+      int start, end;
+      while (owl_regex_compare(owl_global_get_search_re(&g), s, &start, &end) == 0) {
+	/* Prevent an infinite loop matching the empty string. */
+	if (end == 0)
+	  break;
+
+	/* Found search string, highlight it. */
+
+	waddnstr(w, s, start);
+
+	_owl_fmtext_wattrset(w, attr ^ OWL_FMTEXT_ATTR_REVERSE);
+	_owl_fmtext_wcolor_set(w, pair);
+
+	waddnstr(w, s + start, end - start);
+
+	_owl_fmtext_wattrset(w, attr);
+	_owl_fmtext_wcolor_set(w, pair);
+
+	s += end;
       }
-      attr |= default_attrs;
-      if (fg == OWL_COLOR_DEFAULT) fg = default_fgcolor;
-      if (bg == OWL_COLOR_DEFAULT) bg = default_bgcolor;
-      _owl_fmtext_wattrset(w, attr);
-      pair = owl_fmtext_get_colorpair(fg, bg);
-      _owl_fmtext_wcolor_set(w, pair);
-
-      /* Advance to next non-formatting character. */
-      s = p;
-      p = strchr(s, OWL_FMTEXT_UC_STARTBYTE_UTF8);
     }
-    else {
-      p = strchr(p+1, OWL_FMTEXT_UC_STARTBYTE_UTF8);
+    /* Deal with remaining part of string. */
+    waddstr(w, s);
+    p[0] = tmp;
+
+    /* Deal with new attributes. Process all consecutive formatting
+     * characters, and then apply defaults where relevant. */
+    while (i < f->runs->len && f->buff->str + g_array_index(f->runs, int, i) == p) {
+      _owl_fmtext_update_attributes(g_utf8_get_char(p), &attr, &fg, &bg);
+      p = g_utf8_next_char(p);
+      i++;
     }
+    attr |= default_attrs;
+    if (fg == OWL_COLOR_DEFAULT) fg = default_fgcolor;
+    if (bg == OWL_COLOR_DEFAULT) bg = default_bgcolor;
+    _owl_fmtext_wattrset(w, attr);
+    pair = owl_fmtext_get_colorpair(fg, bg);
+    _owl_fmtext_wcolor_set(w, pair);
+
+    /* Advance to next non-formatting character. */
+    s = p;
   }
   if (s) {
     waddstr(w, s);
@@ -326,33 +407,25 @@ void owl_fmtext_expand_tabs(const owl_fmtext *in, owl_fmtext *out, int start) {
  */
 int owl_fmtext_truncate_lines(const owl_fmtext *in, int aline, int lines, owl_fmtext *out)
 {
-  const char *ptr1, *ptr2;
-  int i, offset;
+  int i, offset, newline;
   
   /* find the starting line */
-  ptr1 = in->buff->str;
-  for (i = 0; i < aline; i++) {
-    ptr1 = strchr(ptr1, '\n');
-    if (!ptr1) return(-1);
-    ptr1++;
-  }
-  
-  /* ptr1 now holds the starting point */
+  if (aline > (int)in->lines->len) return(-1);
+  offset = aline > 0 ? g_array_index(in->lines, int, aline - 1) + 1 : 0;
 
   /* copy in the next 'lines' lines */
   if (lines < 1) return(-1);
 
   for (i = 0; i < lines; i++) {
-    offset = ptr1 - in->buff->str;
-    ptr2 = strchr(ptr1, '\n');
-    if (!ptr2) {
+    if (aline + i >= (int)in->lines->len) {
       /* Copy to the end of the buffer. */
       _owl_fmtext_append_fmtext(out, in, offset, in->buff->len);
       return(-1);
     }
     /* Copy up to, and including, the new line. */
-    _owl_fmtext_append_fmtext(out, in, offset, (ptr2 - ptr1) + offset + 1);
-    ptr1 = ptr2 + 1;
+    newline = g_array_index(in->lines, int, aline + i);
+    _owl_fmtext_append_fmtext(out, in, offset, newline + 1);
+    offset = newline + 1;
   }
   return(0);
 }
@@ -360,8 +433,9 @@ int owl_fmtext_truncate_lines(const owl_fmtext *in, int aline, int lines, owl_fm
 /* Implementation of owl_fmtext_truncate_cols. Does not support tabs in input. */
 void _owl_fmtext_truncate_cols_internal(const owl_fmtext *in, int acol, int bcol, owl_fmtext *out)
 {
-  const char *ptr_s, *ptr_e, *ptr_c, *last;
+  const char *ptr_s, *ptr_e, *ptr_c, *ptr_f, *last;
   int col, st, padding, chwidth;
+  guint run;
 
   last = in->buff->str + in->buff->len - 1;
   ptr_s = in->buff->str;
@@ -383,10 +457,15 @@ void _owl_fmtext_truncate_cols_internal(const owl_fmtext *in, int acol, int bcol
     padding = 0;
     chwidth = 0;
     ptr_c = ptr_s;
+    /* ptr_f is the next formatting character */
+    run = _owl_fmtext_find_run(in, ptr_s - in->buff->str);
+    ptr_f = run < in->runs->len ? in->buff->str + g_array_index(in->runs, int, run) : last + 1;
     while(ptr_c < ptr_e) {
-      gunichar c = g_utf8_get_char(ptr_c);
-      if (!owl_fmtext_is_format_char(c)) {
-	chwidth = mk_wcwidth(c);
+      if (ptr_c == ptr_f) {
+	run++;
+	ptr_f = run < in->runs->len ? in->buff->str + g_array_index(in->runs, int, run) : last + 1;
+      } else {
+	chwidth = mk_wcwidth(g_utf8_get_char(ptr_c));
 	if (col + chwidth > bcol) break;
 	
 	if (col >= acol) {
@@ -457,27 +536,19 @@ void owl_fmtext_truncate_cols(const owl_fmtext *in, int acol, int bcol, owl_fmte
 /* Return the number of lines in 'f' */
 int owl_fmtext_num_lines(const owl_fmtext *f)
 {
-  int lines, i;
-  char *lastbreak, *p;
+  int lines, trailing, formatting;
+  const char *lastbreak;
 
-  lines=0;
-  lastbreak = f->buff->str;
-  for (i = 0; i < f->buff->len; i++) {
-    if (f->buff->str[i]=='\n') {
-      lastbreak = f->buff->str + i;
-      lines++;
-    }
-  }
+  lines = f->lines->len;
+  lastbreak = lines ? f->buff->str + g_array_index(f->lines, int, lines - 1) : f->buff->str;
 
-  /* Check if there's a trailing line; formatting characters don't count. */
-  for (p = g_utf8_next_char(lastbreak);
-       p < f->buff->str + f->buff->len;
-       p = g_utf8_next_char(p)) {
-    if (!owl_fmtext_is_format_char(g_utf8_get_char(p))) {
-      lines++;
-      break;
-    }
-  }
+  /* Check if there's a trailing line; formatting characters don't
+   * count.  They are all four bytes long, so there is one if the
+   * formatting characters are not all of it. */
+  trailing = f->buff->len - (g_utf8_next_char(lastbreak) - f->buff->str);
+  formatting = f->runs->len - _owl_fmtext_find_run(f, g_utf8_next_char(lastbreak) - f->buff->str);
+  if (trailing > 4 * formatting)
+    lines++;
 
   return(lines);
 }
@@ -489,14 +560,10 @@ int owl_fmtext_num_lines(const owl_fmtext *f)
  * characters are considered on a new line. */
 int owl_fmtext_line_number(const owl_fmtext *f, int offset)
 {
-  int i, lineno = 0;
   if (offset >= f->buff->len)
     offset = f->buff->len - 1;
-  for (i = 0; i < offset; i++) {
-    if (f->buff->str[i] == '\n')
-      lineno++;
-  }
-  return lineno;
+  /* The number of newlines before 'offset' */
+  return _owl_fmtext_find_offset(f->lines, offset);
 }
 
 /* Searches for line 'lineno' in 'f'. The returned range, [start,
@@ -504,14 +571,17 @@ int owl_fmtext_line_number(const owl_fmtext *f, int offset)
 void owl_fmtext_line_extents(const owl_fmtext *f, int lineno, int *o_start, int *o_end)
 {
   int start, end;
-  char *newline;
-  for (start = 0; lineno > 0 && start < f->buff->len; start++) {
-    if (f->buff->str[start] == '\n')
-      lineno--;
+
+  if (lineno < 0)
+    lineno = 0;
+  if (lineno > (int)f->lines->len) {
+    /* Past the last line */
+    start = end = f->buff->len;
+  } else {
+    start = lineno > 0 ? g_array_index(f->lines, int, lineno - 1) + 1 : 0;
+    /* Include the newline, if it is there. */
+    end = lineno < (int)f->lines->len ? g_array_index(f->lines, int, lineno) + 1 : f->buff->len;
   }
-  newline = strchr(f->buff->str + start, '\n');
-  /* Include the newline, if it is there. */
-  end = newline ? newline - f->buff->str + 1 : f->buff->len;
   if (o_start) *o_start = start;
   if (o_end) *o_end = end;
 }
@@ -530,6 +600,10 @@ int owl_fmtext_num_bytes(const owl_fmtext *f)
 void owl_fmtext_copy(owl_fmtext *dst, const owl_fmtext *src)
 {
   dst->buff = g_string_new(src->buff->str);
+  dst->runs = g_array_sized_new(FALSE, FALSE, sizeof(int), src->runs->len);
+  g_array_append_vals(dst->runs, src->runs->data, src->runs->len);
+  dst->lines = g_array_sized_new(FALSE, FALSE, sizeof(int), src->lines->len);
+  g_array_append_vals(dst->lines, src->lines->data, src->lines->len);
 }
 
 /* Search 'f' for the regex 're' for matches starting at
@@ -783,6 +857,10 @@ void owl_fmtext_cleanup(owl_fmtext *f)
 {
   if (f->buff) g_string_free(f->buff, true);
   f->buff = NULL;
+  if (f->runs) g_array_free(f->runs, true);
+  f->runs = NULL;
+  if (f->lines) g_array_free(f->lines, true);
+  f->lines = NULL;
 }
 
 /*** Color Pair manager ***/
@@ -1267,6 +1267,7 @@ void owl_function_full_redisplay(void)
 {
   /* Ask every widget to redraw itself. */
   _dirty_everything(owl_window_get_screen());
+  owl_mainwin_repaint(owl_global_get_mainwin(&g));
   /* Force ncurses to redisplay everything. */
   clearok(stdscr, TRUE);
 }
@@ -1776,6 +1777,12 @@ void owl_function_status(void)
 #endif
   
 
+  owl_fmtext_append_normal(&fm, "\nFormatted Message Cache:\n");
+  owl_message_fmtext_cache_tofmtext(&fm);
+
+  owl_fmtext_append_normal(&fm, "\nScreen Updates:\n");
+  owl_window_redraw_stats_tofmtext(&fm);
+
   owl_fmtext_append_normal(&fm, "\nAIM Status:\n");
   owl_fmtext_append_normal(&fm, "  Logged in: ");
   if (owl_global_is_aimloggedin(&g)) {
@@ -1817,6 +1824,21 @@ void owl_function_show_term(void)
   owl_fmtext_cleanup(&fm);
 }
 
+void owl_function_show_logging(void)
+{
+  owl_fmtext fm;
+  char *policy;
+
+  policy = owl_variable_get_tostring(owl_global_get_vardict(&g), "loggingoverflow");
+  owl_fmtext_init_null(&fm);
+  owl_fmtext_append_bold(&fm, "Logging:\n");
+  owl_fmtext_appendf_normal(&fm, "  Overflow policy    : %s\n", policy);
+  g_free(policy);
+  owl_log_stats_tofmtext(&fm);
+  owl_function_popless_fmtext(&fm);
+  owl_fmtext_cleanup(&fm);
+}
+
 /* if type = 0 then normal reply.
  * if type = 1 then it's a reply to sender
  * if enter = 0 then allow the command to be edited
@@ -2947,6 +2969,7 @@ void owl_function_search_helper(int consider_current, int direction)
   const owl_view *v;
   int viewsize, i, curmsg, start;
   owl_message *m;
+  GArray *candidates;
 
   v=owl_global_get_current_view(&g);
   viewsize=owl_view_get_size(v);
@@ -2971,9 +2994,14 @@ void owl_function_search_helper(int consider_current, int direction)
     return;
   }
 
+  /* Only format and check messages the index says may match */
+  candidates = owl_searchindex_candidates(owl_global_get_search_re(&g));
   for (i=start; i<viewsize && i>=0;) {
     m=owl_view_get_element(v, i);
-    if (owl_message_search(m, owl_global_get_search_re(&g))) {
+    owl_message_index_format(m);
+    if (owl_searchindex_may_match(candidates, m) &&
+        owl_message_search(m, owl_global_get_search_re(&g))) {
+      if (candidates) g_array_free(candidates, TRUE);
       owl_global_set_curmsg(&g, i);
       owl_function_calculate_topmsg(direction);
       owl_mainwin_redisplay(owl_global_get_mainwin(&g));
@@ -2990,11 +3018,13 @@ void owl_function_search_helper(int consider_current, int direction)
       i--;
     }
     if (owl_global_take_interrupt(&g)) {
+      if (candidates) g_array_free(candidates, TRUE);
       owl_function_makemsg("Search interrupted!");
       owl_mainwin_redisplay(owl_global_get_mainwin(&g));
       return;
     }
   }
+  if (candidates) g_array_free(candidates, TRUE);
   owl_mainwin_redisplay(owl_global_get_mainwin(&g));
   owl_function_makemsg("No matches found");
 }
@@ -46,6 +46,7 @@ void owl_global_init(owl_global *g) {
 
   owl_dict_create(&(g->filters));
   g->filterlist = NULL;
+  g->filter_generation = 1;
   owl_list_create(&(g->puntlist));
   g->messagequeue = g_queue_new();
   owl_dict_create(&(g->styledict));
@@ -65,7 +66,8 @@ void owl_global_init(owl_global *g) {
   owl_history_init(&(g->msghist));
   owl_history_init(&(g->cmdhist));
   owl_history_set_norepeats(&(g->cmdhist));
-  g->nextmsgid=0;
+  /* the ids below are for log history, which goes before everything */
+  g->nextmsgid=OWL_LOGHISTORY_MAX_MESSAGES;
 
   /* Fill in some variables which don't have constant defaults */
 
@@ -83,6 +85,7 @@ void owl_global_init(owl_global *g) {
   g_free(cd);
 
   owl_messagelist_create(&(g->msglist));
+  owl_messagelist_enable_indexes(&(g->msglist));
 
   _owl_global_init_windows(g);
 
@@ -554,12 +557,27 @@ void owl_global_add_filter(owl_global *g, owl_filter *f) {
   owl_dict_insert_element(&(g->filters), owl_filter_get_name(f),
                           e, owl_global_delete_filter_ent);
   g->filterlist = g_list_append(g->filterlist, f);
+  owl_global_filters_changed(g);
 }
 
 void owl_global_remove_filter(owl_global *g, const char *name) {
   owl_global_filter_ent *e = owl_dict_remove_element(&(g->filters), name);
-  if (e)
+  if (e) {
     owl_global_delete_filter_ent(e);
+    owl_global_filters_changed(g);
+  }
+}
+
+/* Note that a filter was added, removed or redefined. */
+void owl_global_filters_changed(owl_global *g) {
+  g->filter_generation++;
+}
+
+/* Returns a counter which changes whenever a filter is added,
+ * removed or redefined.  Anything computed from the set of filters
+ * is stale once this moves on. */
+unsigned int owl_global_get_filter_generation(const owl_global *g) {
+  return g->filter_generation;
 }
 
 /* nextmsgid */
@@ -1,5 +1,6 @@
 #include "owl.h"
 #include <stdlib.h>
+#include <string.h>
 
 #define INITSIZE 10
 #define GROWBY 3 / 2
@@ -52,6 +53,18 @@ int owl_list_insert_element(owl_list *l, int at, void *element)
   return(0);
 }
 
+/* Insert the 'n' elements of 'elements' so the first is at 'at' */
+int owl_list_insert_elements(owl_list *l, int at, void *const *elements, int n)
+{
+  if(at < 0 || at > l->size || n < 0) return -1;
+  owl_list_grow(l, n);
+
+  memmove(l->list + at + n, l->list + at, (l->size - at) * sizeof(void *));
+  memcpy(l->list + at, elements, n * sizeof(void *));
+  l->size += n;
+  return(0);
+}
+
 int owl_list_append_element(owl_list *l, void *element)
 {
   return owl_list_insert_element(l, l->size, element);
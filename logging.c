@@ -3,17 +3,67 @@
 #include <string.h>
 #include <ctype.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 typedef struct _owl_log_entry { /* noproto */
   char *filename;
   char *message;
+  int fsync;            /* the loggingfsync variable when logged */
+  int store;            /* 'message' is a record for the message store
+                           in the directory 'filename' */
+  GTimeVal queued;
 } owl_log_entry;
 
+/* A log file, as the logging thread sees it */
+typedef struct _owl_log_file { /* noproto */
+  char *filename;
+  int fd;               /* -1 while closed */
+  GList *link;          /* in log_open_files, while open */
+  dev_t dev;            /* of the file 'fd' is open on */
+  ino_t ino;
+  GPtrArray *pending;   /* entries not yet written */
+  int fsync;
+} owl_log_file;
+
+#define OWL_LOG_IOV_MAX 64
+/* Long enough for any header line in the spill file */
+#define OWL_LOG_SPILL_HEADER 128
 
 static GMainContext *log_context;
 static GMainLoop *log_loop;
 static GThread *logging_thread;
 
+/* These belong to the logging thread */
+static GHashTable *log_files;           /* filename -> owl_log_file */
+static GQueue *log_open_files;          /* most recently used first */
+static GSource *log_flush_source;
+static int log_pending;                 /* entries in all files' pending */
+
+/* The queue from the main thread to the logging thread, and the
+ * counters shown by "show logging", all guarded by log_queue_lock.
+ * Once the ring fills under the spill policy, entries go to
+ * log_spill until the logging thread has caught up with both, so
+ * they are still written in order.
+ */
+static GMutex *log_queue_lock;
+static GCond *log_queue_notfull;
+static owl_log_entry *log_queue[OWL_LOG_QUEUE_SIZE];
+static int log_queue_head, log_queue_count;
+static int log_drain_posted;
+static FILE *log_spill;
+static int log_spill_count;
+
+static struct {
+  guint64 enqueued, written, dropped, spilled, blocked;
+  int maxdepth;
+  guint64 latency_count;
+  double latency_total, latency_max;    /* in seconds */
+} log_stats;
+
 /* This is now the one function that should be called to log a
  * message.  It will do all the work necessary by calling the other
  * functions in this file as necessary.
@@ -32,6 +82,8 @@ void owl_log_message(const owl_message *m) {
     return;
   }
 
+  owl_logstore_append(m);
+
   /* handle incmoing messages */
   if (owl_message_is_direction_in(m)) {
     owl_log_incoming(m);
@@ -92,6 +144,8 @@ char *owl_log_zephyr(const owl_message *m) {
                              owl_message_get_opcode(m));
     }
     g_string_append_printf(buffer, "\n");
+    /* The host is the numeric address if the resolver had not named
+     * it yet when the message was logged */
     g_string_append_printf(buffer, "Time: %s Host: %s\n", 
                            owl_message_get_timestr(m), 
                            owl_message_get_hostname(m));
@@ -149,44 +203,429 @@ static void owl_log_error_main_thread(gpointer data)
   owl_function_error("%s", (const char*)data);
 }
 
-static void owl_log_error(const char *message)
+/* Report a logging error.  May be called from the logging thread. */
+void owl_log_error(const char *message)
 {
   char *data = g_strdup(message);
   owl_select_post_task(owl_log_error_main_thread,
 		       data, g_free, g_main_context_default());
 }
 
-static void owl_log_write_entry(gpointer data)
+static void owl_log_entry_free(void *data)
 {
   owl_log_entry *msg = (owl_log_entry*)data;
-  FILE *file = NULL;
-  file = fopen(msg->filename, "a");
-  if (!file) {
+  if (msg) {
+    g_free(msg->message);
+    g_free(msg->filename);
+    g_free(msg);
+  }
+}
+
+static void owl_log_file_delete(gpointer data)
+{
+  owl_log_file *f = data;
+
+  g_ptr_array_foreach(f->pending, (GFunc)owl_log_entry_free, NULL);
+  g_ptr_array_free(f->pending, TRUE);
+  g_free(f->filename);
+  g_free(f);
+}
+
+static void owl_log_close_file(owl_log_file *f)
+{
+  if (f->fd < 0) return;
+  if (f->fsync == OWL_LOGGING_FSYNC_CLOSE)
+    fsync(f->fd);
+  close(f->fd);
+  f->fd = -1;
+  g_queue_delete_link(log_open_files, f->link);
+  f->link = NULL;
+}
+
+static void owl_log_flush_file(owl_log_file *f);
+
+/* Make sure 'f' is open, closing the least recently used file if too
+ * many are.  A file that has been renamed or removed since it was
+ * opened, as by logrotate, is opened again by name.  Returns 0 if it
+ * cannot be opened. */
+static int owl_log_open_file(owl_log_file *f)
+{
+  owl_log_file *old;
+  struct stat st;
+
+  if (f->fd >= 0) {
+    if (stat(f->filename, &st) == 0 && st.st_dev == f->dev && st.st_ino == f->ino) {
+      g_queue_unlink(log_open_files, f->link);
+      g_queue_push_head_link(log_open_files, f->link);
+      return 1;
+    }
+    owl_log_close_file(f);
+  }
+
+  f->fd = open(f->filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if (f->fd < 0)
+    return 0;
+  if (fstat(f->fd, &st) == 0) {
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+  }
+  g_queue_push_head(log_open_files, f);
+  f->link = g_queue_peek_head_link(log_open_files);
+
+  while (g_queue_get_length(log_open_files) > OWL_LOG_MAX_OPEN_FILES) {
+    old = g_queue_peek_tail(log_open_files);
+    owl_log_flush_file(old);
+    owl_log_close_file(old);
+  }
+  return 1;
+}
+
+/* Write all of 'iov', however much each writev manages */
+static int owl_log_writev_all(int fd, struct iovec *iov, int count)
+{
+  ssize_t n;
+
+  while (count > 0) {
+    n = writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 1;
+}
+
+/* Count 'msg' as written, from when it was queued to 'now'.  Called
+ * with log_queue_lock held. */
+static void owl_log_count_latency(const owl_log_entry *msg, const GTimeVal *now)
+{
+  double latency;
+
+  latency = (now->tv_sec - msg->queued.tv_sec) +
+    (now->tv_usec - msg->queued.tv_usec) / 1e6;
+  log_stats.written++;
+  log_stats.latency_total += latency;
+  log_stats.latency_count++;
+  if (latency > log_stats.latency_max)
+    log_stats.latency_max = latency;
+}
+
+/* Count 'written' entries of 'f' as written, from when they were
+ * queued to now */
+static void owl_log_count_written(const owl_log_file *f, guint written)
+{
+  GTimeVal now;
+  guint i;
+
+  g_get_current_time(&now);
+  g_mutex_lock(log_queue_lock);
+  log_stats.dropped += f->pending->len - written;
+  for (i = 0; i < written; i++)
+    owl_log_count_latency(g_ptr_array_index(f->pending, i), &now);
+  g_mutex_unlock(log_queue_lock);
+}
+
+/* Write out every pending entry for 'f', in as few calls as we can */
+static void owl_log_flush_file(owl_log_file *f)
+{
+  struct iovec iov[OWL_LOG_IOV_MAX];
+  const owl_log_entry *msg;
+  guint i, done = 0, count;
+
+  if (f->pending->len == 0) return;
+
+  if (!owl_log_open_file(f)) {
     owl_log_error("Unable to open file for logging");
+  } else {
+    for (; done < f->pending->len; done += count) {
+      count = MIN(f->pending->len - done, OWL_LOG_IOV_MAX);
+      for (i = 0; i < count; i++) {
+        msg = g_ptr_array_index(f->pending, done + i);
+        iov[i].iov_base = msg->message;
+        iov[i].iov_len = strlen(msg->message);
+      }
+      if (!owl_log_writev_all(f->fd, iov, count)) {
+        owl_log_error("Unable to write to log file");
+        break;
+      }
+    }
+    if (f->fsync == OWL_LOGGING_FSYNC_FLUSH)
+      fsync(f->fd);
+  }
+
+  owl_log_count_written(f, done);
+  log_pending -= f->pending->len;
+  g_ptr_array_foreach(f->pending, (GFunc)owl_log_entry_free, NULL);
+  g_ptr_array_set_size(f->pending, 0);
+}
+
+static gboolean owl_log_flush_one(gpointer key, gpointer value, gpointer data)
+{
+  owl_log_file *f = value;
+
+  owl_log_flush_file(f);
+  /* forget files we have no reason to remember */
+  return f->fd < 0 && f->pending->len == 0;
+}
+
+static void owl_log_flush_all(void)
+{
+  if (log_flush_source) {
+    g_source_destroy(log_flush_source);
+    log_flush_source = NULL;
+  }
+  g_hash_table_foreach_remove(log_files, owl_log_flush_one, NULL);
+}
+
+static gboolean owl_log_flush_timeout(gpointer data)
+{
+  log_flush_source = NULL;
+  owl_log_flush_all();
+  return FALSE;
+}
+
+/* Take 'msg' to be written with any others for its file that arrive
+ * within OWL_LOG_FLUSH_MSECS.  If the disk is slow to take them, stop
+ * gathering and write, so the queue backs up instead of this thread.
+ */
+static void owl_log_write_entry(owl_log_entry *msg)
+{
+  owl_log_file *f;
+  GTimeVal now;
+  int ok;
+
+  /* Records for the message store are not batched */
+  if (msg->store) {
+    ok = owl_logstore_write_record(msg->filename, msg->message);
+    g_get_current_time(&now);
+    g_mutex_lock(log_queue_lock);
+    if (ok)
+      owl_log_count_latency(msg, &now);
+    else
+      log_stats.dropped++;
+    g_mutex_unlock(log_queue_lock);
+    owl_log_entry_free(msg);
     return;
   }
-  fprintf(file, "%s", msg->message);
-  fclose(file);
+
+  f = g_hash_table_lookup(log_files, msg->filename);
+  if (!f) {
+    f = g_new0(owl_log_file, 1);
+    f->filename = g_strdup(msg->filename);
+    f->fd = -1;
+    f->pending = g_ptr_array_new();
+    g_hash_table_insert(log_files, f->filename, f);
+  }
+  g_ptr_array_add(f->pending, msg);
+  f->fsync = msg->fsync;
+  log_pending++;
+
+  if (log_pending >= OWL_LOG_MAX_PENDING) {
+    owl_log_flush_all();
+  } else if (!log_flush_source) {
+    log_flush_source = g_timeout_source_new(OWL_LOG_FLUSH_MSECS);
+    g_source_set_callback(log_flush_source, owl_log_flush_timeout, NULL, NULL);
+    g_source_attach(log_flush_source, log_context);
+    g_source_unref(log_flush_source);
+  }
 }
 
-static void owl_log_entry_free(void *data)
+/* Write 'msg' to the spill file.  Called with log_queue_lock held. */
+static int owl_log_spill_entry(const owl_log_entry *msg)
 {
-  owl_log_entry *msg = (owl_log_entry*)data;
-  if (msg) {
-    g_free(msg->message);
-    g_free(msg->filename);
-    g_free(msg);
+  if (!log_spill) {
+    log_spill = tmpfile();
+    if (!log_spill) return 0;
   }
+  if (fprintf(log_spill, "%ld %ld %d %d %lu %lu\n",
+              (long)msg->queued.tv_sec, (long)msg->queued.tv_usec,
+              msg->fsync, msg->store,
+              (unsigned long)strlen(msg->filename),
+              (unsigned long)strlen(msg->message)) < 0 ||
+      fputs(msg->filename, log_spill) < 0 ||
+      fputs(msg->message, log_spill) < 0)
+    return 0;
+  log_spill_count++;
+  return 1;
 }
 
-void owl_log_enqueue_message(const char *buffer, const char *filename)
+/* Write out the entries in a spill file the main thread is done with */
+static void owl_log_unspill(FILE *spill)
+{
+  owl_log_entry *msg;
+  char head[OWL_LOG_SPILL_HEADER];
+  long sec, usec;
+  unsigned long flen, mlen;
+  int sync, store;
+
+  rewind(spill);
+  /* Read the header line on its own, so that scanning it cannot eat
+   * into the filename after it */
+  while (fgets(head, sizeof(head), spill) &&
+         sscanf(head, "%ld %ld %d %d %lu %lu", &sec, &usec, &sync, &store, &flen, &mlen) == 6) {
+    msg = g_new(owl_log_entry, 1);
+    msg->queued.tv_sec = sec;
+    msg->queued.tv_usec = usec;
+    msg->fsync = sync;
+    msg->store = store;
+    msg->filename = g_malloc0(flen + 1);
+    msg->message = g_malloc0(mlen + 1);
+    if (fread(msg->filename, 1, flen, spill) != flen ||
+        fread(msg->message, 1, mlen, spill) != mlen) {
+      owl_log_entry_free(msg);
+      break;
+    }
+    owl_log_write_entry(msg);
+  }
+  fclose(spill);
+}
+
+/* Take everything the main thread has queued, oldest first */
+static void owl_log_drain(gpointer data)
 {
-  owl_log_entry *log_msg = NULL; 
+  owl_log_entry *msg;
+  FILE *spill;
+
+  while (1) {
+    g_mutex_lock(log_queue_lock);
+    if (log_queue_count == 0) {
+      if (!log_spill) {
+        log_drain_posted = 0;
+        g_mutex_unlock(log_queue_lock);
+        return;
+      }
+      spill = log_spill;
+      log_spill = NULL;
+      log_spill_count = 0;
+      g_mutex_unlock(log_queue_lock);
+      owl_log_unspill(spill);
+      continue;
+    }
+    msg = log_queue[log_queue_head];
+    log_queue_head = (log_queue_head + 1) % OWL_LOG_QUEUE_SIZE;
+    log_queue_count--;
+    g_cond_signal(log_queue_notfull);
+    g_mutex_unlock(log_queue_lock);
+
+    owl_log_write_entry(msg);
+  }
+}
+
+/* Set up the queue and the logging thread's main context.  Entries
+ * logged before the thread starts wait in the queue. */
+static void owl_log_setup(void)
+{
+  if (log_context) return;
+  log_context = g_main_context_new();
+  log_loop = g_main_loop_new(log_context, FALSE);
+  log_files = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                    NULL, owl_log_file_delete);
+  log_open_files = g_queue_new();
+  log_queue_lock = g_mutex_new();
+  log_queue_notfull = g_cond_new();
+  owl_logstore_setup();
+}
+
+static void owl_log_enqueue(const char *buffer, const char *filename, int store)
+{
+  owl_log_entry *log_msg = NULL, *old;
+  int policy, post = 0;
+
+  owl_log_setup();
+
   log_msg = g_new(owl_log_entry,1);
   log_msg->message = g_strdup(buffer);
   log_msg->filename = g_strdup(filename);
-  owl_select_post_task(owl_log_write_entry, log_msg, 
-		       owl_log_entry_free, log_context);
+  log_msg->fsync = owl_global_get_loggingfsync(&g);
+  log_msg->store = store;
+  g_get_current_time(&log_msg->queued);
+
+  policy = owl_global_get_loggingoverflow(&g);
+  /* Nothing would ever make room */
+  if (policy == OWL_LOGGING_OVERFLOW_BLOCK && !logging_thread)
+    policy = OWL_LOGGING_OVERFLOW_DROP;
+
+  g_mutex_lock(log_queue_lock);
+  log_stats.enqueued++;
+
+  if (log_spill || (log_queue_count == OWL_LOG_QUEUE_SIZE &&
+                    policy == OWL_LOGGING_OVERFLOW_SPILL)) {
+    if (owl_log_spill_entry(log_msg))
+      log_stats.spilled++;
+    else
+      log_stats.dropped++;
+    owl_log_entry_free(log_msg);
+    log_msg = NULL;
+  } else if (log_queue_count == OWL_LOG_QUEUE_SIZE) {
+    if (policy == OWL_LOGGING_OVERFLOW_BLOCK) {
+      log_stats.blocked++;
+      while (log_queue_count == OWL_LOG_QUEUE_SIZE)
+        g_cond_wait(log_queue_notfull, log_queue_lock);
+    } else {
+      old = log_queue[log_queue_head];
+      log_queue_head = (log_queue_head + 1) % OWL_LOG_QUEUE_SIZE;
+      log_queue_count--;
+      owl_log_entry_free(old);
+      log_stats.dropped++;
+    }
+  }
+
+  if (log_msg) {
+    log_queue[(log_queue_head + log_queue_count) % OWL_LOG_QUEUE_SIZE] = log_msg;
+    log_queue_count++;
+    if (log_queue_count > log_stats.maxdepth)
+      log_stats.maxdepth = log_queue_count;
+  }
+  if (!log_drain_posted) {
+    log_drain_posted = 1;
+    post = 1;
+  }
+  g_mutex_unlock(log_queue_lock);
+
+  if (post)
+    owl_select_post_task(owl_log_drain, NULL, NULL, log_context);
+}
+
+void owl_log_enqueue_message(const char *buffer, const char *filename)
+{
+  owl_log_enqueue(buffer, filename, 0);
+}
+
+/* Queue 'record', as owl_logstore_format_record makes, to be added to
+ * the message store in 'dir'.  It goes through the same queue as log
+ * entries, so is subject to the same overflow policy. */
+void owl_log_enqueue_store_record(const char *record, const char *dir)
+{
+  owl_log_enqueue(record, dir, 1);
+}
+
+/* Append the logging queue's counters to 'fm' */
+void owl_log_stats_tofmtext(owl_fmtext *fm)
+{
+  owl_log_setup();
+  g_mutex_lock(log_queue_lock);
+  owl_fmtext_appendf_normal(fm, "  Queue depth        : %d of %d (most %d)\n",
+                            log_queue_count, OWL_LOG_QUEUE_SIZE, log_stats.maxdepth);
+  owl_fmtext_appendf_normal(fm, "  In spill file      : %d\n", log_spill_count);
+  owl_fmtext_appendf_normal(fm, "  Entries logged     : %" G_GUINT64_FORMAT "\n", log_stats.enqueued);
+  owl_fmtext_appendf_normal(fm, "  Entries written    : %" G_GUINT64_FORMAT "\n", log_stats.written);
+  owl_fmtext_appendf_normal(fm, "  Entries dropped    : %" G_GUINT64_FORMAT "\n", log_stats.dropped);
+  owl_fmtext_appendf_normal(fm, "  Entries spilled    : %" G_GUINT64_FORMAT "\n", log_stats.spilled);
+  owl_fmtext_appendf_normal(fm, "  Times blocked      : %" G_GUINT64_FORMAT "\n", log_stats.blocked);
+  owl_fmtext_appendf_normal(fm, "  Write latency      : %.1f ms average, %.1f ms most\n",
+                            log_stats.latency_count ?
+                            1000 * log_stats.latency_total / log_stats.latency_count : 0.0,
+                            1000 * log_stats.latency_max);
+  g_mutex_unlock(log_queue_lock);
 }
 
 void owl_log_append(const owl_message *m, const char *filename) {
@@ -427,8 +866,6 @@ void owl_log_incoming(const owl_message *m)
 
 static gpointer owl_log_thread_func(gpointer data)
 {
-  log_context = g_main_context_new();
-  log_loop = g_main_loop_new(log_context, FALSE);
   g_main_loop_run(log_loop);
   return NULL;
 }
@@ -436,6 +873,7 @@ static gpointer owl_log_thread_func(gpointer data)
 void owl_log_init(void) 
 {
   GError *error = NULL;
+  owl_log_setup();
   logging_thread = g_thread_create(owl_log_thread_func,
                                    NULL,
                                    TRUE,
@@ -451,6 +889,12 @@ void owl_log_init(void)
 
 static void owl_log_quit_func(gpointer data)
 {
+  /* Everything logged before we were asked to quit is written first */
+  owl_log_drain(NULL);
+  owl_log_flush_all();
+  while (!g_queue_is_empty(log_open_files))
+    owl_log_close_file(g_queue_peek_head(log_open_files));
+  owl_logstore_close();
   g_main_loop_quit(log_loop);
 }
 
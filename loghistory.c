@@ -0,0 +1,610 @@
+/* Load the last few days of logged messages into the message list at
+ * startup, so that history survives a restart.
+ *
+ * A thread maps the personal "all" log and each class log, finds where
+ * the days wanted begin in each by binary search on their Time: lines,
+ * and merges what follows, newest first.  It makes messages of those
+ * entries and hands them to the main thread a batch at a time.  Each
+ * batch goes just before the one before it, so recent history shows up
+ * first and the message list stays in order of id; history takes its
+ * ids, counting down, from a block set aside before any message is
+ * made, so it sorts before the messages made at startup too.
+ */
+
+#include "owl.h"
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define OWL_LOGHISTORY_ZEPHYR   1       /* from owl_log_zephyr */
+#define OWL_LOGHISTORY_GENERIC  2       /* from owl_log_generic and friends */
+#define OWL_LOGHISTORY_OTHER    3       /* an error, say; skipped */
+
+typedef struct _owl_loghistory_file { /* noproto */
+  const char *map;
+  size_t len;
+  int personal;
+} owl_loghistory_file;
+
+typedef struct _owl_loghistory_entry { /* noproto */
+  time_t time;
+  const owl_loghistory_file *file;
+  size_t offset;
+  size_t length;
+  int kind;
+} owl_loghistory_entry;
+
+typedef struct _owl_loghistory_job { /* noproto */
+  char *logpath;
+  char *classlogpath;
+  char *sender;         /* our zephyr sender, with realm */
+  char *realm;
+  time_t since;
+} owl_loghistory_job;
+
+static GThread *loghistory_thread;
+static GMutex *loghistory_lock;
+static GCond *loghistory_taken;
+static int loghistory_inflight;         /* batches posted but not yet added */
+static int loghistory_cancelled;
+
+/* The main thread's: the id below the oldest history added so far */
+static int loghistory_nextid;
+
+static void owl_loghistory_job_delete(owl_loghistory_job *job)
+{
+  g_free(job->logpath);
+  g_free(job->classlogpath);
+  g_free(job->sender);
+  g_free(job->realm);
+  g_free(job);
+}
+
+static void owl_loghistory_batch_delete(void *data)
+{
+  GPtrArray *batch = data;
+
+  g_ptr_array_foreach(batch, (GFunc)owl_message_delete, NULL);
+  g_ptr_array_free(batch, TRUE);
+}
+
+/* Parse the ctime-style time at 'p', if there is one */
+static int owl_loghistory_parse_time(const char *p, size_t len, time_t *t)
+{
+  char buf[32];
+  struct tm tm;
+  const char *end;
+
+  if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+  memcpy(buf, p, len);
+  buf[len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(buf, "%a %b %d %T %Y", &tm);
+  if (!end) return 0;
+  tm.tm_isdst = -1;
+  *t = mktime(&tm);
+  return 1;
+}
+
+static int owl_loghistory_has_prefix(const char *map, size_t len, size_t pos, const char *prefix)
+{
+  size_t n = strlen(prefix);
+  return pos + n <= len && !memcmp(map + pos, prefix, n);
+}
+
+static size_t owl_loghistory_next_line(const char *map, size_t len, size_t pos)
+{
+  const char *nl = memchr(map + pos, '\n', len - pos);
+  return nl ? nl + 1 - map : len;
+}
+
+/* If an entry starts at 'pos', return what kind, and set *t to its
+ * time.  Otherwise return 0.  Every entry ends with a blank line, so
+ * entries start only after one. */
+static int owl_loghistory_entry_kind(const char *map, size_t len, size_t pos, time_t *t)
+{
+  size_t timeline;
+  int kind;
+
+  if (pos > 0 && (pos < 2 || map[pos - 1] != '\n' || map[pos - 2] != '\n'))
+    return 0;
+  if (owl_loghistory_has_prefix(map, len, pos, "Class: "))
+    kind = OWL_LOGHISTORY_ZEPHYR;
+  else if (owl_loghistory_has_prefix(map, len, pos, "From: <"))
+    kind = OWL_LOGHISTORY_GENERIC;
+  else if (owl_loghistory_has_prefix(map, len, pos, "ERROR (owl): "))
+    return OWL_LOGHISTORY_OTHER;
+  else
+    return 0;
+
+  timeline = owl_loghistory_next_line(map, len, pos);
+  if (!owl_loghistory_has_prefix(map, len, timeline, "Time: ") ||
+      !owl_loghistory_parse_time(map + timeline + 6, len - timeline - 6, t))
+    return 0;
+  return kind;
+}
+
+/* Return the start of the first entry at or after 'pos' that has a
+ * time, or 'len' if there is none */
+static size_t owl_loghistory_next_entry(const char *map, size_t len, size_t pos, time_t *t)
+{
+  int kind;
+
+  if (pos > 0 && map[pos - 1] != '\n')
+    pos = owl_loghistory_next_line(map, len, pos);
+  for (; pos < len; pos = owl_loghistory_next_line(map, len, pos)) {
+    kind = owl_loghistory_entry_kind(map, len, pos, t);
+    if (kind == OWL_LOGHISTORY_ZEPHYR || kind == OWL_LOGHISTORY_GENERIC)
+      break;
+  }
+  return pos;
+}
+
+/* Map 'filename' and add its entries from 'since' on to 'entries' */
+static void owl_loghistory_scan_file(const char *filename, int personal, time_t since, GPtrArray *files, GArray *entries)
+{
+  owl_loghistory_file *file;
+  owl_loghistory_entry e;
+  struct stat st;
+  const char *map;
+  size_t len, lo, hi, mid, start, pos;
+  time_t t, next = 0;
+  int fd, kind;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) return;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  len = st.st_size;
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return;
+
+  file = g_new(owl_loghistory_file, 1);
+  file->map = map;
+  file->len = len;
+  file->personal = personal;
+  g_ptr_array_add(files, file);
+
+  /* Logs are appended to in order, so find the first entry of the
+   * window without reading what comes before it */
+  lo = 0;
+  hi = len;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    start = owl_loghistory_next_entry(map, len, mid, &t);
+    if (start == len || t >= since)
+      hi = mid;
+    else
+      lo = start + 1;
+  }
+
+  pos = owl_loghistory_next_entry(map, len, lo, &t);
+  kind = pos < len ? owl_loghistory_entry_kind(map, len, pos, &t) : 0;
+  while (pos < len) {
+    /* This entry runs to the start of the next, of whatever kind */
+    start = pos;
+    e.kind = kind;
+    e.time = t;
+    do {
+      pos = owl_loghistory_next_line(map, len, pos);
+      kind = pos < len ? owl_loghistory_entry_kind(map, len, pos, &next) : 0;
+    } while (pos < len && !kind);
+
+    if (e.kind == OWL_LOGHISTORY_ZEPHYR || e.kind == OWL_LOGHISTORY_GENERIC) {
+      e.file = file;
+      e.offset = start;
+      e.length = pos - start;
+      g_array_append_val(entries, e);
+    }
+    t = next;
+  }
+}
+
+static gint owl_loghistory_entry_cmp(gconstpointer a, gconstpointer b)
+{
+  const owl_loghistory_entry *ea = a, *eb = b;
+
+  /* newest first */
+  if (ea->time != eb->time)
+    return ea->time < eb->time ? 1 : -1;
+  if (ea->file == eb->file && ea->offset != eb->offset)
+    return ea->offset < eb->offset ? 1 : -1;
+  return 0;
+}
+
+/* Return the line of 'text' starting at *p, and move *p past it */
+static char *owl_loghistory_take_line(char **p)
+{
+  char *line = *p, *nl;
+
+  nl = strchr(line, '\n');
+  if (nl) {
+    *nl = '\0';
+    *p = nl + 1;
+  } else {
+    *p = line + strlen(line);
+  }
+  return line;
+}
+
+static void owl_loghistory_set_time(owl_message *m, time_t t, const char *timestr)
+{
+  m->time = t;
+  g_free(m->timestr);
+  m->timestr = g_strdup(timestr);
+}
+
+/* Make a message of a zephyr entry:
+ *
+ *   Class: <class> Instance: <instance>[ Opcode: <opcode>]
+ *   Time: <time> Host: <host>
+ *   From: <zsig> <<sender>>
+ *
+ *   <body>
+ */
+static owl_message *owl_loghistory_parse_zephyr(const owl_loghistory_job *job, const owl_loghistory_entry *e, char *text)
+{
+  owl_message *m;
+  char *p = text, *line, *field, *end, *lt, *sender;
+
+  m = g_new(owl_message, 1);
+#ifdef HAVE_LIBZEPHYR
+  /* There is no notice behind it */
+  memset(&(m->notice), 0, sizeof(ZNotice_t));
+#endif
+  owl_message_init_without_id(m);
+  owl_message_set_type_zephyr(m);
+  owl_message_set_attribute(m, "pseudo", "");
+
+  line = owl_loghistory_take_line(&p) + strlen("Class: ");
+  field = strstr(line, " Instance: ");
+  if (!field) goto bad;
+  *field = '\0';
+  owl_message_set_class(m, line);
+  line = field + strlen(" Instance: ");
+  field = strstr(line, " Opcode: ");
+  if (field) {
+    *field = '\0';
+    owl_message_set_opcode(m, field + strlen(" Opcode: "));
+  } else {
+    owl_message_set_opcode(m, "");
+  }
+  owl_message_set_instance(m, line);
+
+  line = owl_loghistory_take_line(&p) + strlen("Time: ");
+  field = strstr(line, " Host: ");
+  if (!field) goto bad;
+  *field = '\0';
+  owl_loghistory_set_time(m, e->time, line);
+  owl_message_set_hostname(m, field + strlen(" Host: "));
+
+  /* The zsig may run over several lines */
+  if (strncmp(p, "From: ", 6)) goto bad;
+  end = strstr(p, ">\n\n");
+  if (!end) goto bad;
+  *end = '\0';
+  lt = strrchr(p, '<');
+  if (!lt) goto bad;
+  *lt = '\0';
+  if (lt > p + 6 && lt[-1] == ' ')
+    lt[-1] = '\0';
+  owl_message_set_zsig(m, p + 6);
+  if (strchr(lt + 1, '@') || !*job->realm)
+    sender = g_strdup(lt + 1);
+  else
+    sender = g_strdup_printf("%s@%s", lt + 1, job->realm);
+  owl_message_set_sender(m, sender);
+  owl_message_set_body(m, end + 3);
+
+  if (!strcasecmp(sender, job->sender)) {
+    owl_message_set_direction_out(m);
+    owl_message_set_recipient(m, "");
+  } else {
+    owl_message_set_direction_in(m);
+    if (e->file->personal) {
+      owl_message_set_recipient(m, job->sender);
+      owl_message_set_isprivate(m);
+    } else {
+      owl_message_set_recipient(m, "");
+    }
+  }
+  g_free(sender);
+  return m;
+
+ bad:
+  owl_message_delete(m);
+  return NULL;
+}
+
+/* Make a message of any other entry:
+ *
+ *   From: <<sender>> To: <<recipient>>
+ *   Time: <time>
+ *
+ *   <body>
+ */
+static owl_message *owl_loghistory_parse_generic(const owl_loghistory_entry *e, char *text)
+{
+  owl_message *m;
+  char *p = text, *line, *field, *end;
+
+  m = g_new(owl_message, 1);
+  owl_message_init_without_id(m);
+  owl_message_set_type(m, "generic");
+  owl_message_set_direction_in(m);
+
+  line = owl_loghistory_take_line(&p) + strlen("From: <");
+  field = strstr(line, "> To: <");
+  end = strrchr(line, '>');
+  if (!field || end <= field) goto bad;
+  *field = '\0';
+  *end = '\0';
+  owl_message_set_sender(m, line);
+  owl_message_set_recipient(m, field + strlen("> To: <"));
+
+  line = owl_loghistory_take_line(&p) + strlen("Time: ");
+  owl_loghistory_set_time(m, e->time, line);
+  if (*p != '\n') goto bad;
+  owl_message_set_body(m, p + 1);
+  return m;
+
+ bad:
+  owl_message_delete(m);
+  return NULL;
+}
+
+static owl_message *owl_loghistory_parse_entry(const owl_loghistory_job *job, const owl_loghistory_entry *e)
+{
+  owl_message *m;
+  char *text;
+  size_t len = e->length;
+
+  /* Drop the blank line that ends every entry */
+  if (len >= 2 && !memcmp(e->file->map + e->offset + len - 2, "\n\n", 2))
+    len -= 2;
+  text = g_strndup(e->file->map + e->offset, len);
+  if (e->kind == OWL_LOGHISTORY_ZEPHYR)
+    m = owl_loghistory_parse_zephyr(job, e, text);
+  else
+    m = owl_loghistory_parse_generic(e, text);
+  g_free(text);
+  return m;
+}
+
+/* Runs on the main thread with a batch of messages, newest first */
+static void owl_loghistory_add_batch(void *data)
+{
+  GPtrArray *batch = data;
+  owl_view *v = owl_global_get_current_view(&g);
+  owl_message **msgs, *m;
+  int i, n = 0, before, added, at, offset;
+
+  g_mutex_lock(loghistory_lock);
+  loghistory_inflight--;
+  g_cond_signal(loghistory_taken);
+  g_mutex_unlock(loghistory_lock);
+
+  msgs = g_new(owl_message *, batch->len);
+  for (i = batch->len - 1; i >= 0; i--) {
+    m = g_ptr_array_index(batch, i);
+    if (owl_global_message_is_puntable(&g, m)) {
+      owl_message_delete(m);
+      continue;
+    }
+    msgs[n++] = m;
+  }
+  g_ptr_array_set_size(batch, 0);
+
+  /* Oldest first, all older than what we have added so far */
+  for (i = 0; i < n; i++) {
+    owl_message_set_id(msgs[i], loghistory_nextid - n + i);
+    owl_searchindex_add_message(msgs[i]);
+    owl_message_index_format(msgs[i]);
+  }
+  loghistory_nextid -= n;
+  owl_messagelist_insert_elements(owl_global_get_msglist(&g), msgs, n);
+
+  before = owl_view_get_size(v);
+  added = owl_view_consider_messages(v, msgs, n, &at);
+  if (added) {
+    if (before == 0) {
+      /* Start on the newest, as if it had just arrived; later batches
+       * go before it */
+      owl_global_set_curmsg(&g, added - 1);
+      owl_function_calculate_topmsg(OWL_DIRECTION_DOWNWARDS);
+    } else {
+      /* Stay on the messages we were looking at */
+      if (at <= owl_global_get_curmsg(&g)) {
+        offset = owl_global_get_curmsg_vert_offset(&g);
+        owl_global_set_curmsg(&g, owl_global_get_curmsg(&g) + added);
+        owl_global_set_curmsg_vert_offset(&g, offset);
+      }
+      if (at <= owl_global_get_topmsg(&g))
+        owl_global_set_topmsg(&g, owl_global_get_topmsg(&g) + added);
+    }
+    owl_mainwin_redisplay(owl_global_get_mainwin(&g));
+  }
+  g_free(msgs);
+}
+
+/* Hand 'batch' to the main thread, once it has taken the last one, so
+ * that it is never asked to do much at once */
+static int owl_loghistory_post_batch(GPtrArray *batch)
+{
+  int cancelled;
+
+  g_mutex_lock(loghistory_lock);
+  while (loghistory_inflight > 0 && !loghistory_cancelled)
+    g_cond_wait(loghistory_taken, loghistory_lock);
+  cancelled = loghistory_cancelled;
+  if (!cancelled)
+    loghistory_inflight++;
+  g_mutex_unlock(loghistory_lock);
+
+  if (cancelled) {
+    owl_loghistory_batch_delete(batch);
+    return 0;
+  }
+  owl_select_post_task(owl_loghistory_add_batch, batch, owl_loghistory_batch_delete, NULL);
+  return 1;
+}
+
+/* Find the entries of 'job' in the logs, newest first, mapping the
+ * files they are in onto 'files' */
+static GArray *owl_loghistory_scan(const owl_loghistory_job *job, GPtrArray *files)
+{
+  GArray *entries;
+  struct dirent *d;
+  DIR *dir;
+  char *path;
+
+  entries = g_array_new(FALSE, FALSE, sizeof(owl_loghistory_entry));
+
+  path = g_strdup_printf("%s/all", job->logpath);
+  owl_loghistory_scan_file(path, 1, job->since, files, entries);
+  g_free(path);
+
+  dir = opendir(job->classlogpath);
+  if (dir) {
+    while ((d = readdir(dir)) != NULL) {
+      if (d->d_name[0] == '.') continue;
+      path = g_strdup_printf("%s/%s", job->classlogpath, d->d_name);
+      owl_loghistory_scan_file(path, 0, job->since, files, entries);
+      g_free(path);
+    }
+    closedir(dir);
+  }
+
+  g_array_sort(entries, owl_loghistory_entry_cmp);
+  return entries;
+}
+
+static void owl_loghistory_unmap(GPtrArray *files)
+{
+  owl_loghistory_file *file;
+  guint i;
+
+  for (i = 0; i < files->len; i++) {
+    file = g_ptr_array_index(files, i);
+    munmap((void *)file->map, file->len);
+    g_free(file);
+  }
+  g_ptr_array_free(files, TRUE);
+}
+
+static gpointer owl_loghistory_thread_func(gpointer data)
+{
+  owl_loghistory_job *job = data;
+  GPtrArray *files, *batch = NULL;
+  GArray *entries;
+  owl_message *m;
+  guint i, n;
+
+  files = g_ptr_array_new();
+  entries = owl_loghistory_scan(job, files);
+
+  n = MIN(entries->len, OWL_LOGHISTORY_MAX_MESSAGES);
+  for (i = 0; i < n; i++) {
+    m = owl_loghistory_parse_entry(job, &g_array_index(entries, owl_loghistory_entry, i));
+    if (!m) continue;
+    if (!batch)
+      batch = g_ptr_array_new();
+    g_ptr_array_add(batch, m);
+    if (batch->len == OWL_LOGHISTORY_BATCH_SIZE) {
+      if (!owl_loghistory_post_batch(batch)) {
+        batch = NULL;
+        break;
+      }
+      batch = NULL;
+    }
+  }
+  if (batch)
+    owl_loghistory_post_batch(batch);
+
+  owl_loghistory_unmap(files);
+  g_array_free(entries, TRUE);
+  owl_loghistory_job_delete(job);
+  return NULL;
+}
+
+/* Return messages of the entries from 'since' on in the logs under
+ * 'logpath' and 'classlogpath', newest first, as the history thread
+ * makes them but in the calling thread.  'sender' is our zephyr
+ * sender.  The caller must free the array and its messages. */
+GPtrArray *owl_loghistory_read(const char *logpath, const char *classlogpath, const char *sender, const char *realm, time_t since)
+{
+  owl_loghistory_job job;
+  GPtrArray *files, *msgs;
+  GArray *entries;
+  owl_message *m;
+  guint i;
+
+  job.logpath = (char *)logpath;
+  job.classlogpath = (char *)classlogpath;
+  job.sender = (char *)sender;
+  job.realm = (char *)realm;
+  job.since = since;
+
+  files = g_ptr_array_new();
+  entries = owl_loghistory_scan(&job, files);
+  msgs = g_ptr_array_new();
+  for (i = 0; i < entries->len; i++) {
+    m = owl_loghistory_parse_entry(&job, &g_array_index(entries, owl_loghistory_entry, i));
+    if (m)
+      g_ptr_array_add(msgs, m);
+  }
+  owl_loghistory_unmap(files);
+  g_array_free(entries, TRUE);
+  return msgs;
+}
+
+/* Start loading the last 'loghistorydays' days of logs, if that is
+ * more than none */
+void owl_loghistory_init(void)
+{
+  owl_loghistory_job *job;
+  GError *error = NULL;
+  int days = owl_global_get_loghistorydays(&g);
+
+  if (days <= 0) return;
+
+  job = g_new(owl_loghistory_job, 1);
+  job->logpath = owl_util_makepath(owl_global_get_logpath(&g));
+  job->classlogpath = owl_util_makepath(owl_global_get_classlogpath(&g));
+  job->sender = g_strdup(owl_zephyr_get_sender());
+  job->realm = g_strdup(owl_zephyr_get_realm());
+  job->since = time(NULL) - (time_t)days * 24 * 60 * 60;
+
+  /* owl_global_init keeps the ids below this for us */
+  loghistory_nextid = OWL_LOGHISTORY_MAX_MESSAGES;
+  loghistory_lock = g_mutex_new();
+  loghistory_taken = g_cond_new();
+  loghistory_thread = g_thread_create(owl_loghistory_thread_func,
+                                      job,
+                                      TRUE,
+                                      &error);
+  if (error) {
+    owl_function_error("Error spawning log history thread: %s", error->message);
+    g_error_free(error);
+    owl_loghistory_job_delete(job);
+    loghistory_thread = NULL;
+  }
+}
+
+void owl_loghistory_shutdown(void)
+{
+  if (!loghistory_thread) return;
+  g_mutex_lock(loghistory_lock);
+  loghistory_cancelled = 1;
+  g_cond_signal(loghistory_taken);
+  g_mutex_unlock(loghistory_lock);
+  g_thread_join(loghistory_thread);
+  loghistory_thread = NULL;
+}
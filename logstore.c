@@ -0,0 +1,903 @@
+/* An optional store of logged messages, kept beside the text logs so
+ * that history can be searched without reading through them.
+ *
+ * messages.dat is an append-only segment of records, each a header
+ * line with the message's time and the lengths of its fields,
+ * followed by the fields themselves.  messages.idx has a line for
+ * each record giving its offset and length in messages.dat, its time,
+ * sender, class and instance, and the distinct words of its body.
+ *
+ * Records are built on the main thread and go through the logging
+ * queue, so the logging thread writes them in order with everything
+ * else.  Whichever thread first needs the store reads the index into
+ * memory, and the logging thread keeps it up to date as records are
+ * added.  Searches run on a thread of their own and are answered from
+ * the index, reading only the records that match; they hold the lock
+ * on the store only while picking out records, so a long search does
+ * not hold up logging.
+ */
+
+#include "owl.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define OWL_LOGSTORE_FIELD_TYPE       0
+#define OWL_LOGSTORE_FIELD_DIRECTION  1
+#define OWL_LOGSTORE_FIELD_SENDER     2
+#define OWL_LOGSTORE_FIELD_RECIPIENT  3
+#define OWL_LOGSTORE_FIELD_CLASS      4
+#define OWL_LOGSTORE_FIELD_INSTANCE   5
+#define OWL_LOGSTORE_FIELD_OPCODE     6
+#define OWL_LOGSTORE_FIELD_HOST       7
+#define OWL_LOGSTORE_FIELD_BODY       8
+#define OWL_LOGSTORE_NUM_FIELDS       9
+
+/* Long enough for any record's header line */
+#define OWL_LOGSTORE_MAX_HEADER     256
+/* How much of messages.idx is read at a time */
+#define OWL_LOGSTORE_READ_CHUNK     65536
+/* Records a search picks out each time it takes the lock */
+#define OWL_LOGSTORE_SEARCH_CHUNK   256
+/* Records whose range of times is kept together, so that a search by
+ * time alone can pass over most of them */
+#define OWL_LOGSTORE_BLOCK_SIZE     256
+
+typedef struct _owl_logstore_record { /* noproto */
+  gint64 time;
+  char *fields[OWL_LOGSTORE_NUM_FIELDS];
+} owl_logstore_record;
+
+/* Where a record is, and enough to check a time range without it */
+typedef struct _owl_logstore_ref { /* noproto */
+  guint64 offset;
+  guint32 length;
+  gint64 time;
+} owl_logstore_ref;
+
+typedef struct _owl_logstore_block { /* noproto */
+  gint64 min, max;
+} owl_logstore_block;
+
+typedef struct _owl_logstore_query { /* noproto */
+  char *dir;
+  char *sender;         /* as given, or NULL */
+  char *class;
+  char *instance;
+  gint64 after;         /* 0 for no bound */
+  gint64 before;
+  GPtrArray *terms;
+  GPtrArray *results;   /* of owl_logstore_record, newest first */
+  int truncated;
+} owl_logstore_query;
+
+/* The open store, guarded by store_lock */
+static GMutex *store_lock;
+static unsigned int store_generation;   /* changes when it is closed */
+static char *store_dir;
+static int store_data_fd = -1;
+static int store_index_fd = -1;
+static GArray *store_refs;              /* owl_logstore_ref, by record number */
+static GArray *store_blocks;            /* owl_logstore_block */
+static GHashTable *store_senders;       /* key -> GArray of record numbers */
+static GHashTable *store_classes;
+static GHashTable *store_instances;
+static GHashTable *store_terms;
+
+static GMainContext *search_context;
+static GMainLoop *search_loop;
+static GThread *search_thread;
+
+static void owl_logstore_record_delete(void *data)
+{
+  owl_logstore_record *r = data;
+  int i;
+
+  if (!r) return;
+  for (i = 0; i < OWL_LOGSTORE_NUM_FIELDS; i++)
+    g_free(r->fields[i]);
+  g_free(r);
+}
+
+static void owl_logstore_query_delete(void *data)
+{
+  owl_logstore_query *q = data;
+
+  g_free(q->dir);
+  g_free(q->sender);
+  g_free(q->class);
+  g_free(q->instance);
+  g_ptr_array_foreach(q->terms, (GFunc)g_free, NULL);
+  g_ptr_array_free(q->terms, TRUE);
+  g_ptr_array_foreach(q->results, (GFunc)owl_logstore_record_delete, NULL);
+  g_ptr_array_free(q->results, TRUE);
+  g_free(q);
+}
+
+static void owl_logstore_postings_delete(gpointer data)
+{
+  g_array_free(data, TRUE);
+}
+
+/* The form of 'value' that is indexed: lowercase, without tabs or
+ * newlines, and for senders, without a realm. */
+static char *owl_logstore_key(const char *value, int strip_realm)
+{
+  char *key, *p;
+
+  key = g_utf8_strdown(value ? value : "", -1);
+  if (strip_realm && (p = strchr(key, '@')) != NULL)
+    *p = '\0';
+  for (p = key; *p; p++)
+    if (*p == '\t' || *p == '\n')
+      *p = ' ';
+  return key;
+}
+
+/* Return the distinct words of 'body', lowercased, as an array of
+ * newly allocated strings.  A word is a run of letters and digits
+ * (counting any non-ASCII character as a letter) at least two bytes
+ * long. */
+GPtrArray *owl_logstore_body_terms(const char *body)
+{
+  GPtrArray *terms = g_ptr_array_new();
+  GHashTable *seen;
+  char *lower, *p, *start;
+
+  seen = g_hash_table_new(g_str_hash, g_str_equal);
+  lower = g_utf8_strdown(body ? body : "", -1);
+  for (p = lower; *p; ) {
+    while (*p && !(g_ascii_isalnum(*p) || (unsigned char)*p >= 0x80))
+      p++;
+    start = p;
+    while (*p && (g_ascii_isalnum(*p) || (unsigned char)*p >= 0x80))
+      p++;
+    if (p - start < 2) continue;
+    start = g_strndup(start, p - start);
+    if (g_hash_table_lookup(seen, start)) {
+      g_free(start);
+    } else {
+      g_hash_table_insert(seen, start, start);
+      g_ptr_array_add(terms, start);
+    }
+  }
+  g_free(lower);
+  g_hash_table_destroy(seen);
+  return terms;
+}
+
+static void owl_logstore_postings_add(GHashTable *table, const char *key, guint32 recno)
+{
+  GArray *postings;
+
+  postings = g_hash_table_lookup(table, key);
+  if (!postings) {
+    postings = g_array_new(FALSE, FALSE, sizeof(guint32));
+    g_hash_table_insert(table, g_strdup(key), postings);
+  }
+  g_array_append_val(postings, recno);
+}
+
+/* Add a record to the in-memory index.  'keys' is its sender, class
+ * and instance keys, then its body terms. */
+static void owl_logstore_index_add(const owl_logstore_ref *ref, char **keys, int nkeys)
+{
+  guint32 recno = store_refs->len;
+  owl_logstore_block *b, nb;
+  int i;
+
+  g_array_append_val(store_refs, *ref);
+  if (recno % OWL_LOGSTORE_BLOCK_SIZE == 0) {
+    nb.min = nb.max = ref->time;
+    g_array_append_val(store_blocks, nb);
+  } else {
+    b = &g_array_index(store_blocks, owl_logstore_block, store_blocks->len - 1);
+    b->min = MIN(b->min, ref->time);
+    b->max = MAX(b->max, ref->time);
+  }
+  owl_logstore_postings_add(store_senders, keys[0], recno);
+  owl_logstore_postings_add(store_classes, keys[1], recno);
+  owl_logstore_postings_add(store_instances, keys[2], recno);
+  for (i = 3; i < nkeys; i++)
+    if (*keys[i])
+      owl_logstore_postings_add(store_terms, keys[i], recno);
+}
+
+/* Parse one line of messages.idx, without its newline */
+static int owl_logstore_index_parse(char *line)
+{
+  owl_logstore_ref ref;
+  char **parts, **words, **keys;
+  char *end;
+  int i, n, ok = 0;
+
+  ref.offset = g_ascii_strtoull(line, &end, 10);
+  if (*end != ' ') return 0;
+  ref.length = strtoul(end + 1, &end, 10);
+  if (*end != ' ') return 0;
+  ref.time = g_ascii_strtoll(end + 1, &end, 10);
+  if (*end != '\t') return 0;
+
+  parts = g_strsplit(end + 1, "\t", 4);
+  if (g_strv_length(parts) == 4) {
+    words = g_strsplit(parts[3], " ", 0);
+    n = g_strv_length(words);
+    keys = g_new(char *, n + 3);
+    for (i = 0; i < 3; i++)
+      keys[i] = parts[i];
+    for (i = 0; i < n; i++)
+      keys[i + 3] = words[i];
+    owl_logstore_index_add(&ref, keys, n + 3);
+    g_free(keys);
+    g_strfreev(words);
+    ok = 1;
+  }
+  g_strfreev(parts);
+  return ok;
+}
+
+static int owl_logstore_write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Index the record 'r' at 'offset', in memory and in messages.idx */
+static int owl_logstore_index_record(const owl_logstore_record *r, guint64 offset, guint32 length)
+{
+  owl_logstore_ref ref;
+  GPtrArray *terms;
+  GString *line;
+  char **keys;
+  guint i;
+  int ok;
+
+  ref.offset = offset;
+  ref.length = length;
+  ref.time = r->time;
+
+  terms = owl_logstore_body_terms(r->fields[OWL_LOGSTORE_FIELD_BODY]);
+  keys = g_new(char *, terms->len + 3);
+  keys[0] = owl_logstore_key(r->fields[OWL_LOGSTORE_FIELD_SENDER], 1);
+  keys[1] = owl_logstore_key(r->fields[OWL_LOGSTORE_FIELD_CLASS], 0);
+  keys[2] = owl_logstore_key(r->fields[OWL_LOGSTORE_FIELD_INSTANCE], 0);
+  for (i = 0; i < terms->len; i++)
+    keys[i + 3] = g_ptr_array_index(terms, i);
+
+  line = g_string_new("");
+  g_string_append_printf(line, "%" G_GUINT64_FORMAT " %u %" G_GINT64_FORMAT "\t%s\t%s\t%s\t",
+                         ref.offset, ref.length, ref.time, keys[0], keys[1], keys[2]);
+  for (i = 0; i < terms->len; i++) {
+    if (i) g_string_append_c(line, ' ');
+    g_string_append(line, keys[i + 3]);
+  }
+  g_string_append_c(line, '\n');
+  ok = owl_logstore_write_all(store_index_fd, line->str, line->len);
+  if (ok)
+    owl_logstore_index_add(&ref, keys, terms->len + 3);
+
+  g_string_free(line, TRUE);
+  for (i = 0; i < 3; i++)
+    g_free(keys[i]);
+  g_free(keys);
+  g_ptr_array_foreach(terms, (GFunc)g_free, NULL);
+  g_ptr_array_free(terms, TRUE);
+  return ok;
+}
+
+/* Parse the record at the start of 'buf', which holds 'len' bytes,
+ * and set *used to its length.  If 'buf' holds only part of it,
+ * return NULL, with *used still set if the header was there. */
+static owl_logstore_record *owl_logstore_record_parse(const char *buf, size_t len, size_t *used)
+{
+  owl_logstore_record *r;
+  const char *nl, *p;
+  char *end;
+  size_t lengths[OWL_LOGSTORE_NUM_FIELDS], total;
+  gint64 time;
+  int i;
+
+  *used = 0;
+  nl = memchr(buf, '\n', MIN(len, OWL_LOGSTORE_MAX_HEADER));
+  if (!nl) return NULL;
+
+  time = g_ascii_strtoll(buf, &end, 10);
+  total = nl + 1 - buf;
+  for (i = 0; i < OWL_LOGSTORE_NUM_FIELDS; i++) {
+    if (*end != ' ') return NULL;
+    lengths[i] = strtoul(end + 1, &end, 10);
+    total += lengths[i];
+  }
+  if (end != nl) return NULL;
+  *used = total;
+  if (total > len) return NULL;
+
+  r = g_new(owl_logstore_record, 1);
+  r->time = time;
+  p = nl + 1;
+  for (i = 0; i < OWL_LOGSTORE_NUM_FIELDS; i++) {
+    r->fields[i] = g_strndup(p, lengths[i]);
+    p += lengths[i];
+  }
+  return r;
+}
+
+static owl_logstore_record *owl_logstore_read_record(int fd, const owl_logstore_ref *ref)
+{
+  owl_logstore_record *r = NULL;
+  char *buf;
+  size_t used;
+
+  buf = g_malloc(ref->length);
+  if (pread(fd, buf, ref->length, ref->offset) == (ssize_t)ref->length)
+    r = owl_logstore_record_parse(buf, ref->length, &used);
+  g_free(buf);
+  return r;
+}
+
+/* Index any records written to messages.dat after the last one in
+ * messages.idx, as happens if we stopped between writing the two.  A
+ * record cut off partway is removed. */
+static void owl_logstore_catch_up(void)
+{
+  owl_logstore_record *r;
+  const owl_logstore_ref *last;
+  struct stat st;
+  guint64 offset = 0;
+  char head[OWL_LOGSTORE_MAX_HEADER];
+  char *buf;
+  size_t used, len;
+  ssize_t n;
+
+  if (store_refs->len > 0) {
+    last = &g_array_index(store_refs, owl_logstore_ref, store_refs->len - 1);
+    offset = last->offset + last->length;
+  }
+  if (fstat(store_data_fd, &st) < 0) return;
+
+  while (offset < (guint64)st.st_size) {
+    /* Find the record's length from its header, then read it all */
+    n = pread(store_data_fd, head, sizeof(head), offset);
+    if (n <= 0) break;
+    r = owl_logstore_record_parse(head, n, &used);
+    if (!r && used > 0 && offset + used <= (guint64)st.st_size) {
+      len = used;
+      buf = g_malloc(len);
+      n = pread(store_data_fd, buf, len, offset);
+      r = n == (ssize_t)len ? owl_logstore_record_parse(buf, len, &used) : NULL;
+      g_free(buf);
+    }
+    if (!r) {
+      if (ftruncate(store_data_fd, offset) < 0)
+        owl_log_error("Unable to repair the message store");
+      break;
+    }
+    owl_logstore_index_record(r, offset, used);
+    owl_logstore_record_delete(r);
+    offset += used;
+  }
+}
+
+/* Read messages.idx into memory, a piece at a time.  A last line cut
+ * off partway is removed. */
+static void owl_logstore_load_index(void)
+{
+  GString *line;
+  char *buf, *p, *nl;
+  guint64 offset = 0, good = 0;
+  ssize_t n;
+
+  buf = g_malloc(OWL_LOGSTORE_READ_CHUNK);
+  line = g_string_new("");
+  while ((n = pread(store_index_fd, buf, OWL_LOGSTORE_READ_CHUNK, offset)) > 0) {
+    offset += n;
+    for (p = buf; (nl = memchr(p, '\n', buf + n - p)) != NULL; p = nl + 1) {
+      g_string_append_len(line, p, nl - p);
+      if (!owl_logstore_index_parse(line->str))
+        owl_function_debugmsg("owl_logstore_load_index: bad line at %" G_GUINT64_FORMAT, good);
+      good += line->len + 1;
+      g_string_truncate(line, 0);
+    }
+    g_string_append_len(line, p, buf + n - p);
+  }
+  if (line->len > 0 && ftruncate(store_index_fd, good) < 0)
+    owl_log_error("Unable to repair the message store index");
+  g_string_free(line, TRUE);
+  g_free(buf);
+}
+
+/* Set up the lock on the store.  Called on the main thread before any
+ * other thread uses the store. */
+void owl_logstore_setup(void)
+{
+  if (!store_lock)
+    store_lock = g_mutex_new();
+}
+
+/* Called with store_lock held */
+static void owl_logstore_close_locked(void)
+{
+  if (!store_dir) return;
+  close(store_data_fd);
+  close(store_index_fd);
+  store_data_fd = store_index_fd = -1;
+  g_array_free(store_refs, TRUE);
+  g_array_free(store_blocks, TRUE);
+  g_hash_table_destroy(store_senders);
+  g_hash_table_destroy(store_classes);
+  g_hash_table_destroy(store_instances);
+  g_hash_table_destroy(store_terms);
+  g_free(store_dir);
+  store_dir = NULL;
+  store_generation++;
+}
+
+/* Called on the logging thread before it exits */
+void owl_logstore_close(void)
+{
+  if (!store_lock) return;
+  g_mutex_lock(store_lock);
+  owl_logstore_close_locked();
+  g_mutex_unlock(store_lock);
+}
+
+/* Make the store in 'dir' the open one.  Called with store_lock held.
+ * Returns 0 on failure. */
+static int owl_logstore_open(const char *dir)
+{
+  char *datapath, *indexpath;
+
+  if (store_dir && !strcmp(store_dir, dir))
+    return 1;
+  owl_logstore_close_locked();
+
+  datapath = g_strdup_printf("%s/messages.dat", dir);
+  indexpath = g_strdup_printf("%s/messages.idx", dir);
+  store_data_fd = open(datapath, O_RDWR | O_APPEND | O_CREAT, 0600);
+  store_index_fd = open(indexpath, O_RDWR | O_APPEND | O_CREAT, 0600);
+  g_free(datapath);
+  g_free(indexpath);
+  if (store_data_fd < 0 || store_index_fd < 0) {
+    if (store_data_fd >= 0) close(store_data_fd);
+    if (store_index_fd >= 0) close(store_index_fd);
+    store_data_fd = store_index_fd = -1;
+    return 0;
+  }
+
+  store_dir = g_strdup(dir);
+  store_refs = g_array_new(FALSE, FALSE, sizeof(owl_logstore_ref));
+  store_blocks = g_array_new(FALSE, FALSE, sizeof(owl_logstore_block));
+  store_senders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, owl_logstore_postings_delete);
+  store_classes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, owl_logstore_postings_delete);
+  store_instances = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, owl_logstore_postings_delete);
+  store_terms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, owl_logstore_postings_delete);
+  owl_logstore_load_index();
+  owl_logstore_catch_up();
+  return 1;
+}
+
+/* Add 'record', as owl_logstore_format_record made it, to the store
+ * in 'dir'.  Runs on the logging thread.  Returns 0 on failure. */
+int owl_logstore_write_record(const char *dir, const char *record)
+{
+  owl_logstore_record *r;
+  struct stat st;
+  size_t len = strlen(record), used;
+  int ok;
+
+  owl_logstore_setup();
+  r = owl_logstore_record_parse(record, len, &used);
+  if (!r || used != len) {
+    owl_logstore_record_delete(r);
+    owl_log_error("Bad record for the message store");
+    return 0;
+  }
+
+  g_mutex_lock(store_lock);
+  if (!owl_logstore_open(dir)) {
+    g_mutex_unlock(store_lock);
+    owl_logstore_record_delete(r);
+    owl_log_error("Unable to open the message store");
+    return 0;
+  }
+  /* We are the only writer, so the end now is where this will go */
+  ok = fstat(store_data_fd, &st) == 0 &&
+    owl_logstore_write_all(store_data_fd, record, len) &&
+    owl_logstore_index_record(r, st.st_size, len);
+  g_mutex_unlock(store_lock);
+
+  if (!ok)
+    owl_log_error("Unable to write to the message store");
+  owl_logstore_record_delete(r);
+  return ok;
+}
+
+/* Return 'm' as a record for the message store */
+char *owl_logstore_format_record(const owl_message *m)
+{
+  const char *fields[OWL_LOGSTORE_NUM_FIELDS];
+  GString *buf;
+  int i;
+
+  fields[OWL_LOGSTORE_FIELD_TYPE] = owl_message_get_type(m);
+  fields[OWL_LOGSTORE_FIELD_DIRECTION] = owl_message_get_direction(m);
+  fields[OWL_LOGSTORE_FIELD_SENDER] = owl_message_get_sender(m);
+  fields[OWL_LOGSTORE_FIELD_RECIPIENT] = owl_message_get_recipient(m);
+  fields[OWL_LOGSTORE_FIELD_CLASS] = owl_message_get_class(m);
+  fields[OWL_LOGSTORE_FIELD_INSTANCE] = owl_message_get_instance(m);
+  fields[OWL_LOGSTORE_FIELD_OPCODE] = owl_message_get_opcode(m);
+  fields[OWL_LOGSTORE_FIELD_HOST] = owl_message_get_hostname(m);
+  fields[OWL_LOGSTORE_FIELD_BODY] = owl_message_get_body(m);
+  for (i = 0; i < OWL_LOGSTORE_NUM_FIELDS; i++)
+    if (!fields[i])
+      fields[i] = "";
+
+  buf = g_string_new("");
+  g_string_append_printf(buf, "%" G_GINT64_FORMAT, (gint64)m->time);
+  for (i = 0; i < OWL_LOGSTORE_NUM_FIELDS; i++)
+    g_string_append_printf(buf, " %lu", (unsigned long)strlen(fields[i]));
+  g_string_append_c(buf, '\n');
+  for (i = 0; i < OWL_LOGSTORE_NUM_FIELDS; i++)
+    g_string_append(buf, fields[i]);
+  return g_string_free(buf, FALSE);
+}
+
+/* Add 'm' to the message store, if that is turned on */
+void owl_logstore_append(const owl_message *m)
+{
+  char *record, *dir;
+
+  if (!owl_global_is_logstore(&g)) return;
+
+  record = owl_logstore_format_record(m);
+  dir = owl_util_makepath(owl_global_get_logstorepath(&g));
+  owl_log_enqueue_store_record(record, dir);
+  g_free(record);
+  g_free(dir);
+}
+
+static gint owl_logstore_postings_cmp(gconstpointer a, gconstpointer b)
+{
+  const GArray *pa = *(GArray *const *)a, *pb = *(GArray *const *)b;
+  return pa->len - pb->len;
+}
+
+static int owl_logstore_postings_contain(const GArray *postings, guint32 recno)
+{
+  guint lo = 0, hi = postings->len, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (g_array_index(postings, guint32, mid) < recno)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < postings->len && g_array_index(postings, guint32, lo) == recno;
+}
+
+/* Whether the record numbered 'recno' can be what 'q' asks for,
+ * judging by the index alone */
+static int owl_logstore_ref_matches(const owl_logstore_query *q, GPtrArray *lists, guint first, guint32 recno)
+{
+  const owl_logstore_ref *ref = &g_array_index(store_refs, owl_logstore_ref, recno);
+  guint i;
+
+  if (q->after && ref->time < q->after) return 0;
+  if (q->before && ref->time >= q->before) return 0;
+  for (i = first; i < lists->len; i++)
+    if (!owl_logstore_postings_contain(g_ptr_array_index(lists, i), recno))
+      return 0;
+  return 1;
+}
+
+/* Runs on the main thread with a finished search */
+static void owl_logstore_search_done(void *data)
+{
+  owl_logstore_query *q = data;
+  const owl_logstore_record *r;
+  owl_fmtext fm;
+  char **lines, timestr[64];
+  time_t t;
+  guint i, j;
+
+  if (q->results->len == 0) {
+    owl_function_makemsg("No logged messages match");
+    return;
+  }
+
+  owl_fmtext_init_null(&fm);
+  owl_fmtext_appendf_normal(&fm, "%d%s logged messages, newest first:\n\n",
+                            q->results->len, q->truncated ? " (or more)" : "");
+  for (i = 0; i < q->results->len; i++) {
+    r = g_ptr_array_index(q->results, i);
+    t = r->time;
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M", localtime(&t));
+    owl_fmtext_appendf_normal(&fm, "%s  ", timestr);
+    if (*r->fields[OWL_LOGSTORE_FIELD_CLASS])
+      owl_fmtext_appendf_normal(&fm, "%s / %s / ",
+                                r->fields[OWL_LOGSTORE_FIELD_CLASS],
+                                r->fields[OWL_LOGSTORE_FIELD_INSTANCE]);
+    owl_fmtext_append_bold(&fm, r->fields[OWL_LOGSTORE_FIELD_SENDER]);
+    if (*r->fields[OWL_LOGSTORE_FIELD_RECIPIENT])
+      owl_fmtext_appendf_normal(&fm, " -> %s", r->fields[OWL_LOGSTORE_FIELD_RECIPIENT]);
+    owl_fmtext_append_normal(&fm, "\n");
+    lines = g_strsplit(r->fields[OWL_LOGSTORE_FIELD_BODY], "\n", 0);
+    for (j = 0; lines[j]; j++) {
+      if (!lines[j + 1] && !*lines[j]) break;
+      owl_fmtext_append_normal(&fm, "    ");
+      owl_fmtext_append_normal(&fm, lines[j]);
+      owl_fmtext_append_normal(&fm, "\n");
+    }
+    g_strfreev(lines);
+    owl_fmtext_append_normal(&fm, "\n");
+  }
+  owl_function_popless_fmtext(&fm);
+  owl_fmtext_cleanup(&fm);
+}
+
+/* Add to 'lists' the postings of every key 'q' gives.  Returns 0 if
+ * one was never seen, so nothing matches.  Called with store_lock
+ * held. */
+static int owl_logstore_query_lists(const owl_logstore_query *q, GPtrArray *lists)
+{
+  GArray *postings;
+  char *key;
+  guint i;
+  int found = 1;
+
+  if (q->sender) {
+    key = owl_logstore_key(q->sender, 1);
+    postings = g_hash_table_lookup(store_senders, key);
+    if (postings) g_ptr_array_add(lists, postings); else found = 0;
+    g_free(key);
+  }
+  if (q->class) {
+    key = owl_logstore_key(q->class, 0);
+    postings = g_hash_table_lookup(store_classes, key);
+    if (postings) g_ptr_array_add(lists, postings); else found = 0;
+    g_free(key);
+  }
+  if (q->instance) {
+    key = owl_logstore_key(q->instance, 0);
+    postings = g_hash_table_lookup(store_instances, key);
+    if (postings) g_ptr_array_add(lists, postings); else found = 0;
+    g_free(key);
+  }
+  for (i = 0; i < q->terms->len; i++) {
+    postings = g_hash_table_lookup(store_terms, g_ptr_array_index(q->terms, i));
+    if (postings) g_ptr_array_add(lists, postings); else found = 0;
+  }
+  return found;
+}
+
+/* Pick out, newest first, up to OWL_LOGSTORE_SEARCH_CHUNK records
+ * that may match 'q' from the first *n of 'walk', or of every record
+ * if 'walk' is NULL, and lower *n past them.  Called with store_lock
+ * held. */
+static void owl_logstore_query_chunk(const owl_logstore_query *q, GPtrArray *lists, const GArray *walk, guint *n, GArray *refs)
+{
+  const owl_logstore_block *b;
+  guint32 recno;
+
+  while (*n > 0 && refs->len < OWL_LOGSTORE_SEARCH_CHUNK) {
+    if (!walk) {
+      /* Pass over blocks entirely outside the range of times */
+      b = &g_array_index(store_blocks, owl_logstore_block, (*n - 1) / OWL_LOGSTORE_BLOCK_SIZE);
+      if ((q->after && b->max < q->after) || (q->before && b->min >= q->before)) {
+        *n = (*n - 1) / OWL_LOGSTORE_BLOCK_SIZE * OWL_LOGSTORE_BLOCK_SIZE;
+        continue;
+      }
+    }
+    (*n)--;
+    recno = walk ? g_array_index(walk, guint32, *n) : *n;
+    if (owl_logstore_ref_matches(q, lists, 1, recno))
+      g_array_append_val(refs, g_array_index(store_refs, owl_logstore_ref, recno));
+  }
+}
+
+/* Fill in the results of 'q'.  The lock is only held while picking
+ * out records, not while reading them. */
+static void owl_logstore_query_run(owl_logstore_query *q)
+{
+  owl_logstore_record *r;
+  GPtrArray *lists;
+  GArray *refs;
+  const GArray *walk;
+  char *datapath;
+  unsigned int generation;
+  guint i, n;
+  int fd;
+
+  g_mutex_lock(store_lock);
+  if (!owl_logstore_open(q->dir)) {
+    g_mutex_unlock(store_lock);
+    owl_log_error("Unable to open the message store");
+    return;
+  }
+  generation = store_generation;
+  lists = g_ptr_array_new();
+  /* Walk the shortest list, or every record */
+  if (owl_logstore_query_lists(q, lists)) {
+    g_ptr_array_sort(lists, owl_logstore_postings_cmp);
+    walk = lists->len ? g_ptr_array_index(lists, 0) : NULL;
+    n = walk ? walk->len : store_refs->len;
+  } else {
+    walk = NULL;
+    n = 0;
+  }
+  g_mutex_unlock(store_lock);
+
+  /* Records are read through a descriptor of our own */
+  datapath = g_strdup_printf("%s/messages.dat", q->dir);
+  fd = open(datapath, O_RDONLY);
+  g_free(datapath);
+  if (fd < 0) n = 0;
+
+  refs = g_array_new(FALSE, FALSE, sizeof(owl_logstore_ref));
+  while (n > 0 && !q->truncated) {
+    g_mutex_lock(store_lock);
+    /* The postings we walk went away with the store */
+    if (store_generation != generation) {
+      g_mutex_unlock(store_lock);
+      break;
+    }
+    g_array_set_size(refs, 0);
+    owl_logstore_query_chunk(q, lists, walk, &n, refs);
+    g_mutex_unlock(store_lock);
+
+    for (i = 0; i < refs->len; i++) {
+      r = owl_logstore_read_record(fd, &g_array_index(refs, owl_logstore_ref, i));
+      if (!r) continue;
+      /* The index has senders without realms */
+      if (q->sender && strchr(q->sender, '@') &&
+          g_ascii_strcasecmp(q->sender, r->fields[OWL_LOGSTORE_FIELD_SENDER])) {
+        owl_logstore_record_delete(r);
+        continue;
+      }
+      if (q->results->len == OWL_LOGSTORE_MAX_RESULTS) {
+        owl_logstore_record_delete(r);
+        q->truncated = 1;
+        break;
+      }
+      g_ptr_array_add(q->results, r);
+    }
+  }
+  g_array_free(refs, TRUE);
+  g_ptr_array_free(lists, TRUE);
+  if (fd >= 0) close(fd);
+}
+
+/* Runs on the search thread */
+static void owl_logstore_search_run(void *data)
+{
+  owl_logstore_query *q = data;
+
+  owl_logstore_query_run(q);
+  owl_select_post_task(owl_logstore_search_done, q, owl_logstore_query_delete, NULL);
+}
+
+static owl_logstore_query *owl_logstore_query_new(const char *dir, const char *sender, const char *class, const char *instance, time_t after, time_t before, const char *const *words, int nwords)
+{
+  owl_logstore_query *q;
+  GPtrArray *terms;
+  int i;
+  guint j;
+
+  q = g_new0(owl_logstore_query, 1);
+  q->dir = g_strdup(dir);
+  q->sender = g_strdup(sender);
+  q->class = g_strdup(class);
+  q->instance = g_strdup(instance);
+  q->after = after;
+  q->before = before;
+  q->terms = g_ptr_array_new();
+  q->results = g_ptr_array_new();
+  for (i = 0; i < nwords; i++) {
+    terms = owl_logstore_body_terms(words[i]);
+    for (j = 0; j < terms->len; j++)
+      g_ptr_array_add(q->terms, g_ptr_array_index(terms, j));
+    g_ptr_array_free(terms, TRUE);
+  }
+  return q;
+}
+
+static gpointer owl_logstore_thread_func(gpointer data)
+{
+  g_main_loop_run(search_loop);
+  return NULL;
+}
+
+/* Start the search thread, the first time we search */
+static void owl_logstore_search_init(void)
+{
+  GError *error = NULL;
+
+  if (search_context) return;
+  search_context = g_main_context_new();
+  search_loop = g_main_loop_new(search_context, FALSE);
+  search_thread = g_thread_create(owl_logstore_thread_func,
+                                  NULL,
+                                  TRUE,
+                                  &error);
+  if (error) {
+    owl_function_error("Error spawning search thread: %s", error->message);
+    g_error_free(error);
+    g_main_loop_unref(search_loop);
+    g_main_context_unref(search_context);
+    search_loop = NULL;
+    search_context = NULL;
+  }
+}
+
+/* Show the stored messages that match everything given: a sender,
+ * class and instance (any may be NULL), a range of times (0 for no
+ * bound), and words that must all appear in the body. */
+void owl_logstore_search(const char *sender, const char *class, const char *instance, time_t after, time_t before, const char *const *words, int nwords)
+{
+  owl_logstore_query *q;
+  char *dir;
+
+  owl_logstore_setup();
+  owl_logstore_search_init();
+
+  dir = owl_util_makepath(owl_global_get_logstorepath(&g));
+  q = owl_logstore_query_new(dir, sender, class, instance, after, before, words, nwords);
+  g_free(dir);
+
+  if (search_context) {
+    owl_select_post_task(owl_logstore_search_run, q, NULL, search_context);
+  } else {
+    owl_logstore_query_run(q);
+    owl_logstore_search_done(q);
+    owl_logstore_query_delete(q);
+  }
+}
+
+/* Return the bodies of the messages in the store in 'dir' that match,
+ * newest first, searching as owl_logstore_search does but in the
+ * calling thread.  The caller must free the array and its strings. */
+GPtrArray *owl_logstore_find_bodies(const char *dir, const char *sender, const char *class, const char *instance, time_t after, time_t before, const char *const *words, int nwords)
+{
+  owl_logstore_query *q;
+  GPtrArray *bodies;
+  const owl_logstore_record *r;
+  guint i;
+
+  owl_logstore_setup();
+  q = owl_logstore_query_new(dir, sender, class, instance, after, before, words, nwords);
+  owl_logstore_query_run(q);
+  bodies = g_ptr_array_new();
+  for (i = 0; i < q->results->len; i++) {
+    r = g_ptr_array_index(q->results, i);
+    g_ptr_array_add(bodies, g_strdup(r->fields[OWL_LOGSTORE_FIELD_BODY]));
+  }
+  owl_logstore_query_delete(q);
+  return bodies;
+}
+
+static void owl_logstore_quit_func(gpointer data)
+{
+  g_main_loop_quit(search_loop);
+}
+
+void owl_logstore_shutdown(void)
+{
+  if (!search_context) return;
+  owl_select_post_task(owl_logstore_quit_func, NULL,
+                       NULL, search_context);
+  g_thread_join(search_thread);
+}
@@ -3,10 +3,36 @@
 static void owl_mainwin_redraw(owl_window *w, WINDOW *recwin, void *user_data);
 static void owl_mainwin_resized(owl_window *w, void *user_data);
 
+/* A message as the last redraw drew it */
+typedef struct _owl_mainwin_row { /* noproto */
+  int id;
+  int y;                  /* first line on screen */
+  int start, bline;       /* lines of the message drawn, as passed to
+                             owl_message_curs_waddstr */
+  int numlines;
+  int drawn;              /* number of screen lines used */
+  unsigned long format;   /* owl_message_get_format_serial */
+  int fgcolor, bgcolor;
+  int marker;             /* owl_mainwin_marker */
+} owl_mainwin_row;
+
+#define OWL_MAINWIN_MARKER_CURRENT  1
+#define OWL_MAINWIN_MARKER_OFFSET   2
+#define OWL_MAINWIN_MARKER_DELETED  4
+#define OWL_MAINWIN_MARKER_MARKED   8
+
 void owl_mainwin_init(owl_mainwin *mw, owl_window *window)
 {
   mw->curtruncated=0;
   mw->lastdisplayed=-1;
+  mw->prefetch_id=0;
+  mw->lasttopmsg=0;
+  mw->rows=g_array_new(FALSE, FALSE, sizeof(owl_mainwin_row));
+  mw->damaged=1;
+  mw->room=1;
+  mw->nexty=0;
+  mw->drawn_win=NULL;
+  mw->drawn_search=NULL;
   mw->window = g_object_ref(window);
   /* for now, just assume this object lasts forever */
   g_signal_connect(window, "redraw", G_CALLBACK(owl_mainwin_redraw), mw);
@@ -29,145 +55,432 @@ static void owl_mainwin_resized(owl_window *w, void *user_data)
   owl_function_calculate_topmsg(OWL_DIRECTION_NONE);
 
   /* Schedule a redraw */
-  owl_window_dirty(mw->window);
+  owl_mainwin_repaint(mw);
 }
 
+/* Schedule a redraw of whatever has changed */
 void owl_mainwin_redisplay(owl_mainwin *mw)
 {
   owl_window_dirty(mw->window);
 }
 
-static void owl_mainwin_redraw(owl_window *w, WINDOW *recwin, void *user_data)
+/* Schedule a redraw of everything, changed or not */
+void owl_mainwin_repaint(owl_mainwin *mw)
+{
+  mw->damaged = 1;
+  owl_window_dirty(mw->window);
+}
+
+/* Format one message ahead of the screen, upwards or downwards.
+ * Returns 0 if there is nothing left to do in that direction. */
+static int owl_mainwin_prefetch_one(owl_mainwin *mw, const owl_view *v, int up)
 {
   owl_message *m;
-  int i, lines, isfull, viewsize;
-  int x, y, savey, recwinlines, start;
-  int topmsg, curmsg, markedmsgid, fgcolor, bgcolor;
-  const owl_view *v;
-  GList *fl;
-  const owl_filter *f;
+
+  if (up) {
+    if (mw->prefetch_uplines <= 0 || mw->prefetch_up < 0) return 0;
+    m = owl_view_get_element(v, mw->prefetch_up--);
+    mw->prefetch_uplines -= owl_message_get_numlines(m);
+  } else {
+    if (mw->prefetch_downlines <= 0 || mw->prefetch_down >= owl_view_get_size(v)) return 0;
+    m = owl_view_get_element(v, mw->prefetch_down++);
+    mw->prefetch_downlines -= owl_message_get_numlines(m);
+  }
+  return 1;
+}
+
+/* Idle callback which formats the messages just off screen, in the
+ * direction we last scrolled first, so that paging finds them in the
+ * fmtext cache.  Each call only runs for a short slice so that input
+ * is not held up.
+ */
+static gboolean owl_mainwin_prefetch(gpointer user_data)
+{
   owl_mainwin *mw = user_data;
+  const owl_view *v = owl_global_get_current_view(&g);
+  GTimer *timer = g_timer_new();
+  int up = mw->prefetch_dir < 0;
+  gboolean more = TRUE;
 
-  topmsg = owl_global_get_topmsg(&g);
-  curmsg = owl_global_get_curmsg(&g);
-  markedmsgid = owl_global_get_markedmsgid(&g);
-  v = owl_global_get_current_view(&g);
+  do {
+    if (!owl_mainwin_prefetch_one(mw, v, up) &&
+        !owl_mainwin_prefetch_one(mw, v, !up)) {
+      mw->prefetch_id = 0;
+      more = FALSE;
+      break;
+    }
+  } while (g_timer_elapsed(timer, NULL) < OWL_MAINWIN_PREFETCH_SLICE);
 
-  if (v==NULL) {
-    owl_function_debugmsg("Hit a null window in owl_mainwin_redisplay.");
-    return;
-  }
+  g_timer_destroy(timer);
+  return more;
+}
 
-  werase(recwin);
+static void owl_mainwin_schedule_prefetch(owl_mainwin *mw, int topmsg, int recwinlines)
+{
+  mw->prefetch_dir = topmsg - mw->lasttopmsg;
+  mw->lasttopmsg = topmsg;
 
-  recwinlines=owl_global_get_recwin_lines(&g);
-  viewsize=owl_view_get_size(v);
+  /* two screens ahead in the direction of travel, one behind */
+  mw->prefetch_up = topmsg - 1;
+  mw->prefetch_down = mw->lastdisplayed + 1;
+  mw->prefetch_uplines = recwinlines * (mw->prefetch_dir < 0 ? 2 : 1);
+  mw->prefetch_downlines = recwinlines * (mw->prefetch_dir > 0 ? 2 : 1);
 
-  /* if there are no messages or if topmsg is past the end of the messages,
-   * just draw a blank screen */
-  if (viewsize==0 || topmsg>=viewsize) {
-    if (viewsize==0) {
-      owl_global_set_topmsg(&g, 0);
+  if (!mw->prefetch_id)
+    mw->prefetch_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, owl_mainwin_prefetch, mw, NULL);
+}
+
+/* Return what goes in the left margin next to 'm' */
+static int owl_mainwin_marker(const owl_view *v, const owl_message *m)
+{
+  int marker = 0;
+
+  if (owl_global_get_rightshift(&g) != 0)   /* this lame and should be fixed */
+    return 0;
+  if (m == owl_view_get_element(v, owl_global_get_curmsg(&g))) {
+    marker |= OWL_MAINWIN_MARKER_CURRENT;
+    if (owl_global_get_curmsg_vert_offset(&g) > 0)
+      marker |= OWL_MAINWIN_MARKER_OFFSET;
+  }
+  if (owl_message_is_delete(m))
+    marker |= OWL_MAINWIN_MARKER_DELETED;
+  else if (owl_global_get_markedmsgid(&g) == owl_message_get_id(m))
+    marker |= OWL_MAINWIN_MARKER_MARKED;
+  return marker;
+}
+
+/* Draw 'marker' at the start of line 'y', leaving the cursor be */
+static void owl_mainwin_draw_marker(WINDOW *recwin, int marker, int y)
+{
+  int savey, savex;
+
+  getyx(recwin, savey, savex);
+  wattrset(recwin, A_NORMAL);
+  if (marker & OWL_MAINWIN_MARKER_CURRENT) {
+    wmove(recwin, y, 0);
+    wattron(recwin, A_BOLD);
+    if (marker & OWL_MAINWIN_MARKER_OFFSET) {
+      waddstr(recwin, "+");
+    } else {
+      waddstr(recwin, "-");
     }
-    mw->curtruncated=0;
-    mw->lastdisplayed=-1;
-    return;
+    if (marker & OWL_MAINWIN_MARKER_DELETED) {
+      waddstr(recwin, "D");
+    } else if (marker & OWL_MAINWIN_MARKER_MARKED) {
+      waddstr(recwin, "*");
+    } else {
+      waddstr(recwin, ">");
+    }
+    wmove(recwin, savey, savex);
+    wattroff(recwin, A_BOLD);
+  } else if (marker & OWL_MAINWIN_MARKER_DELETED) {
+    wmove(recwin, y, 0);
+    waddstr(recwin, " D");
+    wmove(recwin, savey, savex);
+  } else if (marker & OWL_MAINWIN_MARKER_MARKED) {
+    wmove(recwin, y, 0);
+    waddstr(recwin, " *");
+    wmove(recwin, savey, savex);
   }
+  wattroff(recwin, A_BOLD);
+}
 
-  /* write the messages out */
-  isfull=0;
-  mw->curtruncated=0;
-  mw->lasttruncated=0;
+/* Draw the messages of 'v' from 'first' on, starting at line 'y',
+ * until the screen is full, and remember where each went */
+static void owl_mainwin_draw_messages(owl_mainwin *mw, WINDOW *recwin, const owl_view *v, int first, int y)
+{
+  owl_message *m;
+  owl_mainwin_row row;
+  int i, lines, isfull, viewsize;
+  int x, recwinlines, start;
+
+  recwinlines=owl_global_get_recwin_lines(&g);
+  viewsize=owl_view_get_size(v);
 
-  for (i=topmsg; i<viewsize; i++) {
+  wmove(recwin, y, 0);
+  isfull=0;
+  for (i=first; i<viewsize; i++) {
     if (isfull) break;
     m=owl_view_get_element(v, i);
+    owl_message_pin_format(m);
 
     /* hold on to y in case this is the current message or deleted */
     getyx(recwin, y, x);
-    savey=y;
+    row.y=y;
 
     /* if it's the current message, account for a vert_offset */
+    row.numlines=owl_message_get_numlines(m);
     if (i==owl_global_get_curmsg(&g)) {
       start=owl_global_get_curmsg_vert_offset(&g);
-      lines=owl_message_get_numlines(m)-start;
+      lines=row.numlines-start;
     } else {
       start=0;
-      lines=owl_message_get_numlines(m);
+      lines=row.numlines;
     }
 
     /* if we match filters set the color */
-    fgcolor=OWL_COLOR_DEFAULT;
-    bgcolor=OWL_COLOR_DEFAULT;
-    for (fl = g.filterlist; fl; fl = g_list_next(fl)) {
-      f = fl->data;
-      if ((owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) ||
-          (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT)) {
-        if (owl_filter_message_match(f, m)) {
-          if (owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) fgcolor=owl_filter_get_fgcolor(f);
-          if (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT) bgcolor=owl_filter_get_bgcolor(f);
-	}
-      }
-    }
+    owl_message_get_filter_colors(m, &row.fgcolor, &row.bgcolor);
 
     /* if we'll fill the screen print a partial message */
     if ((y+lines > recwinlines) && (i==owl_global_get_curmsg(&g))) mw->curtruncated=1;
     if (y+lines > recwinlines) mw->lasttruncated=1;
     if (y+lines > recwinlines-1) {
       isfull=1;
-      owl_message_curs_waddstr(m, recwin,
-			       start,
-			       start+recwinlines-y,
-			       owl_global_get_rightshift(&g),
-			       owl_global_get_cols(&g)+owl_global_get_rightshift(&g)-1,
-			       fgcolor, bgcolor);
+      row.bline=start+recwinlines-y;
     } else {
       /* otherwise print the whole thing */
-      owl_message_curs_waddstr(m, recwin,
-			       start,
-			       start+lines,
-			       owl_global_get_rightshift(&g),
-			       owl_global_get_cols(&g)+owl_global_get_rightshift(&g)-1,
-			       fgcolor, bgcolor);
+      row.bline=start+lines;
     }
-
+    row.start=start;
+    owl_message_curs_waddstr(m, recwin,
+                             row.start,
+                             row.bline,
+                             owl_global_get_rightshift(&g),
+                             owl_global_get_cols(&g)+owl_global_get_rightshift(&g)-1,
+                             row.fgcolor, row.bgcolor);
 
     /* is it the current message and/or deleted? */
-    getyx(recwin, y, x);
-    wattrset(recwin, A_NORMAL);
-    if (owl_global_get_rightshift(&g)==0) {   /* this lame and should be fixed */
-      if (m==owl_view_get_element(v, curmsg)) {
-	wmove(recwin, savey, 0);
-	wattron(recwin, A_BOLD);	
-	if (owl_global_get_curmsg_vert_offset(&g)>0) {
-	  waddstr(recwin, "+");
-	} else {
-	  waddstr(recwin, "-");
-	}
-	if (owl_message_is_delete(m)) {
-	  waddstr(recwin, "D");
-	} else if (markedmsgid == owl_message_get_id(m)) {
-	  waddstr(recwin, "*");
-	} else {
-	  waddstr(recwin, ">");
-	}
-	wmove(recwin, y, x);
-	wattroff(recwin, A_BOLD);
-      } else if (owl_message_is_delete(m)) {
-	wmove(recwin, savey, 0);
-	waddstr(recwin, " D");
-	wmove(recwin, y, x);
-      } else if (markedmsgid == owl_message_get_id(m)) {
-	wmove(recwin, savey, 0);
-	waddstr(recwin, " *");
-	wmove(recwin, y, x);
-      }
-    }
-    wattroff(recwin, A_BOLD);
+    row.marker=owl_mainwin_marker(v, m);
+    owl_mainwin_draw_marker(recwin, row.marker, row.y);
+
+    row.id=owl_message_get_id(m);
+    row.drawn=MIN(row.bline, row.numlines)-row.start;
+    row.format=owl_message_get_format_serial(m);
+    g_array_append_val(mw->rows, row);
   }
   mw->lastdisplayed=i-1;
+  mw->room=!isfull;
+  getyx(recwin, mw->nexty, x);
+}
+
+/* Repaint the lines of the message 'm' drawn as 'row' */
+static void owl_mainwin_draw_row(WINDOW *recwin, owl_message *m, const owl_mainwin_row *row)
+{
+  int i;
+
+  for (i = 0; i < row->drawn; i++) {
+    wmove(recwin, row->y + i, 0);
+    wclrtoeol(recwin);
+  }
+  wmove(recwin, row->y, 0);
+  owl_message_curs_waddstr(m, recwin,
+                           row->start,
+                           row->bline,
+                           owl_global_get_rightshift(&g),
+                           owl_global_get_cols(&g)+owl_global_get_rightshift(&g)-1,
+                           row->fgcolor, row->bgcolor);
+  owl_mainwin_draw_marker(recwin, row->marker, row->y);
+}
+
+/* Work out again from the rows drawn whether the current message and
+ * the last one are cut off at the bottom */
+static void owl_mainwin_find_truncated(owl_mainwin *mw, int topmsg)
+{
+  const owl_mainwin_row *row;
+  int r;
+
+  mw->curtruncated = 0;
+  mw->lasttruncated = 0;
+  for (r = 0; r < (int)mw->rows->len; r++) {
+    row = &g_array_index(mw->rows, owl_mainwin_row, r);
+    if (row->bline < row->numlines) {
+      mw->lasttruncated = 1;
+      if (topmsg + r == owl_global_get_curmsg(&g))
+        mw->curtruncated = 1;
+    }
+  }
+}
+
+/* Whether the search highlighting drawn last time is still right */
+static int owl_mainwin_same_search(const owl_mainwin *mw)
+{
+  const char *search = NULL;
+
+  if (owl_global_is_search_active(&g))
+    search = owl_regex_get_string(owl_global_get_search_re(&g));
+  if (!search || !mw->drawn_search)
+    return search == mw->drawn_search;
+  return !strcmp(search, mw->drawn_search);
+}
+
+/* Bring what the last redraw drew up to date, repainting only the
+ * messages whose text, colors or markers changed and drawing new ones
+ * at the end if there is room.  If the view has moved down by a few
+ * messages, as it does when following new ones, the messages still on
+ * screen are scrolled up rather than drawn again, which curses can do
+ * with the terminal's own scrolling.  Returns 0, having drawn nothing,
+ * if that is not enough, because the screen scrolled some other way or
+ * a message now takes a different number of lines. */
+static int owl_mainwin_patch(owl_mainwin *mw, WINDOW *recwin, const owl_view *v)
+{
+  owl_message *m;
+  owl_mainwin_row *row, now;
+  GArray *damage;
+  int topmsg, viewsize, first, kept, dy, r, at;
+
+  topmsg = owl_global_get_topmsg(&g);
+  viewsize = owl_view_get_size(v);
+
+  if (mw->damaged || mw->rows->len == 0 ||
+      recwin != mw->drawn_win ||
+      owl_global_get_recwin_lines(&g) != mw->drawn_lines ||
+      owl_global_get_cols(&g) != mw->drawn_cols ||
+      owl_global_get_rightshift(&g) != mw->drawn_rightshift ||
+      owl_view_get_style(v) != mw->drawn_style ||
+      !owl_mainwin_same_search(mw))
+    return 0;
+
+  /* Work out which of the messages drawn can stay */
+  first = 0;
+  kept = mw->rows->len;
+  if (topmsg != mw->drawn_topmsg) {
+    /* A message cut off at the bottom gets drawn again in full */
+    row = &g_array_index(mw->rows, owl_mainwin_row, kept - 1);
+    if (row->bline < row->numlines)
+      kept--;
+    first = topmsg - mw->drawn_topmsg;
+    if (first <= 0 || first >= kept)
+      return 0;
+  }
+
+  /* Check the messages are still where they were */
+  if (mw->drawn_topmsg + kept > viewsize)
+    return 0;
+  damage = g_array_new(FALSE, FALSE, sizeof(int));
+  for (r = first; r < kept; r++) {
+    row = &g_array_index(mw->rows, owl_mainwin_row, r);
+    m = owl_view_get_element(v, mw->drawn_topmsg + r);
+    now.start = mw->drawn_topmsg + r == owl_global_get_curmsg(&g) ? owl_global_get_curmsg_vert_offset(&g) : 0;
+    if (owl_message_get_id(m) != row->id || now.start != row->start) {
+      g_array_free(damage, TRUE);
+      return 0;
+    }
+    now.format = owl_message_get_format_serial(m);
+    owl_message_get_filter_colors(m, &now.fgcolor, &now.bgcolor);
+    now.marker = owl_mainwin_marker(v, m);
+    if (now.format == row->format && now.fgcolor == row->fgcolor &&
+        now.bgcolor == row->bgcolor && now.marker == row->marker)
+      continue;
+    if (now.format != row->format && owl_message_get_numlines(m) != row->numlines) {
+      g_array_free(damage, TRUE);
+      return 0;
+    }
+    /* where it will be once the rows above are gone */
+    at = r - first;
+    g_array_append_val(damage, at);
+  }
+
+  if (first > 0) {
+    /* Scroll what stays up to the top */
+    dy = g_array_index(mw->rows, owl_mainwin_row, first).y;
+    idlok(recwin, TRUE);
+    scrollok(recwin, TRUE);
+    wscrl(recwin, dy);
+    scrollok(recwin, FALSE);
+    idlok(recwin, FALSE);
+
+    g_array_set_size(mw->rows, kept);
+    g_array_remove_range(mw->rows, 0, first);
+    for (r = 0; r < (int)mw->rows->len; r++)
+      g_array_index(mw->rows, owl_mainwin_row, r).y -= dy;
+    row = &g_array_index(mw->rows, owl_mainwin_row, mw->rows->len - 1);
+    mw->nexty = row->y + row->drawn;
+    wmove(recwin, mw->nexty, 0);
+    wclrtobot(recwin);
+
+    mw->drawn_topmsg = topmsg;
+    mw->lastdisplayed = topmsg + mw->rows->len - 1;
+    mw->room = 1;
+  }
+
+  owl_message_fmtext_cache_new_frame();
+  for (r = 0; r < (int)mw->rows->len; r++)
+    owl_message_pin_format(owl_view_get_element(v, topmsg + r));
+
+  /* Repaint the messages that changed */
+  for (r = 0; r < (int)damage->len; r++) {
+    row = &g_array_index(mw->rows, owl_mainwin_row, g_array_index(damage, int, r));
+    m = owl_view_get_element(v, topmsg + g_array_index(damage, int, r));
+    row->format = owl_message_get_format_serial(m);
+    owl_message_get_filter_colors(m, &row->fgcolor, &row->bgcolor);
+    row->marker = owl_mainwin_marker(v, m);
+    owl_mainwin_draw_row(recwin, m, row);
+  }
+  g_array_free(damage, TRUE);
+  /* The pointer may have moved onto or off a message cut off at the
+   * bottom */
+  owl_mainwin_find_truncated(mw, topmsg);
+
+  /* and draw any new ones that fit */
+  if (mw->room && mw->lastdisplayed + 1 < viewsize)
+    owl_mainwin_draw_messages(mw, recwin, v, mw->lastdisplayed + 1, mw->nexty);
+  return 1;
+}
+
+static void owl_mainwin_redraw(owl_window *w, WINDOW *recwin, void *user_data)
+{
+  int topmsg, viewsize, recwinlines;
+  const owl_view *v;
+  owl_mainwin *mw = user_data;
+
+  topmsg = owl_global_get_topmsg(&g);
+  v = owl_global_get_current_view(&g);
+
+  if (v==NULL) {
+    owl_function_debugmsg("Hit a null window in owl_mainwin_redisplay.");
+    return;
+  }
+
+  recwinlines=owl_global_get_recwin_lines(&g);
+
+  if (owl_mainwin_patch(mw, recwin, v)) {
+    owl_mainwin_schedule_prefetch(mw, topmsg, recwinlines);
+    return;
+  }
+
+  werase(recwin);
+  g_array_set_size(mw->rows, 0);
+  mw->damaged=0;
+  mw->drawn_win=recwin;
+  mw->drawn_topmsg=topmsg;
+  mw->drawn_lines=recwinlines;
+  mw->drawn_cols=owl_global_get_cols(&g);
+  mw->drawn_rightshift=owl_global_get_rightshift(&g);
+  mw->drawn_style=owl_view_get_style(v);
+  g_free(mw->drawn_search);
+  mw->drawn_search=NULL;
+  if (owl_global_is_search_active(&g))
+    mw->drawn_search=g_strdup(owl_regex_get_string(owl_global_get_search_re(&g)));
+
+  viewsize=owl_view_get_size(v);
+
+  /* if there are no messages or if topmsg is past the end of the messages,
+   * just draw a blank screen */
+  if (viewsize==0 || topmsg>=viewsize) {
+    if (viewsize==0) {
+      owl_global_set_topmsg(&g, 0);
+    }
+    mw->curtruncated=0;
+    mw->lastdisplayed=-1;
+    mw->room=1;
+    return;
+  }
+
+  /* write the messages out */
+  mw->curtruncated=0;
+  mw->lasttruncated=0;
+
+  owl_message_fmtext_cache_new_frame();
+  owl_mainwin_draw_messages(mw, recwin, v, topmsg, 0);
+
+  owl_mainwin_schedule_prefetch(mw, topmsg, recwinlines);
 }
 
+/* Whether messages added to the end of the view would be on screen */
+int owl_mainwin_has_room(const owl_mainwin *mw)
+{
+  return mw->room;
+}
 
 int owl_mainwin_is_curmsg_truncated(const owl_mainwin *mw)
 {
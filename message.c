@@ -11,74 +11,323 @@
 #include "owl.h"
 #include "filterproc.h"
 
-static owl_fmtext_cache fmtext_cache[OWL_FMTEXT_CACHE_SIZE];
-static owl_fmtext_cache * fmtext_cache_next = fmtext_cache;
+static owl_fmtext_cache *fmtext_cache_head = NULL;
+static owl_fmtext_cache *fmtext_cache_tail = NULL;
+static size_t fmtext_cache_bytes = 0;
+static int fmtext_cache_entries = 0;
+static unsigned int fmtext_cache_frame = 1;
+static unsigned long fmtext_cache_hits = 0;
+static unsigned long fmtext_cache_misses = 0;
+static unsigned long fmtext_cache_evictions = 0;
+static unsigned long fmtext_cache_serial = 0;
 
 void owl_message_init_fmtext_cache(void)
 {
-    int i;
-    for(i = 0; i < OWL_FMTEXT_CACHE_SIZE; i++) {
-        owl_fmtext_init_null(&(fmtext_cache[i].fmtext));
-        fmtext_cache[i].message = NULL;
-    }
+  fmtext_cache_head = fmtext_cache_tail = NULL;
+  fmtext_cache_bytes = 0;
+  fmtext_cache_entries = 0;
+  fmtext_cache_hits = fmtext_cache_misses = fmtext_cache_evictions = 0;
+}
+
+static void owl_message_fmtext_cache_unlink(owl_fmtext_cache *f)
+{
+  if (f->prev) f->prev->next = f->next;
+  else fmtext_cache_head = f->next;
+  if (f->next) f->next->prev = f->prev;
+  else fmtext_cache_tail = f->prev;
+  f->prev = f->next = NULL;
+}
+
+static void owl_message_fmtext_cache_push(owl_fmtext_cache *f)
+{
+  f->prev = NULL;
+  f->next = fmtext_cache_head;
+  if (fmtext_cache_head) fmtext_cache_head->prev = f;
+  else fmtext_cache_tail = f;
+  fmtext_cache_head = f;
+}
+
+/* Drop least recently used entries until the cache fits its budget,
+ * sparing pinned entries and 'keep'. */
+static void owl_message_fmtext_cache_trim(const owl_fmtext_cache *keep)
+{
+  owl_fmtext_cache *f, *prev;
+  size_t budget = MAX(owl_global_get_fmtext_cache_bytes(&g), 0);
+
+  for (f = fmtext_cache_tail; f && fmtext_cache_bytes > budget; f = prev) {
+    prev = f->prev;
+    if (f == keep || f->frame == fmtext_cache_frame)
+      continue;
+    owl_message_invalidate_format(f->message);
+    fmtext_cache_evictions++;
+  }
+}
+
+/* Start a new screen redraw.  Entries pinned by the previous redraw
+ * may be dropped again. */
+void owl_message_fmtext_cache_new_frame(void)
+{
+  fmtext_cache_frame++;
+}
+
+/* Format 'm' and keep it cached for as long as it is on screen, that
+ * is, until the next owl_message_fmtext_cache_new_frame. */
+void owl_message_pin_format(owl_message *m)
+{
+  owl_message_format(m);
+  m->fmtext->frame = fmtext_cache_frame;
+}
+
+/* Return a number that changes whenever 'm' is formatted anew, or 0
+ * if it is not formatted now */
+unsigned long owl_message_get_format_serial(const owl_message *m)
+{
+  return m->fmtext ? m->fmtext->serial : 0;
+}
+
+void owl_message_fmtext_cache_tofmtext(owl_fmtext *fm)
+{
+  owl_fmtext_appendf_normal(fm, "  Entries  : %d\n", fmtext_cache_entries);
+  owl_fmtext_appendf_normal(fm, "  Size     : %lu of %d bytes\n",
+                            (unsigned long)fmtext_cache_bytes,
+                            owl_global_get_fmtext_cache_bytes(&g));
+  owl_fmtext_appendf_normal(fm, "  Hits     : %lu\n", fmtext_cache_hits);
+  owl_fmtext_appendf_normal(fm, "  Misses   : %lu\n", fmtext_cache_misses);
+  owl_fmtext_appendf_normal(fm, "  Evictions: %lu\n", fmtext_cache_evictions);
 }
 
-static owl_fmtext_cache *owl_message_next_fmtext(void)
+/* Forget remembered filter results; call whenever something a filter
+ * can look at changes. */
+static void owl_message_invalidate_filter_memo(owl_message *m)
 {
-    owl_fmtext_cache * f = fmtext_cache_next;
-    if(fmtext_cache_next->message != NULL) {
-        owl_message_invalidate_format(fmtext_cache_next->message);
+  memset(m->filtermemo, 0, sizeof(m->filtermemo));
+  m->colorgen = 0;
+}
+
+static owl_message_filter_memo *owl_message_filter_memo_slot(const owl_message *m, const owl_filter *f)
+{
+  unsigned int id = owl_filter_get_id(f);
+
+  return (owl_message_filter_memo *)&m->filtermemo[id % OWL_MESSAGE_FILTER_MEMO_SIZE];
+}
+
+/* If the result of filter 'f' on 'm' was remembered during filter
+ * generation 'generation', store it in *result and return 1;
+ * otherwise return 0.
+ */
+int owl_message_get_filter_memo(const owl_message *m, const owl_filter *f, unsigned int generation, int *result)
+{
+  const owl_message_filter_memo *memo = owl_message_filter_memo_slot(m, f);
+
+  if (memo->filter != owl_filter_get_id(f) || memo->generation != generation)
+    return 0;
+  *result = memo->result;
+  return 1;
+}
+
+/* Remember 'result' as the outcome of filter 'f' on 'm'.  The memo is
+ * a cache rather than part of the message, so this takes a const
+ * message. */
+void owl_message_set_filter_memo(const owl_message *m, const owl_filter *f, unsigned int generation, int result)
+{
+  owl_message_filter_memo *memo = owl_message_filter_memo_slot(m, f);
+
+  memo->filter = owl_filter_get_id(f);
+  memo->generation = generation;
+  memo->result = result;
+}
+
+/* Store in *fgcolor and *bgcolor the colors given to 'm' by colored
+ * filters, later filters taking precedence.  The result is kept on
+ * the message until the filters or the message change.
+ */
+void owl_message_get_filter_colors(const owl_message *m, int *fgcolor, int *bgcolor)
+{
+  owl_message *cache = (owl_message *)m;
+  unsigned int gen = owl_global_get_filter_generation(&g);
+  const owl_filter *f;
+  GList *fl;
+  int fg, bg;
+
+  if (m->colorgen != gen) {
+    fg = OWL_COLOR_DEFAULT;
+    bg = OWL_COLOR_DEFAULT;
+    for (fl = g.filterlist; fl; fl = g_list_next(fl)) {
+      f = fl->data;
+      if ((owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) ||
+          (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT)) {
+        if (owl_filter_message_match(f, m)) {
+          if (owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) fg=owl_filter_get_fgcolor(f);
+          if (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT) bg=owl_filter_get_bgcolor(f);
+        }
+      }
     }
-    fmtext_cache_next++;
-    if(fmtext_cache_next - fmtext_cache == OWL_FMTEXT_CACHE_SIZE)
-        fmtext_cache_next = fmtext_cache;
-    return f;
+    cache->fgcolor = fg;
+    cache->bgcolor = bg;
+    cache->colorgen = gen;
+  }
+  *fgcolor = m->fgcolor;
+  *bgcolor = m->bgcolor;
+}
+
+/* Attributes most messages carry, and most lookups ask for.  Each has
+ * a fixed slot at the start of a message's attribute table, after
+ * which comes an open-addressed hash table, keyed by the interned
+ * name, for everything else.
+ */
+static const char *const owl_message_fixed_attr_names[OWL_MESSAGE_NUM_FIXED_ATTRS] = {
+  "type", "class", "instance", "sender", "recipient", "body",
+  "opcode", "realm", "zsig", "isprivate", "loginout"
+};
+
+static const char *owl_message_fixed_attr_keys[OWL_MESSAGE_NUM_FIXED_ATTRS];
+
+static gpointer owl_message_intern_fixed_attrs_once(gpointer data)
+{
+  int i;
+
+  for (i = 0; i < OWL_MESSAGE_NUM_FIXED_ATTRS; i++)
+    owl_message_fixed_attr_keys[i] = g_intern_string(owl_message_fixed_attr_names[i]);
+  return NULL;
+}
+
+/* Messages are made on other threads too, so the keys are interned
+ * only once, and seen whole by every thread */
+static void owl_message_intern_fixed_attrs(void)
+{
+  static GOnce once = G_ONCE_INIT;
+
+  g_once(&once, owl_message_intern_fixed_attrs_once, NULL);
+}
+
+static void owl_message_create_attrs(owl_message *m)
+{
+  owl_message_intern_fixed_attrs();
+  m->attrsize = OWL_MESSAGE_ATTR_TABLE_SIZE;
+  m->numattrs = 0;
+  m->attributes = g_new0(owl_message_attr, OWL_MESSAGE_NUM_FIXED_ATTRS + m->attrsize);
+}
+
+/* Return the slot of 'm' which holds the attribute named by the
+ * interned string 'key', or the free slot where it belongs. */
+static owl_message_attr *owl_message_find_attr(const owl_message *m, const char *key)
+{
+  owl_message_attr *table = m->attributes + OWL_MESSAGE_NUM_FIXED_ATTRS;
+  guint mask = m->attrsize - 1;
+  guint i;
+
+  for (i = 0; i < OWL_MESSAGE_NUM_FIXED_ATTRS; i++) {
+    if (owl_message_fixed_attr_keys[i] == key)
+      return &m->attributes[i];
+  }
+
+  /* The table is never more than 3/4 full, so this ends. */
+  for (i = (((gsize)key >> 3) * 2654435761U) & mask; ; i = (i + 1) & mask) {
+    if (table[i].key == key || table[i].key == NULL)
+      return &table[i];
+  }
+}
+
+static void owl_message_grow_attrs(owl_message *m)
+{
+  owl_message_attr *old = m->attributes;
+  int i, oldsize = m->attrsize;
+
+  m->attrsize *= 2;
+  m->attributes = g_new0(owl_message_attr, OWL_MESSAGE_NUM_FIXED_ATTRS + m->attrsize);
+  memcpy(m->attributes, old, OWL_MESSAGE_NUM_FIXED_ATTRS * sizeof(owl_message_attr));
+  for (i = OWL_MESSAGE_NUM_FIXED_ATTRS; i < OWL_MESSAGE_NUM_FIXED_ATTRS + oldsize; i++) {
+    if (old[i].key)
+      *owl_message_find_attr(m, old[i].key) = old[i];
+  }
+  g_free(old);
+}
+
+static const char *owl_message_get_fixed_attr(const owl_message *m, int slot)
+{
+  return m->attributes[slot].value;
+}
+
+/* Every live message, by id, whether or not it is in a message list */
+static GHashTable *owl_message_registry = NULL;
+
+/* Return the live message with id 'id', or NULL if it has been freed */
+owl_message *owl_message_get_by_id(int id)
+{
+  owl_message *m;
+
+  if (!owl_message_registry) return NULL;
+  m = g_hash_table_lookup(owl_message_registry, GINT_TO_POINTER(id));
+  if (m && m->id != id) return NULL;
+  return m;
 }
 
 void owl_message_init(owl_message *m)
 {
-  m->id=owl_global_get_nextmsgid(&g);
+  owl_message_init_without_id(m);
+  owl_message_set_id(m, owl_global_get_nextmsgid(&g));
+}
+
+/* Like owl_message_init, but leave the message without an id until
+ * owl_message_set_id gives it one.  Unlike owl_message_init, this may
+ * be called off the main thread. */
+void owl_message_init_without_id(owl_message *m)
+{
+  char buf[26];
+
+  owl_message_invalidate_filter_memo(m);
+  m->id=-1;
+  m->searchindexed=0;
+  m->searchkeys=NULL;
+  m->searchgen=0;
+  m->perlobjs=NULL;
   owl_message_set_direction_none(m);
   m->delete=0;
 
   owl_message_set_hostname(m, "");
-  owl_list_create(&(m->attributes));
+  owl_message_create_attrs(m);
   
   /* save the time */
   m->time=time(NULL);
-  m->timestr=g_strdup(ctime(&(m->time)));
+  m->timestr=g_strdup(ctime_r(&(m->time), buf));
   m->timestr[strlen(m->timestr)-1]='\0';
 
   m->fmtext = NULL;
 }
 
+/* Give 'm' the id 'id', by which owl_message_get_by_id will find it */
+void owl_message_set_id(owl_message *m, int id)
+{
+  m->id=id;
+  if (!owl_message_registry)
+    owl_message_registry = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(owl_message_registry, GINT_TO_POINTER(m->id), m);
+}
+
 /* add the named attribute to the message.  If an attribute with the
  * name already exists, replace the old value with the new value
  */
 void owl_message_set_attribute(owl_message *m, const char *attrname, const char *attrvalue)
 {
-  int i, j;
-  owl_pair *p = NULL, *pair = NULL;
+  owl_message_attr *attr;
 
   attrname = g_intern_string(attrname);
-
-  /* look for an existing pair with this key, */
-  j=owl_list_get_size(&(m->attributes));
-  for (i=0; i<j; i++) {
-    p=owl_list_get_element(&(m->attributes), i);
-    if (owl_pair_get_key(p) == attrname) {
-      g_free(owl_pair_get_value(p));
-      pair = p;
-      break;
+  owl_message_invalidate_filter_memo(m);
+
+  attr = owl_message_find_attr(m, attrname);
+  if (attr->key) {
+    g_free(attr->value);
+  } else if (attr >= m->attributes + OWL_MESSAGE_NUM_FIXED_ATTRS) {
+    if (4 * (m->numattrs + 1) > 3 * m->attrsize) {
+      owl_message_grow_attrs(m);
+      attr = owl_message_find_attr(m, attrname);
     }
+    m->numattrs++;
   }
-
-  if(pair ==  NULL) {
-    pair = g_new(owl_pair, 1);
-    owl_pair_create(pair, attrname, NULL);
-    owl_list_append_element(&(m->attributes), pair);
-  }
-  owl_pair_set_value(pair, owl_validate_or_convert(attrvalue));
+  attr->key = attrname;
+  attr->value = owl_validate_or_convert(attrvalue);
+  if (m->searchindexed)
+    owl_searchindex_forget_format(m);
 }
 
 /* return the value associated with the named attribute, or NULL if
@@ -86,30 +335,44 @@ void owl_message_set_attribute(owl_message *m, const char *attrname, const char
  */
 const char *owl_message_get_attribute_value(const owl_message *m, const char *attrname)
 {
-  int i, j;
-  owl_pair *p;
   GQuark quark;
 
   quark = g_quark_try_string(attrname);
   if (quark == 0)
     /* don't bother inserting into string table */
     return NULL;
-  attrname = g_quark_to_string(quark);
+  return owl_message_get_attribute_value_interned(m, g_quark_to_string(quark));
+}
 
-  j=owl_list_get_size(&(m->attributes));
-  for (i=0; i<j; i++) {
-    p=owl_list_get_element(&(m->attributes), i);
-    if (owl_pair_get_key(p) == attrname) {
-      return(owl_pair_get_value(p));
+/* As owl_message_get_attribute_value, for a name already interned
+ * with g_intern_string.
+ */
+const char *owl_message_get_attribute_value_interned(const owl_message *m, const char *attrname)
+{
+  const owl_message_attr *attr;
+
+  if (attrname == NULL) return NULL;
+  attr = owl_message_find_attr(m, attrname);
+  return attr->key ? attr->value : NULL;
+}
+
+/* Step through the attributes of 'm'.  Start with *iter set to 0;
+ * each call stores the next attribute's name and value and returns 1,
+ * until there are none left and it returns 0.
+ */
+int owl_message_next_attribute(const owl_message *m, int *iter, const char **attrname, const char **attrvalue)
+{
+  const owl_message_attr *attr;
+
+  while (*iter < OWL_MESSAGE_NUM_FIXED_ATTRS + m->attrsize) {
+    attr = &m->attributes[(*iter)++];
+    if (attr->key) {
+      *attrname = attr->key;
+      *attrvalue = attr->value;
+      return 1;
     }
   }
-
-  /*
-  owl_function_debugmsg("No attribute %s found for message %i",
-			attrname,
-			owl_message_get_id(m));
-  */
-  return(NULL);
+  return 0;
 }
 
 /* We cheat and indent it for now, since we really want this for
@@ -117,24 +380,21 @@ const char *owl_message_get_attribute_value(const owl_message *m, const char *at
  * function to indent fmtext.
  */
 void owl_message_attributes_tofmtext(const owl_message *m, owl_fmtext *fm) {
-  int i, j;
-  owl_pair *p;
+  int iter = 0;
+  const char *key, *value;
   char *buff, *tmpbuff;
 
   owl_fmtext_init_null(fm);
 
-  j=owl_list_get_size(&(m->attributes));
-  for (i=0; i<j; i++) {
-    p=owl_list_get_element(&(m->attributes), i);
-
-    tmpbuff = g_strdup(owl_pair_get_value(p));
+  while (owl_message_next_attribute(m, &iter, &key, &value)) {
+    tmpbuff = g_strdup(value);
     g_strdelimit(tmpbuff, "\n", '~');
     g_strdelimit(tmpbuff, "\r", '!');
-    buff = g_strdup_printf("  %-15.15s: %s\n", owl_pair_get_key(p), tmpbuff);
+    buff = g_strdup_printf("  %-15.15s: %s\n", key, tmpbuff);
     g_free(tmpbuff);
 
     if(buff == NULL) {
-      buff = g_strdup_printf("  %-15.15s: %s\n", owl_pair_get_key(p), "<error>");
+      buff = g_strdup_printf("  %-15.15s: %s\n", key, "<error>");
       if(buff == NULL)
         buff=g_strdup("   <error>\n");
     }
@@ -145,9 +405,14 @@ void owl_message_attributes_tofmtext(const owl_message *m, owl_fmtext *fm) {
 
 void owl_message_invalidate_format(owl_message *m)
 {
-  if(m->fmtext) {
-    m->fmtext->message = NULL;
-    owl_fmtext_clear(&(m->fmtext->fmtext));
+  owl_fmtext_cache *f = m->fmtext;
+
+  if(f) {
+    owl_message_fmtext_cache_unlink(f);
+    fmtext_cache_bytes -= f->size;
+    fmtext_cache_entries--;
+    owl_fmtext_cleanup(&(f->fmtext));
+    g_free(f);
     m->fmtext=NULL;
   }
 }
@@ -162,16 +427,60 @@ void owl_message_format(owl_message *m)
 {
   const owl_style *s;
   const owl_view *v;
+  owl_fmtext_cache *f = m->fmtext;
+
+  if (f) {
+    fmtext_cache_hits++;
+    if (f != fmtext_cache_head) {
+      owl_message_fmtext_cache_unlink(f);
+      owl_message_fmtext_cache_push(f);
+    }
+    return;
+  }
+
+  fmtext_cache_misses++;
+  f = g_new0(owl_fmtext_cache, 1);
+  f->message = m;
+  f->serial = ++fmtext_cache_serial;
+  owl_fmtext_init_null(&(f->fmtext));
+  m->fmtext = f;
+  owl_message_fmtext_cache_push(f);
+  fmtext_cache_entries++;
 
-  if (!m->fmtext) {
-    m->fmtext = owl_message_next_fmtext();
-    m->fmtext->message = m;
-    /* for now we assume there's just the one view and use that style */
-    v=owl_global_get_current_view(&g);
-    s=owl_view_get_style(v);
+  /* for now we assume there's just the one view and use that style */
+  v=owl_global_get_current_view(&g);
+  s=owl_view_get_style(v);
 
-    owl_style_get_formattext(s, &(m->fmtext->fmtext), m);
+  owl_style_get_formattext(s, &(f->fmtext), m);
+  owl_searchindex_note_format(m, owl_fmtext_get_text(&(f->fmtext)));
+
+  f->size = sizeof(*f) + f->fmtext.buff->allocated_len;
+  fmtext_cache_bytes += f->size;
+  owl_message_fmtext_cache_trim(f);
+}
+
+/* Index 'm' for searching as the current style formats it, unless its
+ * entry is already trusted, if that can be done without perl.  The
+ * text is not kept in the format cache.
+ */
+void owl_message_index_format(owl_message *m)
+{
+  const owl_style *s;
+  owl_fmtext fm;
+
+  if (!owl_message_is_searchindexed(m) || owl_searchindex_is_current(m))
+    return;
+  if (m->fmtext) {
+    owl_searchindex_note_format(m, owl_fmtext_get_text(&(m->fmtext->fmtext)));
+    return;
   }
+
+  s=owl_view_get_style(owl_global_get_current_view(&g));
+  if (!s || !s->format_message) return;
+  owl_fmtext_init_null(&fm);
+  if (owl_style_get_native_formattext(s, &fm, m))
+    owl_searchindex_note_format(m, owl_fmtext_get_text(&fm));
+  owl_fmtext_cleanup(&fm);
 }
 
 void owl_message_set_class(owl_message *m, const char *class)
@@ -183,7 +492,7 @@ const char *owl_message_get_class(const owl_message *m)
 {
   const char *class;
 
-  class=owl_message_get_attribute_value(m, "class");
+  class=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_CLASS);
   if (!class) return("");
   return(class);
 }
@@ -197,7 +506,7 @@ const char *owl_message_get_instance(const owl_message *m)
 {
   const char *instance;
 
-  instance=owl_message_get_attribute_value(m, "instance");
+  instance=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_INSTANCE);
   if (!instance) return("");
   return(instance);
 }
@@ -211,7 +520,7 @@ const char *owl_message_get_sender(const owl_message *m)
 {
   const char *sender;
 
-  sender=owl_message_get_attribute_value(m, "sender");
+  sender=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_SENDER);
   if (!sender) return("");
   return(sender);
 }
@@ -225,7 +534,7 @@ const char *owl_message_get_zsig(const owl_message *m)
 {
   const char *zsig;
 
-  zsig=owl_message_get_attribute_value(m, "zsig");
+  zsig=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_ZSIG);
   if (!zsig) return("");
   return(zsig);
 }
@@ -241,7 +550,7 @@ const char *owl_message_get_recipient(const owl_message *m)
 
   const char *recip;
 
-  recip=owl_message_get_attribute_value(m, "recipient");
+  recip=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_RECIPIENT);
   if (!recip) return("");
   return(recip);
 }
@@ -255,7 +564,7 @@ const char *owl_message_get_realm(const owl_message *m)
 {
   const char *realm;
   
-  realm=owl_message_get_attribute_value(m, "realm");
+  realm=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_REALM);
   if (!realm) return("");
   return(realm);
 }
@@ -269,7 +578,7 @@ const char *owl_message_get_body(const owl_message *m)
 {
   const char *body;
 
-  body=owl_message_get_attribute_value(m, "body");
+  body=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_BODY);
   if (!body) return("");
   return(body);
 }
@@ -284,7 +593,7 @@ const char *owl_message_get_opcode(const owl_message *m)
 {
   const char *opcode;
 
-  opcode=owl_message_get_attribute_value(m, "opcode");
+  opcode=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_OPCODE);
   if (!opcode) return("");
   return(opcode);
 }
@@ -305,7 +614,7 @@ int owl_message_is_loginout(const owl_message *m)
 {
   const char *res;
 
-  res=owl_message_get_attribute_value(m, "loginout");
+  res=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_LOGINOUT);
   if (!res) return(0);
   return(1);
 }
@@ -314,7 +623,7 @@ int owl_message_is_login(const owl_message *m)
 {
   const char *res;
 
-  res=owl_message_get_attribute_value(m, "loginout");
+  res=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_LOGINOUT);
   if (!res) return(0);
   if (!strcmp(res, "login")) return(1);
   return(0);
@@ -325,7 +634,7 @@ int owl_message_is_logout(const owl_message *m)
 {
   const char *res;
 
-  res=owl_message_get_attribute_value(m, "loginout");
+  res=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_LOGINOUT);
   if (!res) return(0);
   if (!strcmp(res, "logout")) return(1);
   return(0);
@@ -340,7 +649,7 @@ int owl_message_is_private(const owl_message *m)
 {
   const char *res;
 
-  res=owl_message_get_attribute_value(m, "isprivate");
+  res=owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_ISPRIVATE);
   if (!res) return(0);
   return !strcmp(res, "true");
 }
@@ -377,7 +686,7 @@ void owl_message_set_type(owl_message *m, const char* type)
 }
 
 int owl_message_is_type(const owl_message *m, const char *type) {
-  const char * t = owl_message_get_attribute_value(m, "type");
+  const char * t = owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_TYPE);
   if(!t) return 0;
   return !strcasecmp(t, type);
 }
@@ -422,21 +731,25 @@ const char *owl_message_get_text(owl_message *m)
 
 void owl_message_set_direction_in(owl_message *m)
 {
+  owl_message_invalidate_filter_memo(m);
   m->direction=OWL_MESSAGE_DIRECTION_IN;
 }
 
 void owl_message_set_direction_out(owl_message *m)
 {
+  owl_message_invalidate_filter_memo(m);
   m->direction=OWL_MESSAGE_DIRECTION_OUT;
 }
 
 void owl_message_set_direction_none(owl_message *m)
 {
+  owl_message_invalidate_filter_memo(m);
   m->direction=OWL_MESSAGE_DIRECTION_NONE;
 }
 
 void owl_message_set_direction(owl_message *m, int direction)
 {
+  owl_message_invalidate_filter_memo(m);
   m->direction=direction;
 }
 
@@ -468,12 +781,14 @@ int owl_message_get_numlines(owl_message *m)
 void owl_message_mark_delete(owl_message *m)
 {
   if (m == NULL) return;
+  owl_message_invalidate_filter_memo(m);
   m->delete=1;
 }
 
 void owl_message_unmark_delete(owl_message *m)
 {
   if (m == NULL) return;
+  owl_message_invalidate_filter_memo(m);
   m->delete=0;
 }
 
@@ -510,7 +825,20 @@ void *owl_message_get_notice(const owl_message *m)
 
 void owl_message_set_hostname(owl_message *m, const char *hostname)
 {
+  owl_message_invalidate_filter_memo(m);
   m->hostname = g_intern_string(hostname);
+  if (m->searchindexed)
+    owl_searchindex_forget_format(m);
+}
+
+int owl_message_is_searchindexed(const owl_message *m)
+{
+  return m->searchindexed;
+}
+
+void owl_message_set_searchindexed(owl_message *m, int indexed)
+{
+  m->searchindexed = indexed;
 }
 
 const char *owl_message_get_hostname(const owl_message *m)
@@ -630,7 +958,7 @@ int owl_message_get_id(const owl_message *m)
 }
 
 const char *owl_message_get_type(const owl_message *m) {
-  const char * type = owl_message_get_attribute_value(m, "type");
+  const char * type = owl_message_get_fixed_attr(m, OWL_MESSAGE_ATTR_TYPE);
   if(!type) {
     return "generic";
   }
@@ -773,17 +1101,58 @@ void owl_message_save_ccs(owl_message *m) {
 }
 
 #ifdef HAVE_LIBZEPHYR
-void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
+/* Copy the address 'n' came from into 'sa' and return its length */
+static socklen_t owl_message_znotice_addr(const ZNotice_t *n, struct sockaddr_storage *sa)
 {
+#ifndef ZNOTICE_SOCKADDR
+  struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+#endif /* ZNOTICE_SOCKADDR */
+
+  memset(sa, 0, sizeof(*sa));
 #ifdef ZNOTICE_SOCKADDR
-  char hbuf[NI_MAXHOST];
+  memcpy(sa, &n->z_sender_sockaddr, MIN(sizeof(n->z_sender_sockaddr), sizeof(*sa)));
+  return MIN(sizeof(n->z_sender_sockaddr), sizeof(*sa));
 #else /* !ZNOTICE_SOCKADDR */
-  struct hostent *hent;
+  sin->sin_family = AF_INET;
+  sin->sin_addr = n->z_uid.zuid_addr;
+  return sizeof(*sin);
 #endif /* ZNOTICE_SOCKADDR */
+}
+
+/* Set the body of the zephyr 'm' from its notice */
+static void owl_message_set_body_from_znotice(owl_message *m, int newlinestrip)
+{
   char *tmp, *tmp2;
+
+  tmp=owl_zephyr_get_message(&m->notice, m);
+  if (newlinestrip) {
+    tmp2=owl_util_stripnewlines(tmp);
+    owl_message_set_body(m, tmp2);
+    g_free(tmp2);
+  } else {
+    owl_message_set_body(m, tmp);
+  }
+  g_free(tmp);
+}
+
+/* Fill in what of 'm' can be made from the zephyr 'n' alone, where
+ * 'realm' is ours, read on the main thread.  The rest is left to
+ * owl_message_finish_from_znotice; until then the hostname is the
+ * numeric address.  Unlike owl_message_create_from_znotice, this uses
+ * no global state, libzephyr's included, and may be called off the
+ * main thread.
+ */
+void owl_message_build_from_znotice(owl_message *m, const ZNotice_t *n, int newlinestrip, const char *realm)
+{
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char abuf[NI_MAXHOST];
+  char buf[26];
+  char *tmp;
+  const char *at;
   int len;
 
-  owl_message_init(m);
+  owl_message_init_without_id(m);
   
   owl_message_set_type_zephyr(m);
   owl_message_set_direction_in(m);
@@ -797,7 +1166,7 @@ void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
   /* save the time, we need to nuke the string saved by message_init */
   if (m->timestr) g_free(m->timestr);
   m->time=n->z_time.tv_sec;
-  m->timestr=g_strdup(ctime(&(m->time)));
+  m->timestr=g_strdup(ctime_r(&(m->time), buf));
   m->timestr[strlen(m->timestr)-1]='\0';
 
   /* set other info */
@@ -812,7 +1181,9 @@ void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
   }
   owl_message_set_zsig(m, owl_zephyr_get_zsig(n, &len));
 
-  owl_message_set_realm(m, zuser_realm(n->z_recipient));
+  /* as zuser_realm does, but with the realm we were given */
+  at = strrchr(n->z_recipient, '@');
+  owl_message_set_realm(m, at && at[1] ? at + 1 : realm);
 
   /* Set the "isloginout" attribute if it's a login message */
   if (!strcasecmp(n->z_class, "login") || !strcasecmp(n->z_class, OWL_WEBZEPHYR_CLASS)) {
@@ -847,63 +1218,35 @@ void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
     owl_message_set_attribute(m, "isauto", "");
   }
 
-  /* save the hostname */
-#ifdef ZNOTICE_SOCKADDR
-  owl_function_debugmsg("About to do getnameinfo");
-  if (getnameinfo(&n->z_sender_sockaddr.sa, sizeof(n->z_sender_sockaddr), hbuf, sizeof(hbuf), NULL, 0, 0) == 0)
-    owl_message_set_hostname(m, hbuf);
-#else /* !ZNOTICE_SOCKADDR */
-  owl_function_debugmsg("About to do gethostbyaddr");
-  hent = gethostbyaddr(&n->z_uid.zuid_addr, sizeof(n->z_uid.zuid_addr), AF_INET);
-  if (hent && hent->h_name)
-    owl_message_set_hostname(m, hent->h_name);
-  else
-    owl_message_set_hostname(m, inet_ntoa(n->z_sender_addr));
-#endif /* ZNOTICE_SOCKADDR */
+  /* save the numeric address for now; looking up its name is left to
+   * the main thread */
+  salen = owl_message_znotice_addr(n, &sa);
+  if (getnameinfo((struct sockaddr *)&sa, salen, abuf, sizeof(abuf), NULL, 0, NI_NUMERICHOST) == 0)
+    owl_message_set_hostname(m, abuf);
 
-  /* set the body */
-  tmp=owl_zephyr_get_message(n, m);
-  if (owl_global_is_newlinestrip(&g)) {
-    tmp2=owl_util_stripnewlines(tmp);
-    owl_message_set_body(m, tmp2);
-    g_free(tmp2);
-  } else {
-    owl_message_set_body(m, tmp);
-  }
-  g_free(tmp);
+  owl_message_set_body_from_znotice(m, newlinestrip);
+}
 
-  /* if zcrypt is enabled try to decrypt the message */
-  if (owl_global_is_zcrypt(&g) && !strcasecmp(n->z_opcode, "crypt")) {
-    const char *argv[] = {
-      "zcrypt",
-      "-D",
-      "-c", owl_message_get_class(m),
-      "-i", owl_message_get_instance(m),
-      NULL
-    };
-    char *out;
-    int rv;
-    int status;
-    char *zcrypt;
-
-    zcrypt = g_strdup_printf("%s/zcrypt", owl_get_bindir());
-
-    rv = call_filter(zcrypt, argv, owl_message_get_body(m), &out, &status);
-    g_free(zcrypt);
-
-    if(!rv && !status) {
-      int len = strlen(out);
-      if(len >= 8 && !strcmp(out + len - 8, "**END**\n")) {
-        out[len - 8] = 0;
-      }
-      owl_message_set_body(m, out);
-      g_free(out);
-    } else if(out) {
-      g_free(out);
-    }
-  }
+/* On the main thread, finish the zephyr 'm' that
+ * owl_message_build_from_znotice began: give it its id, save its ccs,
+ * which are compared with our realm, and look up its hostname, which
+ * is filled in once it is known.
+ */
+void owl_message_finish_from_znotice(owl_message *m)
+{
+  struct sockaddr_storage sa;
+  socklen_t salen;
 
+  owl_message_set_id(m, owl_global_get_nextmsgid(&g));
   owl_message_save_ccs(m);
+  salen = owl_message_znotice_addr(&m->notice, &sa);
+  owl_resolver_set_hostname(m, (struct sockaddr *)&sa, salen);
+}
+
+void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
+{
+  owl_message_build_from_znotice(m, n, owl_global_is_newlinestrip(&g), owl_zephyr_get_realm());
+  owl_message_finish_from_znotice(m);
 }
 #else
 void owl_message_create_from_znotice(owl_message *m, const void *n)
@@ -911,6 +1254,17 @@ void owl_message_create_from_znotice(owl_message *m, const void *n)
 }
 #endif
 
+/* Set the hostname of the zephyr 'm' to the name looked up for it, and
+ * make again what was made with the numeric address */
+void owl_message_set_zephyr_hostname(owl_message *m, const char *hostname)
+{
+  owl_message_set_hostname(m, hostname);
+#ifdef HAVE_LIBZEPHYR
+  if (owl_zephyr_is_moira(&m->notice))
+    owl_message_set_body_from_znotice(m, owl_global_is_newlinestrip(&g));
+#endif
+}
+
 /* If 'direction' is '0' it is a login message, '1' is a logout message. */
 void owl_message_create_pseudo_zlogin(owl_message *m, int direction, const char *user, const char *host, const char *time, const char *tty)
 {
@@ -1003,8 +1357,13 @@ void owl_message_create_from_zwrite(owl_message *m, const owl_zwrite *z, const c
 
 void owl_message_cleanup(owl_message *m)
 {
-  int i, j;
-  owl_pair *p;
+  int i;
+
+  if (m->searchindexed)
+    owl_searchindex_remove_message(m);
+  /* perl objects still about get what they have not read yet */
+  if (m->perlobjs)
+    owl_perlconfig_message_freed(m);
 #ifdef HAVE_LIBZEPHYR    
   if (owl_message_is_type_zephyr(m) && owl_message_is_direction_in(m)) {
     ZFreeNotice(&(m->notice));
@@ -1013,16 +1372,14 @@ void owl_message_cleanup(owl_message *m)
   if (m->timestr) g_free(m->timestr);
 
   /* free all the attributes */
-  j=owl_list_get_size(&(m->attributes));
-  for (i=0; i<j; i++) {
-    p=owl_list_get_element(&(m->attributes), i);
-    g_free(owl_pair_get_value(p));
-    g_free(p);
-  }
-
-  owl_list_cleanup(&(m->attributes), NULL);
+  for (i = 0; i < OWL_MESSAGE_NUM_FIXED_ATTRS + m->attrsize; i++)
+    g_free(m->attributes[i].value);
+  g_free(m->attributes);
  
   owl_message_invalidate_format(m);
+  /* Messages without ids may be freed off the main thread */
+  if (m->id >= 0 && owl_message_get_by_id(m->id) == m)
+    g_hash_table_remove(owl_message_registry, GINT_TO_POINTER(m->id));
 }
 
 void owl_message_delete(owl_message *m)
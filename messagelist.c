@@ -2,12 +2,146 @@
 #include <stdlib.h>
 #include <string.h>
 
+static const char *const owl_messagelist_index_fields[OWL_MSGINDEX_NUM] = {
+  "class", "instance", "sender", "recipient", "type"
+};
+
 int owl_messagelist_create(owl_messagelist *ml)
 {
   owl_list_create(&(ml->list));
+  ml->indexes = NULL;
   return(0);
 }
 
+static const char *owl_messagelist_index_value(const owl_message *m, int idx)
+{
+  switch (idx) {
+  case OWL_MSGINDEX_CLASS:
+    return owl_message_get_class(m);
+  case OWL_MSGINDEX_INSTANCE:
+    return owl_message_get_instance(m);
+  case OWL_MSGINDEX_SENDER:
+    return owl_message_get_sender(m);
+  case OWL_MSGINDEX_RECIPIENT:
+    return owl_message_get_recipient(m);
+  case OWL_MSGINDEX_TYPE:
+    return owl_message_get_type(m);
+  }
+  return "";
+}
+
+/* Record the message at position 'pos' in each of the list's
+ * indexes. The indexed fields are assumed not to change once a
+ * message is in the list. */
+static void owl_messagelist_index_message(owl_messagelist *ml, const owl_message *m, int pos)
+{
+  int i;
+  const char *val;
+  owl_list *postings;
+
+  for (i = 0; i < OWL_MSGINDEX_NUM; i++) {
+    val = owl_messagelist_index_value(m, i);
+    postings = owl_dict_find_element(&(ml->indexes[i]), val);
+    if (postings == NULL) {
+      postings = g_new(owl_list, 1);
+      owl_list_create(postings);
+      owl_dict_insert_element(&(ml->indexes[i]), val, postings, NULL);
+    }
+    owl_list_append_element(postings, GINT_TO_POINTER(pos));
+  }
+}
+
+static void owl_messagelist_postings_delete(void *data)
+{
+  owl_list *postings = data;
+  owl_list_cleanup(postings, NULL);
+  g_free(postings);
+}
+
+static void owl_messagelist_build_indexes(owl_messagelist *ml)
+{
+  int i, j;
+
+  for (i = 0; i < OWL_MSGINDEX_NUM; i++)
+    owl_dict_create(&(ml->indexes[i]));
+
+  j = owl_list_get_size(&(ml->list));
+  for (i = 0; i < j; i++)
+    owl_messagelist_index_message(ml, owl_list_get_element(&(ml->list), i), i);
+}
+
+static void owl_messagelist_cleanup_indexes(owl_messagelist *ml)
+{
+  int i;
+
+  for (i = 0; i < OWL_MSGINDEX_NUM; i++)
+    owl_dict_cleanup(&(ml->indexes[i]), owl_messagelist_postings_delete);
+}
+
+/* Maintain inverted indexes over the class, instance, sender,
+ * recipient and type of every message in the list, so filters on
+ * those fields can be resolved without visiting every message. */
+void owl_messagelist_enable_indexes(owl_messagelist *ml)
+{
+  if (ml->indexes) return;
+  ml->indexes = g_new(owl_dict, OWL_MSGINDEX_NUM);
+  owl_messagelist_build_indexes(ml);
+}
+
+/* Returns which index covers the named message field, or -1 if it
+ * is not indexed. */
+int owl_messagelist_get_index_for_field(const char *field)
+{
+  int i;
+
+  for (i = 0; i < OWL_MSGINDEX_NUM; i++) {
+    if (!strcasecmp(field, owl_messagelist_index_fields[i]))
+      return i;
+  }
+  return -1;
+}
+
+/* Add to 'set' the position of every message whose field 'idx'
+ * matches 're'.  The regex is run once per distinct value rather
+ * than once per message.  Returns -1 if the list is not indexed.
+ */
+int owl_messagelist_index_match(const owl_messagelist *ml, int idx, const owl_regex *re, unsigned long *set)
+{
+  int i, j, k, n;
+  owl_list keys;
+  const char *key;
+  const owl_list *postings;
+
+  if (ml->indexes == NULL || idx < 0 || idx >= OWL_MSGINDEX_NUM)
+    return -1;
+
+  owl_list_create(&keys);
+  owl_dict_get_keys(&(ml->indexes[idx]), &keys);
+  j = owl_list_get_size(&keys);
+  for (i = 0; i < j; i++) {
+    key = owl_list_get_element(&keys, i);
+    if (owl_regex_compare(re, key, NULL, NULL) != 0)
+      continue;
+    postings = owl_dict_find_element(&(ml->indexes[idx]), key);
+    n = owl_list_get_size(postings);
+    for (k = 0; k < n; k++)
+      OWL_MSGSET_ADD(set, GPOINTER_TO_INT(owl_list_get_element(postings, k)));
+  }
+  owl_list_cleanup(&keys, g_free);
+  return 0;
+}
+
+/* Frees the list and its indexes, but not the messages in it. */
+void owl_messagelist_cleanup(owl_messagelist *ml)
+{
+  owl_list_cleanup(&(ml->list), NULL);
+  if (ml->indexes) {
+    owl_messagelist_cleanup_indexes(ml);
+    g_free(ml->indexes);
+    ml->indexes = NULL;
+  }
+}
+
 int owl_messagelist_get_size(const owl_messagelist *ml)
 {
   return(owl_list_get_size(&(ml->list)));
@@ -43,7 +177,39 @@ owl_message *owl_messagelist_get_by_id(const owl_messagelist *ml, int target_id)
 
 int owl_messagelist_append_element(owl_messagelist *ml, void *element)
 {
-  return(owl_list_append_element(&(ml->list), element));
+  int ret;
+
+  ret = owl_list_append_element(&(ml->list), element);
+  if (ret == 0 && ml->indexes)
+    owl_messagelist_index_message(ml, element, owl_list_get_size(&(ml->list)) - 1);
+  return(ret);
+}
+
+/* Insert the 'n' messages of 'msgs', which are in order of id, where
+ * their ids belong.  They must all belong at the same place.  Returns
+ * the position of the first. */
+int owl_messagelist_insert_elements(owl_messagelist *ml, owl_message *const *msgs, int n)
+{
+  int first, last, mid;
+
+  if (n == 0) return 0;
+  first = 0;
+  last = owl_list_get_size(&(ml->list));
+  while (first < last) {
+    mid = (first + last) / 2;
+    if (owl_message_get_id(owl_list_get_element(&(ml->list), mid)) < owl_message_get_id(msgs[0]))
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  owl_list_insert_elements(&(ml->list), first, (void *const *)msgs, n);
+
+  /* positions have shifted; rebuild the indexes */
+  if (ml->indexes) {
+    owl_messagelist_cleanup_indexes(ml);
+    owl_messagelist_build_indexes(ml);
+  }
+  return first;
 }
 
 /* do we really still want this? */
@@ -86,6 +252,12 @@ int owl_messagelist_expunge(owl_messagelist *ml)
   /* copy the new list to the old list */
   ml->list = newlist;
 
+  /* positions have shifted; rebuild the indexes */
+  if (ml->indexes) {
+    owl_messagelist_cleanup_indexes(ml);
+    owl_messagelist_build_indexes(ml);
+  }
+
   return(0);
 }
 
@@ -94,6 +266,7 @@ void owl_messagelist_invalidate_formats(const owl_messagelist *ml)
   int i, j;
   owl_message *m;
 
+  owl_searchindex_new_generation();
   j=owl_list_get_size(&(ml->list));
   for (i=0; i<j; i++) {
     m=owl_list_get_element(&(ml->list), i);
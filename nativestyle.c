@@ -0,0 +1,677 @@
+#define OWL_PERL
+#include <string.h>
+#include <time.h>
+#include "owl.h"
+
+/* C implementations of BarnOwl::Style::Default and
+ * BarnOwl::Style::OneLine.  These follow the perl styles and the
+ * BarnOwl::Message classes for the message types defined in C, and
+ * leave everything else (messages from perl modules) to perl.
+ */
+
+#define OWL_ONELINE_FORMAT_SIZE 3
+static const int owl_oneline_widths[OWL_ONELINE_FORMAT_SIZE] = { 13, 11, 12 };
+
+/* True under perl's notion of truth for a string. */
+static int owl_nativestyle_is_true(const char *s)
+{
+  return s && *s && strcmp(s, "0");
+}
+
+/* Returns 1 if the message's perl class is one whose behaviour is
+ * mirrored here. */
+static int owl_nativestyle_handles(const owl_message *m)
+{
+  const char *type = owl_message_get_type(m);
+
+  return !strcmp(type, "zephyr") || !strcmp(type, "admin") ||
+    !strcmp(type, "AIM") || !strcmp(type, "loopback") ||
+    !strcmp(type, "generic") || !strcmp(type, "");
+}
+
+static int owl_nativestyle_is_zephyr(const owl_message *m)
+{
+  return !strcmp(owl_message_get_type(m), "zephyr");
+}
+
+/* BarnOwl::Message accessors */
+
+static int owl_nativestyle_is_loginout(const owl_message *m)
+{
+  return owl_message_is_login(m) || owl_message_is_logout(m);
+}
+
+static int owl_nativestyle_is_private(const owl_message *m)
+{
+  const char *type = owl_message_get_type(m);
+
+  if (!strcmp(type, "loopback"))
+    return 1;
+  if (!strcmp(type, "AIM"))
+    return !owl_nativestyle_is_loginout(m);
+  return owl_message_is_private(m);
+}
+
+static int owl_nativestyle_is_personal(const owl_message *m)
+{
+  if (owl_nativestyle_is_zephyr(m))
+    return !strcasecmp(owl_message_get_class(m), "message") &&
+      owl_nativestyle_is_private(m);
+  return owl_nativestyle_is_private(m);
+}
+
+static int owl_nativestyle_is_ping(const owl_message *m)
+{
+  return owl_nativestyle_is_zephyr(m) &&
+    !strcasecmp(owl_message_get_opcode(m), "ping");
+}
+
+/* The 'auth' field, or NULL if it is undefined. */
+static const char *owl_nativestyle_get_auth(const owl_message *m)
+{
+  const char *auth;
+
+  if (!owl_nativestyle_is_zephyr(m))
+    return NULL;
+  /* As in the perl object, an attribute wins over the notice. */
+  auth = owl_message_get_attribute_value(m, "auth");
+#ifdef HAVE_LIBZEPHYR
+  if (!auth && owl_message_is_direction_in(m))
+    auth = owl_zephyr_get_authstr(owl_message_get_notice(m));
+#endif
+  return auth;
+}
+
+static const char *owl_nativestyle_get_body(const owl_message *m)
+{
+  if (!strcmp(owl_message_get_type(m), "generic") ||
+      !strcmp(owl_message_get_type(m), ""))
+    return "";
+  return owl_message_get_body(m);
+}
+
+/* Append 'name' with the local zephyr realm stripped off. */
+static void owl_nativestyle_append_stripped(GString *out, const char *name, const owl_message *m)
+{
+  const char *realm;
+  size_t len, rlen;
+
+  len = strlen(name);
+  if (owl_nativestyle_is_zephyr(m)) {
+    realm = owl_zephyr_get_realm();
+    rlen = strlen(realm);
+    if (len > rlen && name[len - rlen - 1] == '@' &&
+        !strcmp(name + len - rlen, realm))
+      len -= rlen + 1;
+  }
+  g_string_append_len(out, name, len);
+}
+
+static void owl_nativestyle_append_pretty_sender(GString *out, const owl_message *m)
+{
+  owl_nativestyle_append_stripped(out, owl_message_get_sender(m), m);
+}
+
+static void owl_nativestyle_append_pretty_recipient(GString *out, const owl_message *m)
+{
+  owl_nativestyle_append_stripped(out, owl_message_get_recipient(m), m);
+}
+
+/* Append one argument quoted as BarnOwl::quote would. */
+static void owl_nativestyle_append_quoted(GString *out, const char *str)
+{
+  const char *p;
+
+  if (*str == '\0') {
+    g_string_append(out, "''");
+  } else if (!strpbrk(str, "'\" \n\t")) {
+    g_string_append(out, str);
+  } else if (!strchr(str, '\'')) {
+    g_string_append_printf(out, "'%s'", str);
+  } else {
+    g_string_append_c(out, '"');
+    for (p = str; *p; p++) {
+      if (*p == '"')
+        g_string_append(out, "\"'\"'\"");
+      else
+        g_string_append_c(out, *p);
+    }
+    g_string_append_c(out, '"');
+  }
+}
+
+/* BarnOwl::Message::Zephyr::personal_context */
+static char *owl_nativestyle_personal_context(const owl_message *m)
+{
+  GString *out = g_string_new("");
+
+  if (owl_nativestyle_is_zephyr(m)) {
+    if (strcasecmp(owl_message_get_class(m), "message")) {
+      g_string_append(out, "-c ");
+      owl_nativestyle_append_quoted(out, owl_message_get_class(m));
+    }
+    if (strcasecmp(owl_message_get_instance(m), "personal")) {
+      if (out->len) g_string_append_c(out, ' ');
+      g_string_append(out, "-i ");
+      owl_nativestyle_append_quoted(out, owl_message_get_instance(m));
+    }
+  }
+  return g_string_free(out, false);
+}
+
+static const char *owl_nativestyle_short_personal_context(const owl_message *m)
+{
+  if (!owl_nativestyle_is_zephyr(m))
+    return "";
+  if (strcasecmp(owl_message_get_class(m), "message"))
+    return owl_message_get_class(m);
+  if (strcasecmp(owl_message_get_instance(m), "personal"))
+    return owl_message_get_instance(m);
+  return "";
+}
+
+/* BarnOwl::Message::Zephyr::login_extra; NULL if undefined */
+static char *owl_nativestyle_login_extra(const owl_message *m)
+{
+  char *host, *tty = NULL, *extra;
+
+  if (!owl_nativestyle_is_zephyr(m))
+    return g_strdup("");
+  if (!owl_nativestyle_is_loginout(m))
+    return NULL;
+
+  host = g_utf8_strdown(owl_message_get_hostname(m), -1);
+#ifdef HAVE_LIBZEPHYR
+  if (owl_message_is_direction_in(m) &&
+      owl_zephyr_get_num_fields(owl_message_get_notice(m)) >= 3)
+    tty = owl_zephyr_get_field_as_utf8(owl_message_get_notice(m), 3);
+#endif
+  if (!tty)
+    return host;
+  extra = g_strdup_printf("%s %s", host, tty);
+  g_free(host);
+  g_free(tty);
+  return extra;
+}
+
+static void owl_nativestyle_append_time(GString *out, const owl_message *m)
+{
+  const char *format = "%H:%M";
+  SV *sv = get_sv("BarnOwl::timeformat", 0);
+  char buff[256];
+  struct tm tm;
+
+  if (sv && SvOK(sv))
+    format = SvPV_nolen(sv);
+  localtime_r(&(m->time), &tm);
+  if (strftime(buff, sizeof(buff), format, &tm) > 0)
+    g_string_append(out, buff);
+}
+
+/* Append the character 'c' for humanize */
+static void owl_nativestyle_append_humanized_char(GString *out, gunichar c)
+{
+  g_string_append(out, "@b(");
+  if (owl_global_is_colorztext(&g))
+    g_string_append(out, "@color(cyan)");
+  if (c < ' ')
+    g_string_append_printf(out, "^%c", (char)(c + '@'));
+  else if (c == 255)
+    g_string_append(out, "^?");
+  else
+    g_string_append_printf(out, "\\x{%x}", c);
+  g_string_append_c(out, ')');
+}
+
+/* perl's [[:print:]] on character strings */
+static int owl_nativestyle_isprint(gunichar c)
+{
+  switch (g_unichar_type(c)) {
+  case G_UNICODE_CONTROL:
+  case G_UNICODE_SURROGATE:
+  case G_UNICODE_UNASSIGNED:
+  case G_UNICODE_LINE_SEPARATOR:
+  case G_UNICODE_PARAGRAPH_SEPARATOR:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+/* BarnOwl::Style::Default::humanize */
+static void owl_nativestyle_append_humanized(GString *out, const char *s, int oneline)
+{
+  const char *p;
+  gunichar c;
+  int bad;
+
+  for (p = s; *p; p = g_utf8_next_char(p)) {
+    c = g_utf8_get_char(p);
+    if (oneline)
+      bad = g_unichar_iscntrl(c);
+    else
+      bad = (!owl_nativestyle_isprint(c) && c != '\n') ||
+        c == '\r' || c == '\013' || c == '\f';
+    if (bad)
+      owl_nativestyle_append_humanized_char(out, c);
+    else
+      g_string_append_unichar(out, c);
+  }
+}
+
+/* BarnOwl::Style::Default::humanize_short */
+static void owl_nativestyle_append_humanized_short(GString *out, const char *s)
+{
+  const char *p;
+  gunichar c;
+
+  for (p = s; *p; p = g_utf8_next_char(p)) {
+    c = g_utf8_get_char(p);
+    if (g_unichar_iscntrl(c))
+      g_string_append_c(out, '?');
+    else
+      g_string_append_unichar(out, c);
+  }
+}
+
+/* Append 's' with newlines turned into spaces */
+static void owl_nativestyle_append_flattened(GString *out, const char *s)
+{
+  const char *p;
+
+  for (p = s; *p; p++)
+    g_string_append_c(out, *p == '\n' ? ' ' : *p);
+}
+
+/* BarnOwl::Style::boldify */
+static void owl_nativestyle_append_boldified(GString *out, const char *s)
+{
+  const char *p;
+
+  if (!strchr(s, ')')) {
+    g_string_append_printf(out, "@b(%s)", s);
+  } else if (!strchr(s, '>')) {
+    g_string_append_printf(out, "@b<%s>", s);
+  } else if (!strchr(s, '}')) {
+    g_string_append_printf(out, "@b{%s}", s);
+  } else if (!strchr(s, ']')) {
+    g_string_append_printf(out, "@b[%s]", s);
+  } else {
+    g_string_append(out, "@b(");
+    for (p = s; *p; p++) {
+      if (*p == ')')
+        g_string_append(out, ")@b[)]@b(");
+      else
+        g_string_append_c(out, *p);
+    }
+    g_string_append_c(out, ')');
+  }
+}
+
+/* Append 's' in a field exactly 'width' characters wide, as
+ * sprintf("%-W.Ws") does in perl. */
+static void owl_nativestyle_append_column(GString *out, const char *s, int width)
+{
+  const char *end = s;
+  int n = 0;
+
+  while (*end && n < width) {
+    end = g_utf8_next_char(end);
+    n++;
+  }
+  g_string_append_len(out, s, end - s);
+  for (; n < width; n++)
+    g_string_append_c(out, ' ');
+}
+
+static void owl_nativestyle_append_oneline_columns(GString *out, const char *dir, const char *const *cols)
+{
+  int i;
+
+  g_string_append(out, dir);
+  for (i = 0; i < OWL_ONELINE_FORMAT_SIZE; i++) {
+    g_string_append_c(out, ' ');
+    owl_nativestyle_append_column(out, cols[i], owl_oneline_widths[i]);
+  }
+  g_string_append_c(out, ' ');
+}
+
+/* BarnOwl::Style::Default::indent_body */
+static void owl_nativestyle_append_indented_body(GString *out, const owl_message *m)
+{
+  const owl_filter *wrap = owl_global_get_filter(&g, "wordwrap");
+  char *wrapped = NULL;
+  const char *body, *p;
+  size_t start = out->len;
+
+  body = owl_nativestyle_get_body(m);
+  if (wrap && owl_filter_message_match(wrap, m))
+    body = wrapped = owl_text_wordwrap(body, owl_global_get_cols(&g) - 9);
+
+  g_string_append(out, "    ");
+  for (p = body; *p; p++) {
+    g_string_append_c(out, *p);
+    if (*p == '\n' && p[1] && p[1] != '\n')
+      g_string_append(out, "    ");
+  }
+  while (out->len > start && out->str[out->len - 1] == '\n')
+    g_string_truncate(out, out->len - 1);
+
+  g_free(wrapped);
+}
+
+static void owl_nativestyle_default_login(GString *out, const owl_message *m)
+{
+  char *extra = owl_nativestyle_login_extra(m);
+
+  g_string_append(out, owl_message_is_login(m) ? "@b<LOGIN" : "@b<LOGOUT");
+  if (owl_nativestyle_is_zephyr(m) && !*owl_message_get_zsig(m))
+    g_string_append(out, "(PSEUDO)");
+  g_string_append(out, "> for @b(");
+  owl_nativestyle_append_pretty_sender(out, m);
+  g_string_append_printf(out, ") (%s) ", extra ? extra : "");
+  owl_nativestyle_append_time(out, m);
+  g_free(extra);
+}
+
+static void owl_nativestyle_default_ping(GString *out, const owl_message *m)
+{
+  char *context = owl_nativestyle_personal_context(m);
+
+  g_string_append(out, "@b(PING)");
+  if (*context)
+    g_string_append_printf(out, " [%s]", context);
+  g_string_append(out, " from @b(");
+  owl_nativestyle_append_pretty_sender(out, m);
+  g_string_append_c(out, ')');
+  g_free(context);
+}
+
+static void owl_nativestyle_default_admin(GString *out, const owl_message *m)
+{
+  g_string_append(out, "@bold(OWL ADMIN)\n");
+  owl_nativestyle_append_indented_body(out, m);
+}
+
+static void owl_nativestyle_default_chat_header(GString *out, const owl_message *m)
+{
+  const char *auth = owl_nativestyle_get_auth(m);
+  const char *opcode, *zsig;
+  char *context;
+  size_t start = out->len;
+  gunichar c;
+
+  if (owl_nativestyle_is_personal(m)) {
+    g_string_append(out, owl_message_get_type(m));
+    context = owl_nativestyle_personal_context(m);
+    if (*context) {
+      g_string_append(out, " [");
+      owl_nativestyle_append_humanized(out, context, 1);
+      g_string_append_c(out, ']');
+    }
+    g_free(context);
+
+    if (owl_message_is_direction_out(m)) {
+      g_string_append(out, " sent to ");
+      owl_nativestyle_append_pretty_recipient(out, m);
+    } else {
+      g_string_append(out, " from ");
+    }
+    /* ucfirst */
+    if (out->len > start) {
+      c = g_utf8_get_char(out->str + start);
+      if (g_unichar_totitle(c) != c) {
+        g_string_erase(out, start, g_utf8_next_char(out->str + start) - (out->str + start));
+        g_string_insert_unichar(out, start, g_unichar_totitle(c));
+      }
+    }
+    if (!owl_message_is_direction_out(m)) {
+      if (auth && strcmp(auth, "YES"))
+        g_string_append(out, "UNAUTH: ");
+      owl_nativestyle_append_pretty_sender(out, m);
+    }
+  } else {
+    if (owl_nativestyle_is_zephyr(m)) {
+      owl_nativestyle_append_humanized(out, owl_message_get_class(m), 1);
+      g_string_append(out, " / ");
+      owl_nativestyle_append_humanized(out, owl_message_get_instance(m), 1);
+    } else {
+      g_string_append(out, " / ");
+    }
+    g_string_append(out, " / ");
+    if (auth && strcmp(auth, "YES"))
+      g_string_append(out, "UNAUTH: ");
+    g_string_append(out, "@b{");
+    owl_nativestyle_append_pretty_sender(out, m);
+    g_string_append_c(out, '}');
+  }
+
+  opcode = owl_nativestyle_is_zephyr(m) ? owl_message_get_opcode(m) : NULL;
+  if (owl_nativestyle_is_true(opcode)) {
+    g_string_append(out, " [");
+    owl_nativestyle_append_humanized(out, opcode, 1);
+    g_string_append_c(out, ']');
+  }
+  g_string_append(out, "  ");
+  owl_nativestyle_append_time(out, m);
+
+  zsig = owl_nativestyle_is_zephyr(m) ? owl_message_get_zsig(m) : "";
+  g_string_append(out, "  (");
+  g_string_append_len(out, zsig, strcspn(zsig, "\n"));
+  if (owl_global_is_colorztext(&g))
+    g_string_append(out, "@color[default]");
+  g_string_append_c(out, ')');
+}
+
+static void owl_nativestyle_default_chat(GString *out, const owl_message *m)
+{
+  owl_nativestyle_default_chat_header(out, m);
+  g_string_append_c(out, '\n');
+  owl_nativestyle_append_indented_body(out, m);
+}
+
+static void owl_nativestyle_oneline_login(GString *out, const owl_message *m)
+{
+  GString *sender = g_string_new("");
+  const char *cols[OWL_ONELINE_FORMAT_SIZE];
+  char *extra;
+
+  owl_nativestyle_append_pretty_sender(sender, m);
+  cols[0] = owl_message_get_type(m);
+  cols[1] = owl_message_is_login(m) ? "LOGIN" : "LOGOUT";
+  cols[2] = sender->str;
+  owl_nativestyle_append_oneline_columns(out, "<", cols);
+
+  extra = owl_nativestyle_login_extra(m);
+  if (owl_nativestyle_is_true(extra))
+    g_string_append_printf(out, "at %s", extra);
+  g_free(extra);
+  g_string_free(sender, true);
+}
+
+static void owl_nativestyle_oneline_ping(GString *out, const owl_message *m)
+{
+  GString *sender = g_string_new("");
+  const char *cols[OWL_ONELINE_FORMAT_SIZE];
+
+  owl_nativestyle_append_pretty_sender(sender, m);
+  cols[0] = owl_message_get_type(m);
+  cols[1] = "PING";
+  cols[2] = sender->str;
+  owl_nativestyle_append_oneline_columns(out, "<", cols);
+  g_string_free(sender, true);
+}
+
+static void owl_nativestyle_oneline_admin(GString *out, const owl_message *m)
+{
+  const char *cols[OWL_ONELINE_FORMAT_SIZE] = { "ADMIN", "", "" };
+
+  owl_nativestyle_append_oneline_columns(out, "<", cols);
+  owl_nativestyle_append_flattened(out, owl_message_get_body(m));
+}
+
+static void owl_nativestyle_oneline_chat(GString *out, const owl_message *m)
+{
+  GString *line = g_string_new("");
+  GString *who = g_string_new("");
+  const char *cols[OWL_ONELINE_FORMAT_SIZE];
+  const char *dir = "-";
+
+  if (owl_message_is_direction_in(m))
+    dir = "<";
+  else if (owl_message_is_direction_out(m))
+    dir = ">";
+
+  if (owl_message_is_direction_out(m))
+    owl_nativestyle_append_pretty_recipient(who, m);
+  else
+    owl_nativestyle_append_pretty_sender(who, m);
+
+  if (owl_nativestyle_is_personal(m)) {
+    cols[0] = owl_message_get_type(m);
+    cols[1] = owl_nativestyle_short_personal_context(m);
+  } else if (owl_nativestyle_is_zephyr(m)) {
+    cols[0] = owl_message_get_class(m);
+    cols[1] = owl_message_get_instance(m);
+  } else {
+    cols[0] = cols[1] = "";
+  }
+  cols[2] = who->str;
+  owl_nativestyle_append_oneline_columns(line, dir, cols);
+  owl_nativestyle_append_flattened(line, owl_message_get_body(m));
+
+  owl_nativestyle_append_humanized_short(out, line->str);
+  g_string_free(line, true);
+  g_string_free(who, true);
+}
+
+/* BarnOwl::Style::Default::format_message, with the per-kind
+ * formatters of either style. */
+static int owl_nativestyle_format(const owl_message *m, GString *out, int oneline)
+{
+  GString *fmt;
+
+  if (!owl_nativestyle_handles(m))
+    return 0;
+
+  fmt = g_string_new("");
+  if (owl_nativestyle_is_loginout(m)) {
+    if (oneline)
+      owl_nativestyle_oneline_login(fmt, m);
+    else
+      owl_nativestyle_default_login(fmt, m);
+  } else if (owl_nativestyle_is_ping(m) && owl_nativestyle_is_personal(m)) {
+    if (oneline)
+      owl_nativestyle_oneline_ping(fmt, m);
+    else
+      owl_nativestyle_default_ping(fmt, m);
+  } else if (!strcmp(owl_message_get_type(m), "admin")) {
+    if (oneline)
+      owl_nativestyle_oneline_admin(fmt, m);
+    else
+      owl_nativestyle_default_admin(fmt, m);
+  } else {
+    if (oneline)
+      owl_nativestyle_oneline_chat(fmt, m);
+    else
+      owl_nativestyle_default_chat(fmt, m);
+  }
+
+  if (owl_nativestyle_is_personal(m) && owl_message_is_direction_in(m)) {
+    GString *bold = g_string_new("");
+    owl_nativestyle_append_boldified(bold, fmt->str);
+    g_string_free(fmt, true);
+    fmt = bold;
+  }
+  owl_nativestyle_append_humanized(out, fmt->str, 0);
+  g_string_free(fmt, true);
+  return 1;
+}
+
+/* Packages whose subs the formatters here stand in for.  Redefining
+ * any sub in them (from a config file, say) bumps the package's
+ * generation, and the formatters then leave the message to perl. */
+static const char *const owl_nativestyle_default_packages[] = {
+  "BarnOwl::Style::Default",
+  "BarnOwl::Message", "BarnOwl::Message::Admin", "BarnOwl::Message::AIM",
+  "BarnOwl::Message::Generic", "BarnOwl::Message::Loopback",
+  "BarnOwl::Message::Zephyr",
+  NULL
+};
+static const char *const owl_nativestyle_oneline_packages[] = {
+  "BarnOwl::Style::OneLine",
+  NULL
+};
+
+static unsigned long owl_nativestyle_default_gen;
+static unsigned long owl_nativestyle_oneline_gen;
+
+/* Sum of the method generations of 'packages'. */
+static unsigned long owl_nativestyle_generation(const char *const *packages)
+{
+  unsigned long gen = 0;
+  HV *stash;
+
+  for (; *packages; packages++) {
+    stash = gv_stashpv(*packages, 0);
+    if (stash)
+      gen += HvMROMETA(stash)->pkg_gen;
+  }
+  return gen;
+}
+
+/* Returns 1 if the subs of the default style (and, for 'oneline', of
+ * the OneLine style) are still the ones seen when it was registered. */
+static int owl_nativestyle_is_stock(int oneline)
+{
+  if (owl_nativestyle_generation(owl_nativestyle_default_packages) != owl_nativestyle_default_gen)
+    return 0;
+  return !oneline ||
+    owl_nativestyle_generation(owl_nativestyle_oneline_packages) == owl_nativestyle_oneline_gen;
+}
+
+static int owl_nativestyle_format_default(const owl_message *m, GString *out)
+{
+  if (!owl_nativestyle_is_stock(0))
+    return 0;
+  return owl_nativestyle_format(m, out, 0);
+}
+
+static int owl_nativestyle_format_oneline(const owl_message *m, GString *out)
+{
+  if (!owl_nativestyle_is_stock(1))
+    return 0;
+  return owl_nativestyle_format(m, out, 1);
+}
+
+/* Return the C formatter standing in for the perl style 'obj', or
+ * NULL if it has none.  Only the stock classes themselves qualify, not
+ * subclasses or instances, which may override any part of them.  The
+ * stock modules register their styles as they load, so the generations
+ * of their packages are taken the first time; later redefinitions of
+ * their subs send formatting back to perl.
+ */
+owl_style_formatter owl_nativestyle_get_formatter(SV *obj)
+{
+  static int default_seen, oneline_seen;
+  const char *class;
+
+  if (!obj || !SvOK(obj) || SvROK(obj))
+    return NULL;
+  class = SvPV_nolen(obj);
+  if (!strcmp(class, "BarnOwl::Style::Default")) {
+    if (!default_seen) {
+      owl_nativestyle_default_gen = owl_nativestyle_generation(owl_nativestyle_default_packages);
+      default_seen = 1;
+    }
+    return owl_nativestyle_format_default;
+  }
+  if (!strcmp(class, "BarnOwl::Style::OneLine")) {
+    if (!oneline_seen) {
+      owl_nativestyle_oneline_gen = owl_nativestyle_generation(owl_nativestyle_oneline_packages);
+      oneline_seen = 1;
+    }
+    return owl_nativestyle_format_oneline;
+  }
+  return NULL;
+}
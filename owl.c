@@ -156,10 +156,14 @@ void owl_shutdown_curses(void) {
  * Either a pointer is kept to the message internally, or it is freed
  * if unneeded. The caller no longer ``owns'' the message's memory.
  *
+ * The ids of incoming messages are added to 'received', for perl to
+ * hear about with the rest of the batch.
+ *
  * Returns 1 if the message was added to the message list, and 0 if it
  * was ignored due to user settings or otherwise.
  */
-static int owl_process_message(owl_message *m) {
+static int owl_process_message(owl_message *m, GArray *received) {
+  int id;
   const owl_filter *f;
   /* if this message it on the puntlist, nuke it and continue */
   if (owl_global_message_is_puntable(&g, m)) {
@@ -182,12 +186,15 @@ static int owl_process_message(owl_message *m) {
 
   /* add it to the global list */
   owl_messagelist_append_element(owl_global_get_msglist(&g), m);
+  owl_searchindex_add_message(m);
+  owl_message_index_format(m);
   /* add it to any necessary views; right now there's only the current view */
   owl_view_consider_message(owl_global_get_current_view(&g), m);
 
   if(owl_message_is_direction_in(m)) {
-    /* let perl know about it*/
-    owl_perlconfig_getmsg(m, NULL);
+    /* let perl know about it, once the batch is done */
+    id = owl_message_get_id(m);
+    g_array_append_val(received, id);
 
     /* do we need to autoreply? */
     if (owl_global_is_zaway(&g) && !owl_message_get_attribute_value(m, "isauto")) {
@@ -234,8 +241,6 @@ static int owl_process_message(owl_message *m) {
     }
   }
 
-  /* let perl know about it */
-  owl_perlconfig_newmsg(m, NULL);
   /* log the message if we need to */
   owl_log_message(m);
   /* redraw the sepbar; TODO: don't violate layering */
@@ -260,14 +265,29 @@ static gboolean owl_process_messages_dispatch(GSource *source, GSourceFunc callb
   int newmsgs=0;
   int followlast = owl_global_should_followlast(&g);
   owl_message *m;
+  GArray *received, *added;
+  int id;
+
+  received = g_array_new(FALSE, FALSE, sizeof(int));
+  added = g_array_new(FALSE, FALSE, sizeof(int));
 
   /* Grab incoming messages. */
   while (owl_global_messagequeue_pending(&g)) {
     m = owl_global_messagequeue_popmsg(&g);
-    if (owl_process_message(m))
+    /* processing may run commands that expunge the message */
+    id = owl_message_get_id(m);
+    if (owl_process_message(m, received)) {
+      g_array_append_val(added, id);
       newmsgs = 1;
+    }
   }
 
+  /* let perl know about them, in one call each for the whole batch */
+  owl_perlconfig_getmsgs(received);
+  owl_perlconfig_newmsgs(added);
+  g_array_free(received, TRUE);
+  g_array_free(added, TRUE);
+
   if (newmsgs) {
     /* follow the last message if we're supposed to */
     if (followlast)
@@ -276,9 +296,9 @@ static gboolean owl_process_messages_dispatch(GSource *source, GSourceFunc callb
     /* do the newmsgproc thing */
     owl_function_do_newmsgproc();
 
-    /* redisplay if necessary */
-    /* this should be optimized to not run if the new messages won't be displayed */
-    owl_mainwin_redisplay(owl_global_get_mainwin(&g));
+    /* redisplay if the new messages may be on screen */
+    if (followlast || owl_mainwin_has_room(owl_global_get_mainwin(&g)))
+      owl_mainwin_redisplay(owl_global_get_mainwin(&g));
   }
   return TRUE;
 }
@@ -299,6 +319,8 @@ void owl_process_input_char(owl_input j)
   if (ret!=0 && ret!=1) {
     owl_function_makemsg("Unable to handle keypress");
   }
+  /* echo it without waiting for the next frame */
+  owl_window_redraw_urgently();
 }
 
 void owl_process_input(const owl_io_dispatch *d, void *data)
@@ -611,14 +633,23 @@ int main(int argc, char **argv, char **env)
   g_source_unref(source);
 
   owl_log_init();
+  owl_resolver_init();
+  owl_zdecrypt_init();
+  owl_zreceive_init();
+  owl_loghistory_init();
 
   owl_function_debugmsg("startup: entering main loop");
   owl_select_run_loop();
 
   /* Shut down everything. */
+  owl_loghistory_shutdown();
+  owl_logstore_shutdown();
+  owl_zreceive_shutdown();
   owl_zephyr_shutdown();
   owl_signal_shutdown();
   owl_shutdown_curses();
   owl_log_shutdown();
+  owl_resolver_shutdown();
+  owl_zdecrypt_shutdown();
   return 0;
 }
@@ -31,6 +31,7 @@
 #endif
 #include <sys/param.h>
 #include <EXTERN.h>
+#include <sys/socket.h>
 #include <netdb.h>
 #include <regex.h>
 #include <time.h>
@@ -142,6 +143,28 @@ typedef void HV;
 #define OWL_LOGGING_DIRECTION_IN   1
 #define OWL_LOGGING_DIRECTION_OUT  2
 
+#define OWL_LOGGING_FSYNC_NEVER    0
+#define OWL_LOGGING_FSYNC_FLUSH    1
+#define OWL_LOGGING_FSYNC_CLOSE    2
+
+#define OWL_LOGGING_OVERFLOW_BLOCK 0
+#define OWL_LOGGING_OVERFLOW_DROP  1
+#define OWL_LOGGING_OVERFLOW_SPILL 2
+
+/* Log entries are gathered for this long before being written */
+#define OWL_LOG_FLUSH_MSECS        100
+/* ...or until this many are waiting */
+#define OWL_LOG_MAX_PENDING        256
+/* Entries queued for the logging thread before overflow */
+#define OWL_LOG_QUEUE_SIZE         1024
+/* Log files the logging thread keeps open at once */
+#define OWL_LOG_MAX_OPEN_FILES     32
+/* Most messages a search of the message store shows */
+#define OWL_LOGSTORE_MAX_RESULTS   500
+/* Most logged messages loaded at startup, and how many at a time */
+#define OWL_LOGHISTORY_MAX_MESSAGES 20000
+#define OWL_LOGHISTORY_BATCH_SIZE  200
+
 #define OWL_SCROLLMODE_NORMAL      0
 #define OWL_SCROLLMODE_TOP         1
 #define OWL_SCROLLMODE_NEARTOP     2
@@ -153,6 +176,12 @@ typedef void HV;
 #define OWL_TABSTR        "   "
 #define OWL_MSGTAB            7
 #define OWL_TYPWIN_SIZE       8
+
+/* seconds of formatting per idle callback when formatting ahead */
+#define OWL_MAINWIN_PREFETCH_SLICE 0.005
+
+/* default minimum milliseconds between screen updates */
+#define OWL_REDRAW_INTERVAL 20
 #define OWL_HISTORYSIZE       50
 
 /* Indicate current state, as well as what is allowed */
@@ -185,6 +214,33 @@ typedef void HV;
 
 #define OWL_FILTER_MAX_DEPTH    300
 
+/* Message lists at least this long are filtered by several threads */
+#define OWL_FILTER_PARALLEL_THRESHOLD  4096
+#define OWL_FILTER_MAX_WORKERS         8
+
+#define OWL_FILTER_FIELD_CLASS      0
+#define OWL_FILTER_FIELD_INSTANCE   1
+#define OWL_FILTER_FIELD_SENDER     2
+#define OWL_FILTER_FIELD_RECIPIENT  3
+#define OWL_FILTER_FIELD_BODY       4
+#define OWL_FILTER_FIELD_OPCODE     5
+#define OWL_FILTER_FIELD_REALM      6
+#define OWL_FILTER_FIELD_TYPE       7
+#define OWL_FILTER_FIELD_HOSTNAME   8
+#define OWL_FILTER_FIELD_DELETED    9
+#define OWL_FILTER_FIELD_DIRECTION 10
+#define OWL_FILTER_FIELD_LOGIN     11
+#define OWL_FILTER_FIELD_ATTRIBUTE 12
+
+#define OWL_FILTER_OP_FALSE         0
+#define OWL_FILTER_OP_TRUE          1
+#define OWL_FILTER_OP_RE            2
+#define OWL_FILTER_OP_FILTER        3
+#define OWL_FILTER_OP_PERL          4
+#define OWL_FILTER_OP_NOT           5
+#define OWL_FILTER_OP_JUMP_IF_FALSE 6
+#define OWL_FILTER_OP_JUMP_IF_TRUE  7
+
 #define OWL_KEYMAP_MAXSTACK     20
 
 #define OWL_KEYBINDING_NOOP     0   /* dummy binding that does nothing */
@@ -208,6 +264,13 @@ typedef void HV;
 #define OWL_REGEX_QUOTECHARS    "!+*.?[]^\\${}()|"
 #define OWL_REGEX_QUOTEWITH     "\\"
 
+/* How owl_regex_compare matches a pattern */
+#define OWL_REGEX_KIND_REGEX      0  /* with regexec */
+#define OWL_REGEX_KIND_SUBSTRING  1  /* literal anywhere */
+#define OWL_REGEX_KIND_PREFIX     2  /* ^literal */
+#define OWL_REGEX_KIND_SUFFIX     3  /* literal$ */
+#define OWL_REGEX_KIND_EXACT      4  /* ^literal$ */
+
 #if defined(HAVE_DES_STRING_TO_KEY) && defined(HAVE_DES_KEY_SCHED) && defined(HAVE_DES_ECB_ENCRYPT)
 #define OWL_ENABLE_ZCRYPT 1
 #endif
@@ -277,6 +340,8 @@ typedef struct _owl_input {
 
 typedef struct _owl_fmtext {
   GString *buff;
+  GArray *runs;        /* byte offsets of the formatting characters in buff */
+  GArray *lines;       /* byte offsets of the newlines in buff */
 } owl_fmtext;
 
 typedef struct _owl_list {
@@ -362,6 +427,39 @@ typedef struct _owl_pair {
 
 struct _owl_fmtext_cache;
 
+/* A remembered filter result; see owl_message_get_filter_memo. */
+typedef struct _owl_message_filter_memo {
+  unsigned int filter;  /* owl_filter_get_id, or 0 */
+  unsigned int generation;
+  int result;
+} owl_message_filter_memo;
+
+#define OWL_MESSAGE_FILTER_MEMO_SIZE 8
+
+/* One attribute of a message.  'key' is an interned string, or NULL
+ * if the slot is unused. */
+typedef struct _owl_message_attr {
+  const char *key;
+  char *value;
+} owl_message_attr;
+
+/* Attributes with a fixed slot at the start of every message's table */
+#define OWL_MESSAGE_ATTR_TYPE       0
+#define OWL_MESSAGE_ATTR_CLASS      1
+#define OWL_MESSAGE_ATTR_INSTANCE   2
+#define OWL_MESSAGE_ATTR_SENDER     3
+#define OWL_MESSAGE_ATTR_RECIPIENT  4
+#define OWL_MESSAGE_ATTR_BODY       5
+#define OWL_MESSAGE_ATTR_OPCODE     6
+#define OWL_MESSAGE_ATTR_REALM      7
+#define OWL_MESSAGE_ATTR_ZSIG       8
+#define OWL_MESSAGE_ATTR_ISPRIVATE  9
+#define OWL_MESSAGE_ATTR_LOGINOUT   10
+#define OWL_MESSAGE_NUM_FIXED_ATTRS 11
+
+/* Initial size of the open-addressed part of the attribute table */
+#define OWL_MESSAGE_ATTR_TABLE_SIZE 8
+
 typedef struct _owl_message {
   int id;
   int direction;
@@ -371,22 +469,50 @@ typedef struct _owl_message {
   struct _owl_fmtext_cache * fmtext;
   int delete;
   const char *hostname;
-  owl_list attributes;            /* this is a list of pairs */
+  owl_message_attr *attributes;   /* fixed slots, then a hash table */
+  int attrsize;                   /* size of the hash table, a power of 2 */
+  int numattrs;                   /* entries in the hash table */
   char *timestr;
   time_t time;
+  owl_message_filter_memo filtermemo[OWL_MESSAGE_FILTER_MEMO_SIZE];
+  int fgcolor, bgcolor;           /* from colored filters, as of colorgen */
+  unsigned int colorgen;
+  int searchindexed;              /* whether it is in the search index */
+  GArray *searchkeys;             /* trigrams of its formatted text, sorted */
+  unsigned int searchgen;         /* generation 'searchkeys' is from, or 0 */
+  void *perlobjs;                 /* AV of weak refs to the perl objects for it */
 } owl_message;
 
-#define OWL_FMTEXT_CACHE_SIZE 1000
-/* We cache the saved fmtexts for the last bunch of messages we
-   rendered */
+#define OWL_FMTEXT_CACHE_BYTES (4*1024*1024)
+
+/* Host names remembered by the resolver, by address */
+#define OWL_RESOLVER_CACHE_SIZE 1024
+/* Zephyrs received but not yet made into messages, and messages made
+   but not yet queued; each ring holds one less than this */
+#define OWL_ZRECEIVE_RING_SIZE  256
+/* Bounds, in microseconds, on how long one pass reads zephyrs before
+   letting the rest of the main loop run */
+#define OWL_ZRECEIVE_MIN_BUDGET 1000
+#define OWL_ZRECEIVE_MAX_BUDGET 16000
+/* We cache the saved fmtexts for recently rendered messages, up to
+   the fmtext_cache_bytes variable, dropping the least recently used
+   first.  Messages on screen are never dropped. */
 typedef struct _owl_fmtext_cache {
     owl_message * message;
     owl_fmtext fmtext;
+    struct _owl_fmtext_cache *prev, *next;  /* most recently used first */
+    size_t size;
+    unsigned int frame;   /* pinned while this is the current frame */
+    unsigned long serial; /* distinct for every formatting */
 } owl_fmtext_cache;
 
+/* Formats 'm' into 'out' in C, returning 0 to leave it to perl */
+typedef int (*owl_style_formatter)(const owl_message *m, GString *out);
+
 typedef struct _owl_style {
   char *name;
   SV *perlobj;
+  owl_style_formatter format_message;   /* or NULL */
 } owl_style;
 
 typedef struct _owl_mainwin {
@@ -394,6 +520,22 @@ typedef struct _owl_mainwin {
   int lasttruncated;
   int lastdisplayed;
   owl_window *window;
+  /* formatting ahead of the screen; see owl_mainwin_prefetch */
+  guint prefetch_id;
+  int lasttopmsg;
+  int prefetch_dir;
+  int prefetch_up, prefetch_down;           /* next message to format */
+  int prefetch_uplines, prefetch_downlines; /* lines still wanted */
+  /* what the last redraw drew, so the next can repaint only what
+   * changed; see owl_mainwin_patch */
+  GArray *rows;                 /* one owl_mainwin_row per message */
+  int damaged;                  /* repaint everything next time */
+  int room;                     /* messages after lastdisplayed would show */
+  int nexty;                    /* and would start on this line */
+  WINDOW *drawn_win;
+  int drawn_topmsg, drawn_lines, drawn_cols, drawn_rightshift;
+  const owl_style *drawn_style;
+  char *drawn_search;           /* NULL if no search was highlighted */
 } owl_mainwin;
 
 typedef struct _owl_editwin owl_editwin;
@@ -429,14 +571,33 @@ typedef struct _owl_msgwin {
   gulong redraw_id;
 } owl_msgwin;
 
+/* Fields of the inverted indexes kept on the global message list */
+#define OWL_MSGINDEX_CLASS      0
+#define OWL_MSGINDEX_INSTANCE   1
+#define OWL_MSGINDEX_SENDER     2
+#define OWL_MSGINDEX_RECIPIENT  3
+#define OWL_MSGINDEX_TYPE       4
+#define OWL_MSGINDEX_NUM        5
+
+/* A set of positions in a message list, stored as a bit array. */
+#define OWL_MSGSET_BITS         (8 * sizeof(unsigned long))
+#define OWL_MSGSET_WORDS(n)     (((n) + OWL_MSGSET_BITS - 1) / OWL_MSGSET_BITS)
+#define OWL_MSGSET_ADD(set, i)  ((set)[(i) / OWL_MSGSET_BITS] |= 1UL << ((i) % OWL_MSGSET_BITS))
+#define OWL_MSGSET_HAS(set, i)  (((set)[(i) / OWL_MSGSET_BITS] >> ((i) % OWL_MSGSET_BITS)) & 1UL)
+#define OWL_MSGSET_DEL(set, i)  ((set)[(i) / OWL_MSGSET_BITS] &= ~(1UL << ((i) % OWL_MSGSET_BITS)))
+
 typedef struct _owl_messagelist {
   owl_list list;
+  owl_dict *indexes;    /* field value -> list of positions, or NULL */
 } owl_messagelist;
 
 typedef struct _owl_regex {
   int negate;
   char *string;
-  regex_t re;
+  int kind;
+  char *literal;     /* the unquoted literal, unless kind is REGEX */
+  int literal_len;
+  regex_t re;        /* only compiled if kind is REGEX */
 } owl_regex;
 
 typedef struct _owl_filterelement {
@@ -449,11 +610,32 @@ typedef struct _owl_filterelement {
   owl_regex re;
   /* Used by regexes, filter references, and perl */
   char *field;
+  /* For regex filters, the field resolved at parse time */
+  int fieldid;
+  const char *attr;     /* interned attribute name, for OWL_FILTER_FIELD_ATTRIBUTE */
+  /* For filter references, the filter named by 'field' as of
+   * filter generation 'targetgen' */
+  const struct _owl_filter *target;
+  unsigned int targetgen;
 } owl_filterelement;
 
+/* One instruction of a compiled filter.  Programs keep a single
+ * truth value; jumps skip the rest of an "and" or "or" once its
+ * result is known. */
+typedef struct _owl_filter_insn {
+  int op;               /* OWL_FILTER_OP_* */
+  int arg;              /* field id, or jump target */
+  const owl_filterelement *fe;  /* element supplying the regex or name */
+} owl_filter_insn;
+
 typedef struct _owl_filter {
+  unsigned int id;      /* unique for the life of the process */
   char *name;
   owl_filterelement * root;
+  owl_filter_insn *program;
+  int proglen;
+  int pure;             /* no perl reachable, as of generation 'puregen' */
+  unsigned int puregen;
   int fgcolor;
   int bgcolor;
 } owl_filter;
@@ -572,6 +754,7 @@ typedef struct _owl_global {
   owl_keyhandler kh;
   owl_dict filters;
   GList *filterlist;
+  unsigned int filter_generation;  /* bumped whenever g.filters changes */
   owl_list puntlist;
   owl_vardict vars;
   owl_cmddict cmds;
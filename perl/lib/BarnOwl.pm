@@ -496,7 +496,8 @@ messages.
 
 =cut
 
-my $timeformat = '%H:%M';
+# Also read directly by the C versions of the stock styles
+our $timeformat = '%H:%M';
 
 sub time_format
 {
@@ -40,10 +40,29 @@ Called before BarnOwl shutdown
 Called with a C<BarnOwl::Message> object every time BarnOwl receives a
 new incoming message.
 
+Messages that arrive together are handled as a batch: each is logged,
+answered by autoreply and announced by the bell and alerts first, and
+the hooks are then called for the whole batch. A hook therefore runs
+after all of that has been done, for its own message and for the
+others in the batch.
+
 =item $newMessage
 
 Called with a C<BarnOwl::Message> object every time BarnOwl appends
-I<any> new message to the message list.
+I<any> new message to the message list. As with C<$receiveMessage>, it
+is called once the whole batch has been added.
+
+=item $receiveMessages
+
+Called with a list of C<BarnOwl::Message> objects for each batch of
+new incoming messages BarnOwl receives together, before the
+C<$receiveMessage> functions are called for each of them. Modules
+that see many messages should prefer this hook.
+
+=item $newMessages
+
+Like C<$receiveMessages>, for each batch of new messages appended to
+the message list, before the C<$newMessage> functions are called.
 
 =item $mainLoop
 
@@ -73,6 +92,7 @@ use Exporter;
 
 our @EXPORT_OK = qw($startup $shutdown
                     $receiveMessage $newMessage
+                    $receiveMessages $newMessages
                     $mainLoop $getBuddyList
                     $getQuickstart);
 
@@ -84,6 +104,8 @@ our $startup = BarnOwl::Hook->new;
 our $shutdown = BarnOwl::Hook->new;
 our $receiveMessage = BarnOwl::Hook->new;
 our $newMessage = BarnOwl::Hook->new;
+our $receiveMessages = BarnOwl::Hook->new;
+our $newMessages = BarnOwl::Hook->new;
 our $mainLoop = BarnOwl::MainLoopCompatHook->new;
 our $getBuddyList = BarnOwl::Hook->new;
 our $getQuickstart = BarnOwl::Hook->new;
@@ -190,6 +212,37 @@ sub _new_msg {
     BarnOwl::new_msg($m) if *BarnOwl::new_msg{CODE};
 }
 
+# The C code hands over each batch of messages at once, and the
+# per-message hooks are called from here, so that an error from one
+# message does not lose the rest.
+
+sub _each_msg {
+    my $fn = shift;
+
+    for my $m (@_) {
+        eval { $fn->($m) };
+        BarnOwl::error("$@") if $@;
+    }
+}
+
+sub _receive_msgs {
+    my @msgs = @_;
+
+    eval { $receiveMessages->run(@msgs) };
+    BarnOwl::error("$@") if $@;
+
+    _each_msg(\&BarnOwl::_receive_msg_legacy_wrap, @msgs);
+}
+
+sub _new_msgs {
+    my @msgs = @_;
+
+    eval { $newMessages->run(@msgs) };
+    BarnOwl::error("$@") if $@;
+
+    _each_msg(\&_new_msg, @msgs);
+}
+
 sub _get_blist {
     my @results = grep defined, $getBuddyList->run;
     s/^\s+|\s+$//sg for (@results);
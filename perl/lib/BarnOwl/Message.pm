@@ -8,6 +8,7 @@ use BarnOwl::Message::AIM;
 use BarnOwl::Message::Generic;
 use BarnOwl::Message::Loopback;
 use BarnOwl::Message::Zephyr;
+use BarnOwl::MessageFields;
 
 sub new {
     my $class = shift;
@@ -0,0 +1,109 @@
+use strict;
+use warnings;
+
+package BarnOwl::MessageFields;
+
+=head1 NAME
+
+BarnOwl::MessageFields
+
+=head1 DESCRIPTION
+
+The hash behind every C<BarnOwl::Message> that BarnOwl hands to perl
+is tied to this class. Fields are read from the C message only when
+they are first looked up, so passing a message to perl costs the same
+whatever its type or however many attributes it has.
+
+Values stored into the hash stay in perl and override the C message.
+They never change the message itself. When a message is freed, as
+when it is expunged, the objects for it that are still held are given
+every field they have not read yet, so they keep working as copies of
+the message as it was then.
+
+=cut
+
+sub TIEHASH {
+    my $class = shift;
+    my $id = shift;
+    return bless {id => $id}, $class;
+}
+
+# Called from C as a message is freed, with all of its fields and the
+# objects for it still alive
+sub _message_freed {
+    my $fields = shift;
+    for my $self (@_) {
+        for my $key (keys %$fields) {
+            next if exists $self->{stored}{$key} || $self->{deleted}{$key};
+            my $val = $fields->{$key};
+            $self->{stored}{$key} = ref $val eq 'ARRAY' ? [@$val] : $val;
+        }
+        $self->{freed} = 1;
+    }
+}
+
+sub _field_names {
+    my $self = shift;
+    return () if $self->{freed};
+    return BarnOwl::Internal::message_field_names($self->{id});
+}
+
+sub FETCH {
+    my ($self, $key) = @_;
+    return $self->{stored}{$key} if exists $self->{stored}{$key};
+    return undef if $self->{deleted}{$key} || $self->{freed};
+    my $val = BarnOwl::Internal::message_field($self->{id}, $key);
+    $self->{stored}{$key} = $val if defined $val;
+    return $val;
+}
+
+sub STORE {
+    my ($self, $key, $val) = @_;
+    delete $self->{deleted}{$key};
+    $self->{stored}{$key} = $val;
+}
+
+sub DELETE {
+    my ($self, $key) = @_;
+    my $val = $self->FETCH($key);
+    delete $self->{stored}{$key};
+    $self->{deleted}{$key} = 1;
+    return $val;
+}
+
+sub CLEAR {
+    my $self = shift;
+    $self->{stored} = {};
+    $self->{deleted}{$_} = 1 for $self->_field_names;
+}
+
+sub EXISTS {
+    my ($self, $key) = @_;
+    return 1 if exists $self->{stored}{$key};
+    return 0 if $self->{deleted}{$key};
+    return defined $self->FETCH($key) ? 1 : 0;
+}
+
+sub FIRSTKEY {
+    my $self = shift;
+    my %seen;
+    my @keys = grep { !$seen{$_}++ }
+        (keys %{$self->{stored} || {}},
+         grep { !$self->{deleted}{$_} } $self->_field_names);
+    $self->{keys} = \@keys;
+    return shift @{$self->{keys}};
+}
+
+sub NEXTKEY {
+    my $self = shift;
+    return shift @{$self->{keys}};
+}
+
+sub SCALAR {
+    my $self = shift;
+    my $key = $self->FIRSTKEY;
+    delete $self->{keys};
+    return defined $key ? 1 : 0;
+}
+
+1;
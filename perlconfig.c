@@ -74,77 +74,244 @@ HV *owl_new_hv(const owl_dict *d, SV *(*to_sv)(const void *))
   return ret;
 }
 
-SV *owl_perlconfig_message2hashref(const owl_message *m)
+/* Fields of a perl message object which come from getters rather
+ * than straight from the message's attributes. */
+static const char *const owl_perlconfig_message_getters[] = {
+  "type", "direction", "class", "instance", "sender", "realm",
+  "recipient", "opcode", "hostname", "body", "login", "zsig",
+  "zwriteline", "header", "time", "unix_time", "id", "deleted",
+  "private", "should_wordwrap", NULL
+};
+
+static int owl_perlconfig_is_message_getter(const char *key)
+{
+  int i;
+
+  for (i = 0; owl_perlconfig_message_getters[i]; i++) {
+    if (!strcmp(key, owl_perlconfig_message_getters[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/* Returns a new SV holding field 'key' of the perl object for 'm', or
+ * NULL if the field is not set.
+ */
+SV *owl_perlconfig_message_field(const owl_message *m, const char *key)
 {
-  HV *h, *stash;
-  SV *hr;
-  const char *type;
-  char *ptr, *utype, *blessas;
-  int i, j;
-  const owl_pair *pair;
   const owl_filter *wrap;
+  const char *val;
+  AV *av_zfields;
+  char *ptr;
+  int i, j;
 
-  if (!m) return &PL_sv_undef;
-  wrap = owl_global_get_filter(&g, "wordwrap");
-  if(!wrap) {
+#define MSG2SV(field) if (!strcmp(key, #field))                 \
+    return owl_new_sv(owl_message_get_##field(m))
+
+  MSG2SV(type);
+  MSG2SV(direction);
+  MSG2SV(class);
+  MSG2SV(instance);
+  MSG2SV(sender);
+  MSG2SV(realm);
+  MSG2SV(recipient);
+  MSG2SV(opcode);
+  MSG2SV(hostname);
+  MSG2SV(body);
+  MSG2SV(login);
+  MSG2SV(zsig);
+  MSG2SV(zwriteline);
+  if (!strcmp(key, "header")) {
+    val = owl_message_get_header(m);
+    return val ? owl_new_sv(val) : NULL;
+  }
+  if (!strcmp(key, "time"))
+    return owl_new_sv(owl_message_get_timestr(m));
+  if (!strcmp(key, "unix_time"))
+    return newSViv(m->time);
+  if (!strcmp(key, "id"))
+    return newSViv(owl_message_get_id(m));
+  if (!strcmp(key, "deleted"))
+    return newSViv(owl_message_is_delete(m));
+  if (!strcmp(key, "private"))
+    return newSViv(owl_message_is_private(m));
+  if (!strcmp(key, "should_wordwrap")) {
+    wrap = owl_global_get_filter(&g, "wordwrap");
+    if(!wrap) {
       owl_function_error("wrap filter is not defined");
-      return &PL_sv_undef;
+      return NULL;
+    }
+    return newSViv(owl_filter_message_match(wrap, m));
   }
 
-  h = newHV();
-
-#define MSG2H(h,field) (void)hv_store(h, #field, strlen(#field),        \
-                                      owl_new_sv(owl_message_get_##field(m)), 0)
+  val = owl_message_get_attribute_value(m, key);
+  if (val)
+    return owl_new_sv(val);
 
   if (owl_message_is_type_zephyr(m)
       && owl_message_is_direction_in(m)) {
     /* Handle zephyr-specific fields... */
-    AV *av_zfields;
-
-    av_zfields = newAV();
-    j=owl_zephyr_get_num_fields(owl_message_get_notice(m));
-    for (i=0; i<j; i++) {
-      ptr=owl_zephyr_get_field_as_utf8(owl_message_get_notice(m), i+1);
-      av_push(av_zfields, owl_new_sv(ptr));
-      g_free(ptr);
+    if (!strcmp(key, "fields")) {
+      av_zfields = newAV();
+      j=owl_zephyr_get_num_fields(owl_message_get_notice(m));
+      for (i=0; i<j; i++) {
+        ptr=owl_zephyr_get_field_as_utf8(owl_message_get_notice(m), i+1);
+        av_push(av_zfields, owl_new_sv(ptr));
+        g_free(ptr);
+      }
+      return newRV_noinc((SV*)av_zfields);
     }
-    (void)hv_store(h, "fields", strlen("fields"), newRV_noinc((SV*)av_zfields), 0);
+    if (!strcmp(key, "auth"))
+      return owl_new_sv(owl_zephyr_get_authstr(owl_message_get_notice(m)));
+  }
+
+  return NULL;
+}
+
+/* Append to 'names' the name of every field of the perl object for
+ * 'm'.  The names belong to the message and must not be freed.
+ */
+void owl_perlconfig_message_field_names(const owl_message *m, owl_list *names)
+{
+  const char *key, *value;
+  int i, iter;
 
-    (void)hv_store(h, "auth", strlen("auth"), 
-                   owl_new_sv(owl_zephyr_get_authstr(owl_message_get_notice(m))),0);
+  for (i = 0; owl_perlconfig_message_getters[i]; i++) {
+    if (!strcmp(owl_perlconfig_message_getters[i], "header") &&
+        !owl_message_get_header(m))
+      continue;
+    owl_list_append_element(names, (void *)owl_perlconfig_message_getters[i]);
   }
 
-  j=owl_list_get_size(&(m->attributes));
-  for(i=0; i<j; i++) {
-    pair=owl_list_get_element(&(m->attributes), i);
-    (void)hv_store(h, owl_pair_get_key(pair), strlen(owl_pair_get_key(pair)),
-                   owl_new_sv(owl_pair_get_value(pair)),0);
+  iter = 0;
+  while (owl_message_next_attribute(m, &iter, &key, &value)) {
+    if (!owl_perlconfig_is_message_getter(key))
+      owl_list_append_element(names, (void *)key);
   }
-  
-  MSG2H(h, type);
-  MSG2H(h, direction);
-  MSG2H(h, class);
-  MSG2H(h, instance);
-  MSG2H(h, sender);
-  MSG2H(h, realm);
-  MSG2H(h, recipient);
-  MSG2H(h, opcode);
-  MSG2H(h, hostname);
-  MSG2H(h, body);
-  MSG2H(h, login);
-  MSG2H(h, zsig);
-  MSG2H(h, zwriteline);
-  if (owl_message_get_header(m)) {
-    MSG2H(h, header); 
-  }
-  (void)hv_store(h, "time", strlen("time"), owl_new_sv(owl_message_get_timestr(m)),0);
-  (void)hv_store(h, "unix_time", strlen("unix_time"), newSViv(m->time), 0);
-  (void)hv_store(h, "id", strlen("id"), newSViv(owl_message_get_id(m)),0);
-  (void)hv_store(h, "deleted", strlen("deleted"), newSViv(owl_message_is_delete(m)),0);
-  (void)hv_store(h, "private", strlen("private"), newSViv(owl_message_is_private(m)),0);
-  (void)hv_store(h, "should_wordwrap",
-                 strlen("should_wordwrap"), newSViv(
-                                                    owl_filter_message_match(wrap, m)),0);
+
+  if (owl_message_is_type_zephyr(m)
+      && owl_message_is_direction_in(m)) {
+    if (!owl_message_get_attribute_value(m, "fields"))
+      owl_list_append_element(names, "fields");
+    if (!owl_message_get_attribute_value(m, "auth"))
+      owl_list_append_element(names, "auth");
+  }
+}
+
+/* Remember 'fields', the object behind a perl object for 'm', so that
+ * it can be given the fields it has not read when 'm' is freed.  Only
+ * weak references are kept, and dead ones are dropped as more come. */
+static void owl_perlconfig_message_track(const owl_message *m, HV *fields)
+{
+  AV *objs = m->perlobjs, *live;
+  SV **svp, *ref;
+  I32 i;
+
+  if (!objs) {
+    objs = newAV();
+  } else if (av_len(objs) >= 7) {
+    /* Most objects die as soon as the call they were made for returns */
+    live = newAV();
+    for (i = 0; i <= av_len(objs); i++) {
+      svp = av_fetch(objs, i, 0);
+      if (svp && SvROK(*svp))
+        av_push(live, SvREFCNT_inc(*svp));
+    }
+    SvREFCNT_dec((SV*)objs);
+    objs = live;
+  }
+  ref = newRV_inc((SV*)fields);
+  sv_rvweaken(ref);
+  av_push(objs, ref);
+  /* The message does not change; this is only bookkeeping */
+  ((owl_message *)m)->perlobjs = objs;
+}
+
+/* Called as 'm' is freed: give the perl objects for it that are still
+ * alive every field they have not read yet, so that they keep working
+ * as copies. */
+void owl_perlconfig_message_freed(owl_message *m)
+{
+  dSP;
+  AV *objs = m->perlobjs;
+  HV *snapshot;
+  SV **svp, *val;
+  owl_list names;
+  const char *key;
+  I32 i;
+  int live = 0;
+
+  m->perlobjs = NULL;
+  for (i = 0; i <= av_len(objs); i++) {
+    svp = av_fetch(objs, i, 0);
+    if (svp && SvROK(*svp))
+      live = 1;
+  }
+  if (!live) {
+    SvREFCNT_dec((SV*)objs);
+    return;
+  }
+
+  snapshot = newHV();
+  owl_list_create(&names);
+  owl_perlconfig_message_field_names(m, &names);
+  for (i = 0; i < owl_list_get_size(&names); i++) {
+    key = owl_list_get_element(&names, i);
+    val = owl_perlconfig_message_field(m, key);
+    if (val)
+      (void)hv_store(snapshot, key, strlen(key), val, 0);
+  }
+  owl_list_cleanup(&names, NULL);
+
+  ENTER;
+  SAVETMPS;
+
+  PUSHMARK(SP);
+  XPUSHs(sv_2mortal(newRV_noinc((SV*)snapshot)));
+  for (i = 0; i <= av_len(objs); i++) {
+    svp = av_fetch(objs, i, 0);
+    if (svp && SvROK(*svp))
+      XPUSHs(sv_2mortal(newRV_inc(SvRV(*svp))));
+  }
+  PUTBACK;
+
+  call_pv("BarnOwl::MessageFields::_message_freed", G_DISCARD|G_EVAL);
+
+  if (SvTRUE(ERRSV)) {
+    owl_function_error("Perl Error: '%s'", SvPV_nolen(ERRSV));
+    /* and clear the error */
+    sv_setsv (ERRSV, &PL_sv_undef);
+  }
+
+  FREETMPS;
+  LEAVE;
+
+  SvREFCNT_dec((SV*)objs);
+}
+
+/* Returns a perl object for 'm'.  The object is a hash tied to
+ * BarnOwl::MessageFields, which reads fields from the message only as
+ * perl asks for them.  If the message is freed first, the object is
+ * given the rest of its fields then.
+ */
+SV *owl_perlconfig_message2hashref(const owl_message *m)
+{
+  HV *h, *stash, *fields;
+  SV *hr, *tie;
+  const char *type;
+  char *utype, *blessas;
+
+  if (!m) return &PL_sv_undef;
+
+  fields = newHV();
+  (void)hv_store(fields, "id", strlen("id"), newSViv(owl_message_get_id(m)), 0);
+  owl_perlconfig_message_track(m, fields);
+  tie = newRV_noinc((SV*)fields);
+  sv_bless(tie, gv_stashpv("BarnOwl::MessageFields", GV_ADD));
+
+  h = newHV();
+  sv_magic((SV*)h, tie, PERL_MAGIC_tied, NULL, 0);
+  SvREFCNT_dec(tie);
 
   type = owl_message_get_type(m);
   if(!type || !*type) type = "generic";
@@ -459,25 +626,53 @@ char *owl_perlconfig_execute(const char *line)
   return(out);
 }
 
-void owl_perlconfig_getmsg(const owl_message *m, const char *subname)
+/* Calls 'subname' once, with a perl object for each of the messages
+   whose ids are in 'ids'.  Messages expunged since are left out.
+ */
+static void owl_perlconfig_call_with_messages(const char *subname, const GArray *ids)
 {
-  char *ptr = NULL;
-  if (owl_perlconfig_is_function("BarnOwl::Hooks::_receive_msg")) {
-    ptr = owl_perlconfig_call_with_message(subname?subname
-                                           :"BarnOwl::_receive_msg_legacy_wrap", m);
+  dSP;
+  const owl_message *m;
+  guint i;
+
+  ENTER;
+  SAVETMPS;
+
+  PUSHMARK(SP);
+  for (i = 0; i < ids->len; i++) {
+    m = owl_message_get_by_id(g_array_index(ids, int, i));
+    if (m)
+      XPUSHs(sv_2mortal(owl_perlconfig_message2hashref(m)));
   }
-  g_free(ptr);
+  PUTBACK;
+
+  call_pv(subname, G_DISCARD|G_EVAL);
+
+  if (SvTRUE(ERRSV)) {
+    owl_function_error("Perl Error: '%s'", SvPV_nolen(ERRSV));
+    /* and clear the error */
+    sv_setsv (ERRSV, &PL_sv_undef);
+  }
+
+  FREETMPS;
+  LEAVE;
 }
 
-/* Called on all new messages; receivemsg is only called on incoming ones */
-void owl_perlconfig_newmsg(const owl_message *m, const char *subname)
+/* Called on a batch of incoming messages, given by id, in a single
+   call into perl */
+void owl_perlconfig_getmsgs(const GArray *ids)
 {
-  char *ptr = NULL;
-  if (owl_perlconfig_is_function("BarnOwl::Hooks::_new_msg")) {
-    ptr = owl_perlconfig_call_with_message(subname?subname
-                                           :"BarnOwl::Hooks::_new_msg", m);
-  }
-  g_free(ptr);
+  if (ids->len == 0) return;
+  if (owl_perlconfig_is_function("BarnOwl::Hooks::_receive_msgs"))
+    owl_perlconfig_call_with_messages("BarnOwl::Hooks::_receive_msgs", ids);
+}
+
+/* Called on all new messages; getmsgs is only called on incoming ones */
+void owl_perlconfig_newmsgs(const GArray *ids)
+{
+  if (ids->len == 0) return;
+  if (owl_perlconfig_is_function("BarnOwl::Hooks::_new_msgs"))
+    owl_perlconfig_call_with_messages("BarnOwl::Hooks::_new_msgs", ids);
 }
 
 void owl_perlconfig_new_command(const char *name)
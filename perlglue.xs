@@ -546,6 +546,42 @@ remove_timer(timer)
 		owl_function_debugmsg("Freeing timer %s: %p", t->name ? t->name : "(unnamed)", t);
 		owl_select_remove_timer(t);
 
+SV *
+message_field(id, key)
+	int id
+	const char *key
+	PREINIT:
+		const owl_message *m;
+		SV *sv;
+	CODE:
+	{
+		m = owl_message_get_by_id(id);
+		sv = m ? owl_perlconfig_message_field(m, key) : NULL;
+		RETVAL = sv ? sv : &PL_sv_undef;
+	}
+	OUTPUT:
+		RETVAL
+
+void
+message_field_names(id)
+	int id
+	PREINIT:
+		const owl_message *m;
+		owl_list names;
+		int i;
+	PPCODE:
+	{
+		m = owl_message_get_by_id(id);
+		if (m) {
+			owl_list_create(&names);
+			owl_perlconfig_message_field_names(m, &names);
+			for (i = 0; i < owl_list_get_size(&names); i++) {
+				XPUSHs(sv_2mortal(owl_new_sv(owl_list_get_element(&names, i))));
+			}
+			owl_list_cleanup(&names, NULL);
+		}
+	}
+
 MODULE = BarnOwl		PACKAGE = BarnOwl::Editwin
 
 int
@@ -5,6 +5,49 @@ void owl_regex_init(owl_regex *re)
 {
   re->negate=0;
   re->string=NULL;
+  re->kind=OWL_REGEX_KIND_REGEX;
+  re->literal=NULL;
+  re->literal_len=0;
+}
+
+/* Work out whether 'pattern' is just an ASCII literal, optionally
+ * anchored at either end.  If so, return the kind of match it needs
+ * and leave the unquoted literal in 'literal'.  Anything else is
+ * OWL_REGEX_KIND_REGEX.  Since patterns are compiled without
+ * REG_NEWLINE, the anchors only match at the ends of the string. */
+static int owl_regex_classify(const char *pattern, GString *literal)
+{
+  const char *p = pattern;
+  int prefix = 0, suffix = 0;
+  unsigned char c;
+
+  if (*p == '^') {
+    prefix = 1;
+    p++;
+  }
+  for (; *p; p++) {
+    c = *p;
+    if (c == '\\') {
+      /* Escaped specials are literal; \w, \< and the like are not */
+      if (!p[1] || !strchr(OWL_REGEX_QUOTECHARS, p[1]))
+        return OWL_REGEX_KIND_REGEX;
+      c = *++p;
+    } else if (c == '$' && !p[1]) {
+      suffix = 1;
+      break;
+    } else if (c != '!' && strchr(OWL_REGEX_QUOTECHARS, c)) {
+      return OWL_REGEX_KIND_REGEX;
+    }
+    /* Leave case folding outside ASCII to the regex engine */
+    if (c >= 0x80)
+      return OWL_REGEX_KIND_REGEX;
+    g_string_append_c(literal, c);
+  }
+
+  if (prefix && suffix) return OWL_REGEX_KIND_EXACT;
+  if (prefix) return OWL_REGEX_KIND_PREFIX;
+  if (suffix) return OWL_REGEX_KIND_SUFFIX;
+  return OWL_REGEX_KIND_SUBSTRING;
 }
 
 int owl_regex_create(owl_regex *re, const char *string)
@@ -12,6 +55,7 @@ int owl_regex_create(owl_regex *re, const char *string)
   int ret;
   char buff1[LINE];
   const char *ptr;
+  GString *literal;
   
   re->string=g_strdup(string);
 
@@ -22,6 +66,18 @@ int owl_regex_create(owl_regex *re, const char *string)
     re->negate=1;
   }
 
+  /* Literals are matched directly, without the regex engine */
+  literal=g_string_new("");
+  re->kind=owl_regex_classify(ptr, literal);
+  if (re->kind!=OWL_REGEX_KIND_REGEX) {
+    re->literal_len=literal->len;
+    re->literal=g_string_free(literal, FALSE);
+    return(0);
+  }
+  g_string_free(literal, TRUE);
+  re->literal=NULL;
+  re->literal_len=0;
+
   /* set the regex */
   ret=regcomp(&(re->re), ptr, REG_EXTENDED|REG_ICASE);
   if (ret) {
@@ -45,6 +101,64 @@ int owl_regex_create_quoted(owl_regex *re, const char *string)
   return(0);
 }
 
+/* Return the first case-insensitive occurrence of the 'len' byte ASCII
+ * 'literal' in 'string', or NULL */
+static const char *owl_regex_find_literal(const char *string, const char *literal, int len)
+{
+  char first[3];
+  const char *p;
+
+  if (len == 0) return string;
+
+  /* Let strpbrk find candidates for the first character */
+  first[0] = g_ascii_tolower(literal[0]);
+  first[1] = g_ascii_toupper(literal[0]);
+  first[2] = '\0';
+  if (first[0] == first[1]) first[1] = '\0';
+
+  for (p = strpbrk(string, first); p; p = strpbrk(p + 1, first)) {
+    if (g_ascii_strncasecmp(p + 1, literal + 1, len - 1) == 0)
+      return p;
+  }
+  return NULL;
+}
+
+/* Match 'string' against a literal pattern as regexec would */
+static int owl_regex_compare_literal(const owl_regex *re, const char *string, regmatch_t *match)
+{
+  const char *p;
+  size_t len;
+
+  switch (re->kind) {
+  case OWL_REGEX_KIND_SUBSTRING:
+    p = owl_regex_find_literal(string, re->literal, re->literal_len);
+    if (!p) return REG_NOMATCH;
+    match->rm_so = p - string;
+    break;
+  case OWL_REGEX_KIND_PREFIX:
+    if (g_ascii_strncasecmp(string, re->literal, re->literal_len) != 0)
+      return REG_NOMATCH;
+    match->rm_so = 0;
+    break;
+  case OWL_REGEX_KIND_SUFFIX:
+    len = strlen(string);
+    if (len < (size_t)re->literal_len ||
+        g_ascii_strcasecmp(string + len - re->literal_len, re->literal) != 0)
+      return REG_NOMATCH;
+    match->rm_so = len - re->literal_len;
+    break;
+  case OWL_REGEX_KIND_EXACT:
+    if (g_ascii_strcasecmp(string, re->literal) != 0)
+      return REG_NOMATCH;
+    match->rm_so = 0;
+    break;
+  default:
+    return REG_NOMATCH;
+  }
+  match->rm_eo = match->rm_so + re->literal_len;
+  return 0;
+}
+
 int owl_regex_compare(const owl_regex *re, const char *string, int *start, int *end)
 {
   int out, ret;
@@ -55,7 +169,11 @@ int owl_regex_compare(const owl_regex *re, const char *string, int *start, int *
     return(0);
   }
   
-  ret=regexec(&(re->re), string, 1, &match, 0);
+  if (re->kind!=OWL_REGEX_KIND_REGEX) {
+    ret=owl_regex_compare_literal(re, string, &match);
+  } else {
+    ret=regexec(&(re->re), string, 1, &match, 0);
+  }
   out=ret;
   if (re->negate) {
     out=!out;
@@ -87,6 +205,8 @@ void owl_regex_cleanup(owl_regex *re)
 {
     if (re->string) {
         g_free(re->string);
-        regfree(&(re->re));
+        if (re->kind==OWL_REGEX_KIND_REGEX)
+          regfree(&(re->re));
+        g_free(re->literal);
     }
 }
@@ -0,0 +1,220 @@
+/* Resolve the addresses zephyrs come from without blocking the main
+ * thread.  Lookups run on a thread of their own; their results are
+ * kept in a bounded cache, most recently used first, and copied into
+ * every message waiting on them.
+ *
+ * A message is not held back for its lookup, so anything done with it
+ * before the name is known, logging it in particular, sees the numeric
+ * address.  Hosts already in the cache are named at once.
+ */
+
+#include "owl.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+typedef struct _owl_resolver_entry { /* noproto */
+  char *addr;           /* numeric address, the key */
+  char *host;
+  GList *link;          /* in owl_resolver_lru */
+} owl_resolver_entry;
+
+typedef struct _owl_resolver_lookup { /* noproto */
+  char *addr;
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char *host;
+} owl_resolver_lookup;
+
+static GMainContext *resolver_context;
+static GMainLoop *resolver_loop;
+static GThread *resolver_thread;
+static int resolver_cancelled;          /* set at exit; skip what is queued */
+
+/* The rest belongs to the main thread */
+static GHashTable *owl_resolver_cache;     /* addr -> owl_resolver_entry */
+static GQueue *owl_resolver_lru;
+static GHashTable *owl_resolver_pending;   /* addr -> GSList of message ids */
+
+static void owl_resolver_entry_delete(gpointer data)
+{
+  owl_resolver_entry *e = data;
+
+  g_free(e->addr);
+  g_free(e->host);
+  g_free(e);
+}
+
+static void owl_resolver_lookup_delete(void *data)
+{
+  owl_resolver_lookup *l = data;
+
+  g_free(l->addr);
+  g_free(l->host);
+  g_free(l);
+}
+
+/* Return the cached name for 'addr', or NULL */
+static const char *owl_resolver_cache_find(const char *addr)
+{
+  owl_resolver_entry *e;
+
+  e = g_hash_table_lookup(owl_resolver_cache, addr);
+  if (!e) return NULL;
+  g_queue_unlink(owl_resolver_lru, e->link);
+  g_queue_push_head_link(owl_resolver_lru, e->link);
+  return e->host;
+}
+
+static void owl_resolver_cache_insert(const char *addr, const char *host)
+{
+  owl_resolver_entry *e;
+
+  if (g_hash_table_lookup(owl_resolver_cache, addr)) return;
+
+  e = g_new(owl_resolver_entry, 1);
+  e->addr = g_strdup(addr);
+  e->host = g_strdup(host);
+  g_queue_push_head(owl_resolver_lru, e);
+  e->link = g_queue_peek_head_link(owl_resolver_lru);
+  g_hash_table_insert(owl_resolver_cache, e->addr, e);
+
+  while (g_queue_get_length(owl_resolver_lru) > OWL_RESOLVER_CACHE_SIZE) {
+    e = g_queue_pop_tail(owl_resolver_lru);
+    g_hash_table_remove(owl_resolver_cache, e->addr);
+  }
+}
+
+/* Runs on the main thread with a finished lookup */
+static void owl_resolver_done(void *data)
+{
+  owl_resolver_lookup *l = data;
+  GSList *ids, *id;
+  owl_message *m;
+  int changed = 0;
+
+  owl_resolver_cache_insert(l->addr, l->host);
+
+  ids = g_hash_table_lookup(owl_resolver_pending, l->addr);
+  g_hash_table_remove(owl_resolver_pending, l->addr);
+  for (id = ids; id; id = id->next) {
+    /* The message may have been expunged in the meantime */
+    m = owl_message_get_by_id(GPOINTER_TO_INT(id->data));
+    if (!m) continue;
+    owl_message_set_zephyr_hostname(m, l->host);
+    owl_message_invalidate_format(m);
+    changed = 1;
+  }
+  g_slist_free(ids);
+
+  if (changed)
+    owl_mainwin_redisplay(owl_global_get_mainwin(&g));
+}
+
+/* Runs on the resolver thread */
+static void owl_resolver_lookup_run(void *data)
+{
+  owl_resolver_lookup *l = data;
+  char hbuf[NI_MAXHOST];
+
+  /* Each lookup may take as long as the resolver's timeout; do not
+   * make exit wait for the ones still queued */
+  if (g_atomic_int_get(&resolver_cancelled)) {
+    owl_resolver_lookup_delete(l);
+    return;
+  }
+  if (getnameinfo((struct sockaddr *)&l->sa, l->salen, hbuf, sizeof(hbuf), NULL, 0, 0) == 0)
+    l->host = g_strdup(hbuf);
+  else
+    l->host = g_strdup(l->addr);
+
+  owl_select_post_task(owl_resolver_done, l, owl_resolver_lookup_delete, NULL);
+}
+
+/* Set the hostname of 'm' to the name of the host at 'sa'.  Until the
+ * name is known, the message gets the numeric address instead.
+ */
+void owl_resolver_set_hostname(owl_message *m, const struct sockaddr *sa, socklen_t salen)
+{
+  char abuf[NI_MAXHOST];
+  const char *host;
+  owl_resolver_lookup *l;
+  GSList *ids;
+
+  if (getnameinfo(sa, salen, abuf, sizeof(abuf), NULL, 0, NI_NUMERICHOST) != 0)
+    return;
+
+  if (!resolver_context) {
+    owl_message_set_hostname(m, abuf);
+    return;
+  }
+
+  host = owl_resolver_cache_find(abuf);
+  if (host) {
+    owl_message_set_zephyr_hostname(m, host);
+    return;
+  }
+  owl_message_set_hostname(m, abuf);
+
+  /* Only look up each address once, however many messages want it */
+  ids = g_hash_table_lookup(owl_resolver_pending, abuf);
+  if (ids) {
+    ids = g_slist_prepend(ids, GINT_TO_POINTER(owl_message_get_id(m)));
+    g_hash_table_insert(owl_resolver_pending, g_strdup(abuf), ids);
+    return;
+  }
+  ids = g_slist_prepend(NULL, GINT_TO_POINTER(owl_message_get_id(m)));
+  g_hash_table_insert(owl_resolver_pending, g_strdup(abuf), ids);
+
+  l = g_new0(owl_resolver_lookup, 1);
+  l->addr = g_strdup(abuf);
+  memcpy(&l->sa, sa, MIN(salen, sizeof(l->sa)));
+  l->salen = MIN(salen, sizeof(l->sa));
+  owl_select_post_task(owl_resolver_lookup_run, l, NULL, resolver_context);
+}
+
+static gpointer owl_resolver_thread_func(gpointer data)
+{
+  g_main_loop_run(resolver_loop);
+  return NULL;
+}
+
+void owl_resolver_init(void)
+{
+  GError *error = NULL;
+
+  owl_resolver_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             NULL, owl_resolver_entry_delete);
+  owl_resolver_lru = g_queue_new();
+  owl_resolver_pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, NULL);
+
+  resolver_context = g_main_context_new();
+  resolver_loop = g_main_loop_new(resolver_context, FALSE);
+  resolver_thread = g_thread_create(owl_resolver_thread_func,
+                                    NULL,
+                                    TRUE,
+                                    &error);
+  if (error) {
+    owl_function_error("Error spawning resolver thread: %s", error->message);
+    g_error_free(error);
+    g_main_loop_unref(resolver_loop);
+    g_main_context_unref(resolver_context);
+    resolver_loop = NULL;
+    resolver_context = NULL;
+  }
+}
+
+static void owl_resolver_quit_func(gpointer data)
+{
+  g_main_loop_quit(resolver_loop);
+}
+
+void owl_resolver_shutdown(void)
+{
+  if (!resolver_context) return;
+  g_atomic_int_set(&resolver_cancelled, 1);
+  owl_select_post_task(owl_resolver_quit_func, NULL,
+                       NULL, resolver_context);
+  g_thread_join(resolver_thread);
+}
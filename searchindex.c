@@ -0,0 +1,290 @@
+/* A trigram index of formatted message text, so that searching need
+ * not format and regexec every message to find the few that can match.
+ *
+ * For each trigram of lowercase ASCII without whitespace, the index
+ * keeps the sorted ids of the messages with it in their formatted
+ * text, which is exactly what a search looks at.  A search for a
+ * literal wants the messages that have every trigram of it; only
+ * those are formatted and checked.
+ *
+ * A message is indexed each time it is formatted, and when it arrives
+ * or is searched past, if the style can format it without perl, which
+ * is cheap and does not touch the format cache.  Its entry is only
+ * trusted while nothing has changed that could format it differently:
+ * a change to the message forgets its entry, and anything that changes
+ * how all messages are formatted starts a new generation, which
+ * forgets them all.  Messages without a trusted entry, those of perl
+ * styles, are always checked, and searching formats, and so indexes,
+ * them.
+ */
+
+#include "owl.h"
+#include <string.h>
+
+/* trigram -> GArray of message ids, sorted */
+static GHashTable *searchindex_postings;
+/* entries indexed in an older generation are not trusted */
+static unsigned int searchindex_generation = 1;
+
+static void owl_searchindex_postings_delete(gpointer data)
+{
+  g_array_free(data, TRUE);
+}
+
+static void owl_searchindex_setup(void)
+{
+  if (searchindex_postings) return;
+  searchindex_postings = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                               NULL, owl_searchindex_postings_delete);
+}
+
+static gint owl_searchindex_key_cmp(gconstpointer a, gconstpointer b)
+{
+  guint ka = *(const guint *)a, kb = *(const guint *)b;
+  return ka < kb ? -1 : ka > kb;
+}
+
+/* Return the trigrams of 'text', 'len' bytes long, sorted and without
+ * duplicates.  Trigrams with whitespace, which a literal may span
+ * differently, or with anything outside ASCII, whose case we do not
+ * fold, are left out. */
+static GArray *owl_searchindex_trigrams_len(const char *text, size_t len)
+{
+  GArray *keys = g_array_new(FALSE, FALSE, sizeof(guint));
+  guint key = 0;
+  int run = 0;
+  size_t i;
+  guint j, n;
+  unsigned char c;
+
+  for (i = 0; i < len; i++) {
+    c = text[i];
+    if (c <= ' ' || c >= 0x7f) {
+      run = 0;
+      continue;
+    }
+    key = ((key << 8) | g_ascii_tolower(c)) & 0xffffff;
+    if (++run >= 3)
+      g_array_append_val(keys, key);
+  }
+
+  g_array_sort(keys, owl_searchindex_key_cmp);
+  for (i = 0, n = 0; i < keys->len; i++) {
+    j = g_array_index(keys, guint, i);
+    if (n == 0 || g_array_index(keys, guint, n - 1) != j)
+      g_array_index(keys, guint, n++) = j;
+  }
+  g_array_set_size(keys, n);
+  return keys;
+}
+
+/* Return where 'id' is or belongs in 'postings' */
+static guint owl_searchindex_find(const GArray *postings, int id)
+{
+  guint lo = 0, hi = postings->len, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (g_array_index(postings, int, mid) < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void owl_searchindex_add_id(guint key, int id)
+{
+  GArray *postings;
+  guint at;
+
+  postings = g_hash_table_lookup(searchindex_postings, GUINT_TO_POINTER(key));
+  if (!postings) {
+    postings = g_array_new(FALSE, FALSE, sizeof(int));
+    g_hash_table_insert(searchindex_postings, GUINT_TO_POINTER(key), postings);
+  }
+  /* Messages are mostly first formatted in order of id */
+  if (postings->len == 0 || g_array_index(postings, int, postings->len - 1) < id) {
+    g_array_append_val(postings, id);
+    return;
+  }
+  at = owl_searchindex_find(postings, id);
+  if (at == postings->len || g_array_index(postings, int, at) != id)
+    g_array_insert_val(postings, at, id);
+}
+
+static void owl_searchindex_remove_id(guint key, int id)
+{
+  GArray *postings;
+  guint at;
+
+  postings = g_hash_table_lookup(searchindex_postings, GUINT_TO_POINTER(key));
+  if (!postings) return;
+  at = owl_searchindex_find(postings, id);
+  if (at < postings->len && g_array_index(postings, int, at) == id)
+    g_array_remove_index(postings, at);
+  if (postings->len == 0)
+    g_hash_table_remove(searchindex_postings, GUINT_TO_POINTER(key));
+}
+
+/* Keep 'm' in the index from now on.  It is indexed the next time it
+ * is formatted; see also owl_message_index_format. */
+void owl_searchindex_add_message(owl_message *m)
+{
+  owl_searchindex_setup();
+  owl_message_set_searchindexed(m, 1);
+}
+
+/* Note that 'm' has been formatted as 'text', and index it as such */
+void owl_searchindex_note_format(owl_message *m, const char *text)
+{
+  GArray *keys, *old;
+  guint i = 0, j = 0, ki, kj;
+  int id = owl_message_get_id(m);
+
+  if (!owl_message_is_searchindexed(m)) return;
+
+  keys = owl_searchindex_trigrams_len(text, strlen(text));
+  old = m->searchkeys;
+  m->searchkeys = keys;
+  m->searchgen = searchindex_generation;
+
+  /* Formatting again mostly gives the same text; only post the
+   * difference */
+  while (old && i < old->len && j < keys->len) {
+    ki = g_array_index(old, guint, i);
+    kj = g_array_index(keys, guint, j);
+    if (ki == kj) {
+      i++;
+      j++;
+    } else if (ki < kj) {
+      owl_searchindex_remove_id(ki, id);
+      i++;
+    } else {
+      owl_searchindex_add_id(kj, id);
+      j++;
+    }
+  }
+  for (; old && i < old->len; i++)
+    owl_searchindex_remove_id(g_array_index(old, guint, i), id);
+  for (; j < keys->len; j++)
+    owl_searchindex_add_id(g_array_index(keys, guint, j), id);
+
+  if (old) g_array_free(old, TRUE);
+}
+
+/* 'm' has changed, so may no longer format as it was indexed */
+void owl_searchindex_forget_format(owl_message *m)
+{
+  m->searchgen = 0;
+}
+
+/* Every message may now format differently than it was indexed */
+void owl_searchindex_new_generation(void)
+{
+  searchindex_generation++;
+}
+
+/* Take the indexed message 'm' out of the index */
+void owl_searchindex_remove_message(owl_message *m)
+{
+  guint i;
+
+  if (!m->searchkeys) return;
+  for (i = 0; i < m->searchkeys->len; i++)
+    owl_searchindex_remove_id(g_array_index(m->searchkeys, guint, i), owl_message_get_id(m));
+  g_array_free(m->searchkeys, TRUE);
+  m->searchkeys = NULL;
+}
+
+static gint owl_searchindex_postings_cmp(gconstpointer a, gconstpointer b)
+{
+  const GArray *pa = *(GArray *const *)a, *pb = *(GArray *const *)b;
+  return pa->len - pb->len;
+}
+
+/* Return the sorted ids of indexed messages that 're' may match, or
+ * NULL if the index cannot tell.  're' must be a literal, as
+ * owl_regex_create_quoted makes. */
+GArray *owl_searchindex_candidates(const owl_regex *re)
+{
+  GArray *keys, *postings, *result;
+  GPtrArray *lists;
+  GString *literal;
+  const char *p;
+  guint i, j;
+  int id, ok;
+
+  if (!owl_regex_is_set(re) || re->negate || !searchindex_postings)
+    return NULL;
+
+  /* Unquote the literal; anything unquoted that could be special ends
+   * the part we can use */
+  literal = g_string_new("");
+  for (p = owl_regex_get_string(re); *p; p++) {
+    if (*p == '\\' && p[1]) {
+      g_string_append_c(literal, *++p);
+    } else if (strchr(OWL_REGEX_QUOTECHARS, *p)) {
+      g_string_append_c(literal, ' ');
+    } else {
+      g_string_append_c(literal, *p);
+    }
+  }
+  keys = owl_searchindex_trigrams_len(literal->str, literal->len);
+  g_string_free(literal, TRUE);
+
+  if (keys->len == 0) {
+    g_array_free(keys, TRUE);
+    return NULL;
+  }
+
+  lists = g_ptr_array_new();
+  result = g_array_new(FALSE, FALSE, sizeof(int));
+  for (i = 0; i < keys->len; i++) {
+    postings = g_hash_table_lookup(searchindex_postings,
+                                   GUINT_TO_POINTER(g_array_index(keys, guint, i)));
+    if (!postings) {
+      /* No indexed message can match */
+      g_array_free(keys, TRUE);
+      g_ptr_array_free(lists, TRUE);
+      return result;
+    }
+    g_ptr_array_add(lists, postings);
+  }
+  g_array_free(keys, TRUE);
+
+  g_ptr_array_sort(lists, owl_searchindex_postings_cmp);
+  postings = g_ptr_array_index(lists, 0);
+  for (i = 0; i < postings->len; i++) {
+    id = g_array_index(postings, int, i);
+    ok = 1;
+    for (j = 1; ok && j < lists->len; j++)
+      ok = owl_searchindex_contains(g_ptr_array_index(lists, j), id);
+    if (ok)
+      g_array_append_val(result, id);
+  }
+  g_ptr_array_free(lists, TRUE);
+  return result;
+}
+
+/* Whether the sorted 'ids' include 'id' */
+int owl_searchindex_contains(const GArray *ids, int id)
+{
+  guint at = owl_searchindex_find(ids, id);
+  return at < ids->len && g_array_index(ids, int, at) == id;
+}
+
+/* Whether the index's entry for 'm' is trusted */
+int owl_searchindex_is_current(const owl_message *m)
+{
+  return owl_message_is_searchindexed(m) && m->searchkeys &&
+    m->searchgen == searchindex_generation;
+}
+
+/* Whether 'm' may be one of the messages 'candidates' allows */
+int owl_searchindex_may_match(const GArray *candidates, const owl_message *m)
+{
+  if (!candidates || !owl_searchindex_is_current(m))
+    return 1;
+  return owl_searchindex_contains(candidates, owl_message_get_id(m));
+}
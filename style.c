@@ -6,6 +6,7 @@ void owl_style_create_perl(owl_style *s, const char *name, SV *obj)
 {
   s->name=g_strdup(name);
   s->perlobj = obj;
+  s->format_message = owl_nativestyle_get_formatter(obj);
 }
 
 int owl_style_matches_name(const owl_style *s, const char *name)
@@ -36,33 +37,13 @@ const char *owl_style_get_description(const owl_style *s)
   }
 }
 
-/* Use style 's' to format message 'm' into fmtext 'fm'.
- * 'fm' should already be be initialzed
- */
-void owl_style_get_formattext(const owl_style *s, owl_fmtext *fm, const owl_message *m)
+/* Indent 'body' and put it in 'fm', as every style's text is shown */
+static void owl_style_body_to_fmtext(owl_fmtext *fm, const char *body)
 {
-  const char *body;
   char *indent;
   int curlen;
   owl_fmtext with_tabs;
 
-  SV *sv = NULL;
-  
-  /* Call the perl object */
-  OWL_PERL_CALL_METHOD(s->perlobj,
-                       "format_message",
-                       XPUSHs(sv_2mortal(owl_perlconfig_message2hashref(m)));,
-                       "Error in format_message: %s",
-                       0,
-                       sv = SvREFCNT_inc(POPs);
-                       );
-
-  if(sv) {
-    body = SvPV_nolen(sv);
-  } else {
-    body = "<unformatted message>";
-  }
-
   /* indent and ensure ends with a newline */
   indent = owl_text_indent(body, OWL_TAB);
   curlen = strlen(indent);
@@ -80,6 +61,48 @@ void owl_style_get_formattext(const owl_style *s, owl_fmtext *fm, const owl_mess
   owl_fmtext_cleanup(&with_tabs);
 
   g_free(indent);
+}
+
+/* Format 'm' into 'fm' as owl_style_get_formattext does, if the C
+ * version of style 's' can, without calling into perl.  Returns 0,
+ * leaving 'fm' alone, if it cannot.
+ */
+int owl_style_get_native_formattext(const owl_style *s, owl_fmtext *fm, const owl_message *m)
+{
+  GString *native;
+
+  if (!s->format_message) return 0;
+  native = g_string_new("");
+  if (!s->format_message(m, native)) {
+    g_string_free(native, true);
+    return 0;
+  }
+  owl_style_body_to_fmtext(fm, native->str);
+  g_string_free(native, true);
+  return 1;
+}
+
+/* Use style 's' to format message 'm' into fmtext 'fm'.
+ * 'fm' should already be be initialzed
+ */
+void owl_style_get_formattext(const owl_style *s, owl_fmtext *fm, const owl_message *m)
+{
+  SV *sv = NULL;
+
+  /* Try the C version of the style first */
+  if (owl_style_get_native_formattext(s, fm, m))
+    return;
+
+  /* Call the perl object */
+  OWL_PERL_CALL_METHOD(s->perlobj,
+                       "format_message",
+                       XPUSHs(sv_2mortal(owl_perlconfig_message2hashref(m)));,
+                       "Error in format_message: %s",
+                       0,
+                       sv = SvREFCNT_inc(POPs);
+                       );
+
+  owl_style_body_to_fmtext(fm, sv ? SvPV_nolen(sv) : "<unformatted message>");
   if(sv)
     SvREFCNT_dec(sv);
 }
@@ -0,0 +1,37 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+
+use Test::More qw(no_plan);
+
+=head1 DESCRIPTION
+
+Perl objects for messages read their fields from the C message as they
+are looked up.  These check that an object held on to keeps its
+fields once the message has been expunged.
+
+=cut
+
+BarnOwl::admin_message("test header", "a body to keep");
+my $m = BarnOwl::getcurmsg();
+ok(defined $m, "got the message");
+my $id = $m->id;
+is($m->{header}, "test header", "field read while the message exists");
+
+$m->{extra} = "stored in perl";
+delete $m->{zsig};
+
+BarnOwl::command("delete -id $id");
+BarnOwl::command("expunge");
+ok(!defined BarnOwl::Internal::message_field($id, "body"),
+   "message is freed");
+
+is($m->{body}, "a body to keep", "unread field kept after expunge");
+is($m->type, "admin", "accessor works after expunge");
+is($m->{header}, "test header", "read field kept after expunge");
+is($m->{extra}, "stored in perl", "stored field kept after expunge");
+ok(!exists $m->{zsig}, "deleted field stays deleted");
+ok((grep { $_ eq "body" } keys %$m), "keys listed after expunge");
+
+my $other = BarnOwl::getcurmsg();
+ok(!defined $other || $other->id != $id, "expunged message is not current");
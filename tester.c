@@ -5,6 +5,7 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #undef instr
 #include <curses.h>
@@ -22,6 +23,13 @@ int owl_obarray_regtest(void);
 int owl_editwin_regtest(void);
 int owl_fmtext_regtest(void);
 int owl_smartfilter_regtest(void);
+int owl_messagelist_regtest(void);
+int owl_nativestyle_regtest(void);
+int owl_logstore_regtest(void);
+int owl_loghistory_regtest(void);
+int owl_searchindex_regtest(void);
+int owl_regex_regtest(void);
+int owl_nativestyle_override_regtest(void);
 
 extern void owl_perl_xs_init(pTHX);
 
@@ -109,6 +117,13 @@ int owl_regtest(void) {
   numfailures += owl_editwin_regtest();
   numfailures += owl_fmtext_regtest();
   numfailures += owl_smartfilter_regtest();
+  numfailures += owl_messagelist_regtest();
+  numfailures += owl_nativestyle_regtest();
+  numfailures += owl_logstore_regtest();
+  numfailures += owl_loghistory_regtest();
+  numfailures += owl_searchindex_regtest();
+  numfailures += owl_regex_regtest();
+  numfailures += owl_nativestyle_override_regtest();
   if (numfailures) {
       fprintf(stderr, "# *** WARNING: %d failures total\n", numfailures);
   }
@@ -356,7 +371,10 @@ static int owl_filter_test_string(const char *filt, const owl_message *m, int sh
 int owl_filter_regtest(void) {
   int numfailed=0;
   owl_message m;
-  owl_filter *f1, *f2, *f3, *f4, *f5;
+  owl_filter *f1, *f2, *f3, *f4, *f5, *f6;
+  int fg, bg, i, iter, count;
+  char *name, *value;
+  const char *key, *val;
 
   owl_message_init(&m);
   owl_message_set_type_zephyr(&m);
@@ -397,11 +415,77 @@ int owl_filter_regtest(void) {
   TEST_FILTER("false and false or true", 1);
   TEST_FILTER("true and false or false", 0);
 
+  /* Jumps in compiled filters */
+  TEST_FILTER("not ( true and false ) and true", 1);
+  TEST_FILTER("false or not ( false or true )", 0);
+  TEST_FILTER("( false or false ) or ( false or true )", 1);
+  TEST_FILTER("not not true and not false", 1);
+
+  /* Field names are case-insensitive; unset attributes are empty */
+  TEST_FILTER("CLASS ^owl$", 1);
+  TEST_FILTER("foo ^bar$ and nosuchattr ^$", 1);
+
+  /* Attributes beyond the fixed slots survive the table growing */
+  for (i = 0; i < 40; i++) {
+    name = g_strdup_printf("attr%d", i);
+    value = g_strdup_printf("value%d", i);
+    owl_message_set_attribute(&m, name, value);
+    g_free(name);
+    g_free(value);
+  }
+  owl_message_set_attribute(&m, "attr7", "seven");
+  FAIL_UNLESS("attribute replaced", !strcmp(owl_message_get_attribute_value(&m, "attr7"), "seven"));
+  FAIL_UNLESS("attribute kept", !strcmp(owl_message_get_attribute_value(&m, "attr39"), "value39"));
+  FAIL_UNLESS("fixed attribute kept", !strcmp(owl_message_get_class(&m), "owl"));
+  FAIL_UNLESS("missing attribute", owl_message_get_attribute_value(&m, "attr40") == NULL);
+  count = 0;
+  iter = 0;
+  while (owl_message_next_attribute(&m, &iter, &key, &val)) count++;
+  /* type, class, instance, sender, recipient, foo and attr0..39 */
+  FAIL_UNLESS("attribute count", count == 46);
+  TEST_FILTER("attr7 ^seven$ and attr12 ^value12$", 1);
+
   f1 = owl_filter_new_fromstring("f1", "class owl");
   owl_global_add_filter(&g, f1);
   TEST_FILTER("filter f1", 1);
+
+  /* Remembered results must follow redefinitions and message changes */
+  f6 = owl_filter_new_fromstring("f6", "filter f1");
+  FAIL_UNLESS("memo: first match", owl_filter_message_match(f6, &m));
+  FAIL_UNLESS("memo: repeat match", owl_filter_message_match(f6, &m));
+  owl_global_remove_filter(&g, "f1");
+  FAIL_UNLESS("memo: removed reference", !owl_filter_message_match(f6, &m));
+  owl_global_add_filter(&g, owl_filter_new_fromstring("f1", "class ^nope$"));
+  FAIL_UNLESS("memo: redefined reference", !owl_filter_message_match(f6, &m));
+  owl_message_set_class(&m, "nope");
+  FAIL_UNLESS("memo: changed message", owl_filter_message_match(f6, &m));
+  owl_message_set_class(&m, "owl");
+  owl_filter_delete(f6);
+
+  f6 = owl_filter_new_fromstring("f6", "deleted ^true$");
+  FAIL_UNLESS("memo: not deleted", !owl_filter_message_match(f6, &m));
+  owl_message_mark_delete(&m);
+  FAIL_UNLESS("memo: deleted", owl_filter_message_match(f6, &m));
+  owl_message_unmark_delete(&m);
+  owl_filter_delete(f6);
   owl_global_remove_filter(&g, "f1");
 
+  /* Colors are remembered until a filter changes */
+  f6 = owl_filter_new_fromstring("f6", "-c red class ^owl$");
+  owl_global_add_filter(&g, f6);
+  owl_message_get_filter_colors(&m, &fg, &bg);
+  FAIL_UNLESS("colors: new filter", fg == OWL_COLOR_RED && bg == OWL_COLOR_DEFAULT);
+  owl_filter_set_bgcolor(f6, OWL_COLOR_BLUE);
+  owl_message_get_filter_colors(&m, &fg, &bg);
+  FAIL_UNLESS("colors: recolored filter", fg == OWL_COLOR_RED && bg == OWL_COLOR_BLUE);
+  owl_message_set_class(&m, "nope");
+  owl_message_get_filter_colors(&m, &fg, &bg);
+  FAIL_UNLESS("colors: changed message", fg == OWL_COLOR_DEFAULT && bg == OWL_COLOR_DEFAULT);
+  owl_message_set_class(&m, "owl");
+  owl_global_remove_filter(&g, "f6");
+  owl_message_get_filter_colors(&m, &fg, &bg);
+  FAIL_UNLESS("colors: removed filter", fg == OWL_COLOR_DEFAULT && bg == OWL_COLOR_DEFAULT);
+
   /* Test recursion prevention */
   FAIL_UNLESS("self reference", (f2 = owl_filter_new_fromstring("test", "filter test")) == NULL);
   owl_filter_delete(f2);
@@ -519,6 +603,21 @@ int owl_editwin_regtest(void) {
   return numfailed;
 }
 
+/* Whether f->runs lists exactly the formatting characters of 'f' */
+static int owl_fmtext_runs_consistent(const owl_fmtext *f)
+{
+  const char *p = owl_fmtext_get_text(f);
+  guint i = 0;
+
+  for (; *p; p = g_utf8_next_char(p)) {
+    if (!owl_fmtext_is_format_char(g_utf8_get_char(p))) continue;
+    if (i >= f->runs->len || g_array_index(f->runs, int, i) != p - owl_fmtext_get_text(f))
+      return 0;
+    i++;
+  }
+  return i == f->runs->len;
+}
+
 int owl_fmtext_regtest(void) {
   int numfailed = 0;
   int start, end;
@@ -653,6 +752,31 @@ int owl_fmtext_regtest(void) {
 	      !strncmp("456\n", owl_fmtext_get_text(&fm1)+start, end-start));
   owl_fmtext_line_extents(&fm1, 2, &start, &end);
   FAIL_UNLESS("point to end of buffer", end == owl_fmtext_num_bytes(&fm1));
+  owl_fmtext_line_extents(&fm1, 5, &start, &end);
+  FAIL_UNLESS("past the last line", start == end && end == owl_fmtext_num_bytes(&fm1));
+  FAIL_UNLESS("line number of last byte",
+              owl_fmtext_line_number(&fm1, owl_fmtext_num_bytes(&fm1)) == 2);
+  owl_fmtext_clear(&fm2);
+  owl_fmtext_append_fmtext(&fm2, &fm1);
+  owl_fmtext_line_extents(&fm2, 1, &start, &end);
+  FAIL_UNLESS("line extents of a copy",
+	      !strncmp("456\n", owl_fmtext_get_text(&fm2)+start, end-start));
+
+  /* Test that formatting characters are tracked. */
+  owl_fmtext_clear(&fm1);
+  owl_fmtext_append_ztext(&fm1, "@b(bold)\tplain @i{x}\n");
+  owl_fmtext_append_normal(&fm1, "raw \xf4\x80\xa0\x81" "bold\n");
+  FAIL_UNLESS("runs after append", owl_fmtext_runs_consistent(&fm1));
+  owl_fmtext_clear(&fm2);
+  owl_fmtext_truncate_cols(&fm1, 2, 8, &fm2);
+  FAIL_UNLESS("runs after truncate_cols", owl_fmtext_runs_consistent(&fm2));
+  str = owl_fmtext_print_plain(&fm2);
+  FAIL_UNLESS("truncate_cols skips formatting",
+              str && !strcmp(str, "ld    pw bold\n"));
+  g_free(str);
+  owl_fmtext_clear(&fm2);
+  owl_fmtext_truncate_lines(&fm1, 1, 1, &fm2);
+  FAIL_UNLESS("runs after truncate_lines", owl_fmtext_runs_consistent(&fm2));
 
   owl_fmtext_cleanup(&fm1);
   owl_fmtext_cleanup(&fm2);
@@ -795,3 +919,672 @@ int owl_smartfilter_regtest(void) {
 
   return numfailed;
 }
+
+static owl_message *owl_messagelist_test_message(const char *class, const char *inst, const char *sender)
+{
+  owl_message *m = g_new(owl_message, 1);
+  owl_message_init(m);
+  owl_message_set_type_zephyr(m);
+  owl_message_set_direction_in(m);
+  owl_message_set_class(m, class);
+  owl_message_set_instance(m, inst);
+  owl_message_set_sender(m, sender);
+  return m;
+}
+
+static int owl_messagelist_test_candidates(const owl_messagelist *ml, const char *filt, int expect_exact, const char *expected)
+{
+  owl_filter *f;
+  unsigned long *set;
+  int i, exact, failed = 0;
+  GString *got = g_string_new("");
+
+  f = owl_filter_new_fromstring("test-filter", filt);
+  if (f == NULL) {
+    printf("not ok can't parse %s\n", filt);
+    g_string_free(got, true);
+    return 1;
+  }
+  set = owl_filter_candidates(f, ml, &exact);
+  for (i = 0; i < owl_messagelist_get_size(ml); i++)
+    g_string_append_c(got, OWL_MSGSET_HAS(set, i) ? '1' : '0');
+  if (exact != expect_exact || strcmp(got->str, expected)) {
+    printf("not ok candidates for %s: %s%s instead of %s%s\n", filt,
+           got->str, exact ? " (exact)" : "",
+           expected, expect_exact ? " (exact)" : "");
+    failed = 1;
+  } else {
+    printf("ok candidates for %s\n", filt);
+  }
+  g_free(set);
+  owl_filter_delete(f);
+  g_string_free(got, true);
+  return failed;
+}
+
+int owl_messagelist_regtest(void) {
+  int numfailed = 0;
+  int i, id, exact, same;
+  owl_messagelist ml;
+  owl_message *m;
+  owl_filter *f;
+  unsigned long *set;
+
+  printf("# BEGIN testing owl_messagelist\n");
+
+  owl_messagelist_create(&ml);
+  owl_messagelist_enable_indexes(&ml);
+  owl_messagelist_append_element(&ml, owl_messagelist_test_message("owl", "tester", "alice"));
+  owl_messagelist_append_element(&ml, owl_messagelist_test_message("Owl", "other", "bob"));
+  owl_messagelist_append_element(&ml, owl_messagelist_test_message("barnowl", "tester", "alice"));
+
+#define TEST_CANDIDATES(f, x, e) do {                                 \
+    numtests++;                                                     \
+    numfailed += owl_messagelist_test_candidates(&ml, f, x, e);     \
+  } while (0)
+
+  TEST_CANDIDATES("true", 1, "111");
+  TEST_CANDIDATES("false", 1, "000");
+  TEST_CANDIDATES("class ^owl$", 1, "110");
+  TEST_CANDIDATES("class owl", 1, "111");
+  TEST_CANDIDATES("not sender ^alice$", 1, "010");
+  TEST_CANDIDATES("class ^owl$ and instance ^tester$", 1, "100");
+  TEST_CANDIDATES("class ^barnowl$ or sender ^bob$", 1, "011");
+  TEST_CANDIDATES("class ^owl$ and body foo", 0, "110");
+  TEST_CANDIDATES("not ( class ^owl$ and body foo )", 0, "111");
+  TEST_CANDIDATES("sender ^alice$ or perl foo", 0, "111");
+  TEST_CANDIDATES("filter nonexistent", 1, "000");
+
+  m = owl_messagelist_get_element(&ml, 0);
+  id = owl_message_get_id(m);
+  FAIL_UNLESS("message found by id", owl_message_get_by_id(id) == m);
+
+  /* Expunging shifts positions; the indexes must follow. */
+  owl_message_mark_delete(m);
+  owl_messagelist_expunge(&ml);
+  FAIL_UNLESS("expunged message not found by id", owl_message_get_by_id(id) == NULL);
+  TEST_CANDIDATES("class ^owl$", 1, "10");
+  TEST_CANDIDATES("sender ^alice$", 1, "01");
+
+  /* Older messages go before newer ones, wherever they arrive from */
+  m = owl_messagelist_test_message("history", "tester", "carol");
+  owl_message_set_id(m, id);
+  FAIL_UNLESS("older message inserted first", owl_messagelist_insert_elements(&ml, &m, 1) == 0);
+  FAIL_UNLESS("inserted message found by id", owl_messagelist_get_by_id(&ml, id) == m);
+  TEST_CANDIDATES("sender ^carol$", 1, "100");
+  TEST_CANDIDATES("class ^owl$", 1, "010");
+
+  for (i = 0; i < owl_messagelist_get_size(&ml); i++)
+    owl_message_delete(owl_messagelist_get_element(&ml, i));
+  owl_messagelist_cleanup(&ml);
+
+  /* Long lists are matched in parallel; the result must not change. */
+  owl_messagelist_create(&ml);
+  for (i = 0; i < OWL_FILTER_PARALLEL_THRESHOLD + 100; i++)
+    owl_messagelist_append_element(&ml, owl_messagelist_test_message(i % 3 ? "other" : "owl", "tester", "alice"));
+  f = owl_filter_new_fromstring("test-filter", "class ^owl$ and not body foo");
+  set = owl_filter_candidates(f, &ml, &exact);
+  FAIL_UNLESS("long list not exact", !exact);
+  owl_filter_refine_candidates(f, &ml, set);
+  same = 1;
+  for (i = 0; i < owl_messagelist_get_size(&ml); i++)
+    if (OWL_MSGSET_HAS(set, i) != (i % 3 == 0)) same = 0;
+  FAIL_UNLESS("long list refined", same);
+  g_free(set);
+  owl_filter_delete(f);
+  for (i = 0; i < owl_messagelist_get_size(&ml); i++)
+    owl_message_delete(owl_messagelist_get_element(&ml, i));
+  owl_messagelist_cleanup(&ml);
+
+  printf("# END testing owl_messagelist (%d failures)\n", numfailed);
+  return numfailed;
+}
+
+/* Returns 1 if style 's' formats 'm' the same in C and in perl. */
+static int owl_nativestyle_test_message(owl_style *s, owl_message *m)
+{
+  owl_style_formatter native = s->format_message;
+  owl_fmtext c, perl;
+  int same;
+
+  owl_fmtext_init_null(&c);
+  owl_fmtext_init_null(&perl);
+  owl_style_get_formattext(s, &c, m);
+  s->format_message = NULL;
+  owl_style_get_formattext(s, &perl, m);
+  s->format_message = native;
+
+  same = !strcmp(owl_fmtext_get_text(&c), owl_fmtext_get_text(&perl));
+  if (!same)
+    printf("# C: %s# perl: %s", owl_fmtext_get_text(&c), owl_fmtext_get_text(&perl));
+  owl_fmtext_cleanup(&c);
+  owl_fmtext_cleanup(&perl);
+  return same;
+}
+
+int owl_nativestyle_regtest(void) {
+  int numfailed = 0;
+  const char *const styles[] = { "default", "oneline", NULL };
+  owl_message m[5];
+  owl_style *s;
+  char *desc;
+  int i, j;
+
+  printf("# BEGIN testing owl_nativestyle\n");
+
+  owl_message_create_admin(&m[0], "header", "admin\nbody\n");
+  owl_message_create_loopback(&m[1], "loop\tback\n\nbody");
+  owl_message_set_direction_in(&m[1]);
+  owl_message_set_sender(&m[1], "loopsender");
+
+  for (i = 2; i < 5; i++) {
+    owl_message_init(&m[i]);
+    owl_message_set_type_zephyr(&m[i]);
+    owl_message_set_direction_out(&m[i]);
+    owl_message_set_sender(&m[i], "me");
+    owl_message_set_recipient(&m[i], "you");
+    owl_message_set_zsig(&m[i], "sig\nmore sig");
+    owl_message_set_hostname(&m[i], "HOST.EXAMPLE.COM");
+  }
+  owl_message_set_class(&m[2], "barnowl");
+  owl_message_set_instance(&m[2], "it's \"quoted\"");
+  owl_message_set_opcode(&m[2], "auto");
+  owl_message_set_body(&m[2], "a very long body \x01 with a control character");
+  owl_message_set_class(&m[3], "message");
+  owl_message_set_instance(&m[3], "personal");
+  owl_message_set_attribute(&m[3], "isprivate", "true");
+  owl_message_set_body(&m[3], "personal (with parens)");
+  owl_message_set_class(&m[4], "message");
+  owl_message_set_instance(&m[4], "personal");
+  owl_message_set_islogin(&m[4]);
+
+  for (i = 0; styles[i]; i++) {
+    s = (owl_style *)owl_global_get_style_by_name(&g, styles[i]);
+    FAIL_UNLESS("style has a C formatter", s && s->format_message);
+    if (!s || !s->format_message)
+      continue;
+    for (j = 0; j < 5; j++) {
+      desc = g_strdup_printf("%s formats message %d as perl does", styles[i], j);
+      FAIL_UNLESS(desc, owl_nativestyle_test_message(s, &m[j]));
+      g_free(desc);
+    }
+  }
+
+  for (i = 0; i < 5; i++)
+    owl_message_cleanup(&m[i]);
+
+  printf("# END testing owl_nativestyle (%d failures)\n", numfailed);
+  return numfailed;
+}
+
+static void owl_logstore_free_bodies(GPtrArray *bodies)
+{
+  g_ptr_array_foreach(bodies, (GFunc)g_free, NULL);
+  g_ptr_array_free(bodies, TRUE);
+}
+
+/* Write records to a store, reopen it and search it */
+static int owl_logstore_query_regtest(void) {
+  int numfailed = 0;
+  static const char *const senders[] = { "alice@ATHENA.MIT.EDU", "bob", "alice@ATHENA.MIT.EDU", "bob" };
+  static const char *const classes[] = { "help", "help", "random", "random" };
+  static const char *const bodies[] = { "first needle", "a haystack", "second needle", "last words" };
+  const char *words[1];
+  char dirname[] = "/tmp/owl-logstore-XXXXXX";
+  char *record, *path;
+  GPtrArray *found;
+  owl_message m;
+  FILE *file;
+  int i;
+
+  if (!mkdtemp(dirname)) {
+    FAIL_UNLESS("make a store directory", 0);
+    return numfailed;
+  }
+
+  for (i = 0; i < 4; i++) {
+    owl_message_init(&m);
+    owl_message_set_type_zephyr(&m);
+    owl_message_set_direction_in(&m);
+    owl_message_set_sender(&m, senders[i]);
+    owl_message_set_class(&m, classes[i]);
+    owl_message_set_instance(&m, "personal");
+    owl_message_set_body(&m, bodies[i]);
+    m.time = 1000 + 100 * i;
+    record = owl_logstore_format_record(&m);
+    FAIL_UNLESS("write a record", owl_logstore_write_record(dirname, record));
+    g_free(record);
+    owl_message_cleanup(&m);
+  }
+  /* Searches read the store back from disk */
+  owl_logstore_close();
+
+  words[0] = "NEEDLE";
+  found = owl_logstore_find_bodies(dirname, NULL, NULL, NULL, 0, 0, words, 1);
+  FAIL_UNLESS("term finds both", found->len == 2);
+  if (found->len == 2) {
+    FAIL_UNLESS("newest first", !strcmp(g_ptr_array_index(found, 0), "second needle"));
+    FAIL_UNLESS("then older", !strcmp(g_ptr_array_index(found, 1), "first needle"));
+  }
+  owl_logstore_free_bodies(found);
+
+  found = owl_logstore_find_bodies(dirname, NULL, "HELP", NULL, 0, 0, words, 1);
+  FAIL_UNLESS("class and term", found->len == 1 &&
+              !strcmp(g_ptr_array_index(found, 0), "first needle"));
+  owl_logstore_free_bodies(found);
+
+  found = owl_logstore_find_bodies(dirname, "alice", NULL, NULL, 0, 0, NULL, 0);
+  FAIL_UNLESS("sender without realm", found->len == 2);
+  owl_logstore_free_bodies(found);
+
+  found = owl_logstore_find_bodies(dirname, "Alice@ATHENA.MIT.EDU", NULL, NULL, 0, 0, NULL, 0);
+  FAIL_UNLESS("sender with realm", found->len == 2);
+  owl_logstore_free_bodies(found);
+
+  found = owl_logstore_find_bodies(dirname, "alice@EXAMPLE.COM", NULL, NULL, 0, 0, NULL, 0);
+  FAIL_UNLESS("sender in another realm", found->len == 0);
+  owl_logstore_free_bodies(found);
+
+  found = owl_logstore_find_bodies(dirname, NULL, "nosuch", NULL, 0, 0, NULL, 0);
+  FAIL_UNLESS("unknown class", found->len == 0);
+  owl_logstore_free_bodies(found);
+
+  found = owl_logstore_find_bodies(dirname, NULL, NULL, NULL, 1100, 1300, NULL, 0);
+  FAIL_UNLESS("time range", found->len == 2);
+  if (found->len == 2) {
+    FAIL_UNLESS("time range newest", !strcmp(g_ptr_array_index(found, 0), "second needle"));
+    FAIL_UNLESS("time range oldest", !strcmp(g_ptr_array_index(found, 1), "a haystack"));
+  }
+  owl_logstore_free_bodies(found);
+
+  found = owl_logstore_find_bodies(dirname, NULL, NULL, NULL, 2000, 0, NULL, 0);
+  FAIL_UNLESS("time range after everything", found->len == 0);
+  owl_logstore_free_bodies(found);
+
+  /* A torn last line of the index is dropped when it is read */
+  owl_logstore_close();
+  path = g_strdup_printf("%s/messages.idx", dirname);
+  file = fopen(path, "a");
+  if (file) {
+    fputs("123 45", file);
+    fclose(file);
+  }
+  found = owl_logstore_find_bodies(dirname, NULL, NULL, NULL, 1, 0, NULL, 0);
+  FAIL_UNLESS("torn index line", found->len == 4);
+  owl_logstore_free_bodies(found);
+  owl_logstore_close();
+
+  unlink(path);
+  g_free(path);
+  path = g_strdup_printf("%s/messages.dat", dirname);
+  unlink(path);
+  g_free(path);
+  rmdir(dirname);
+  return numfailed;
+}
+
+int owl_logstore_regtest(void) {
+  int numfailed = 0;
+  GPtrArray *terms;
+
+  printf("# BEGIN testing owl_logstore\n");
+
+  terms = owl_logstore_body_terms("Hello, hello WORLD!\na b c3po x-ray caf\xc3\xa9");
+  FAIL_UNLESS("distinct words", terms->len == 5);
+  if (terms->len == 5) {
+    FAIL_UNLESS("lowercased", !strcmp(g_ptr_array_index(terms, 0), "hello"));
+    FAIL_UNLESS("punctuation splits", !strcmp(g_ptr_array_index(terms, 1), "world"));
+    FAIL_UNLESS("digits are part of words", !strcmp(g_ptr_array_index(terms, 2), "c3po"));
+    FAIL_UNLESS("short words dropped", !strcmp(g_ptr_array_index(terms, 3), "ray"));
+    FAIL_UNLESS("non-ASCII is part of words", !strcmp(g_ptr_array_index(terms, 4), "caf\xc3\xa9"));
+  }
+  g_ptr_array_foreach(terms, (GFunc)g_free, NULL);
+  g_ptr_array_free(terms, TRUE);
+
+  terms = owl_logstore_body_terms("");
+  FAIL_UNLESS("no words", terms->len == 0);
+  g_ptr_array_free(terms, TRUE);
+
+  numfailed += owl_logstore_query_regtest();
+
+  printf("# END testing owl_logstore (%d failures)\n", numfailed);
+  return numfailed;
+}
+
+static void owl_loghistory_write_file(const char *filename, const char *text)
+{
+  FILE *file = fopen(filename, "w");
+
+  if (!file) return;
+  fputs(text, file);
+  fclose(file);
+}
+
+int owl_loghistory_regtest(void) {
+  int numfailed = 0;
+  char dirname[] = "/tmp/owl-loghistory-XXXXXX";
+  char *classdir, *allpath, *classpath;
+  GPtrArray *msgs;
+  owl_message *m;
+  time_t since = 0;
+
+  printf("# BEGIN testing owl_loghistory\n");
+
+  if (!mkdtemp(dirname)) {
+    FAIL_UNLESS("make a log directory", 0);
+    printf("# END testing owl_loghistory (%d failures)\n", numfailed);
+    return numfailed;
+  }
+  classdir = g_strdup_printf("%s/class", dirname);
+  mkdir(classdir, 0700);
+  allpath = g_strdup_printf("%s/all", dirname);
+  classpath = g_strdup_printf("%s/help", classdir);
+
+  owl_loghistory_write_file(allpath,
+    "Class: message Instance: personal\n"
+    "Time: Thu Oct 15 10:00:00 2026 Host: a.example.com\n"
+    "From: Alice <alice>\n"
+    "\n"
+    "first line\n"
+    "\n"
+    "From: the second paragraph\n"
+    "\n"
+    "Class: message Instance: personal\n"
+    "Time: Thu Oct 15 10:20:00 2026 Host: b.example.com\n"
+    "From: Me <me>\n"
+    "\n"
+    "sent\n"
+    "\n"
+    "Class: message\n"
+    "Time: Thu Oct 15 10:30:00 2026 Host: c.example.com\n"
+    "From: Mallory <mallory>\n"
+    "\n"
+    "no instance\n"
+    "\n"
+    "From: <aim:bob> To: <aim:me>\n"
+    "Time: Thu Oct 15 11:00:00 2026\n"
+    "\n"
+    "hi there\n"
+    "\n"
+    "From: <carol>\n"
+    "Time: Thu Oct 15 11:10:00 2026\n"
+    "\n"
+    "no recipient\n"
+    "\n"
+    "Class: message Instance: personal\n"
+    "Time: Thu Oct 15 11:20:00 2026 Host: d.example.com\n"
+    "Fro");
+  owl_loghistory_write_file(classpath,
+    "Class: help Instance: printing\n"
+    "Time: Thu Oct 15 09:00:00 2026 Host: e.example.com\n"
+    "From: Dave Zsig\n"
+    "second zsig line <dave@OTHER.ORG>\n"
+    "\n"
+    "printer on fire\n"
+    "\n"
+    "Class: help Instance: printing Opcode: auto\n"
+    "Time: Thu Oct 15 12:00:00 2026 Host: f.example.com\n"
+    "From: Eve <eve>\n"
+    "\n"
+    "truncated bo");
+
+  msgs = owl_loghistory_read(dirname, classdir, "me@EXAMPLE.COM", "EXAMPLE.COM", 0);
+  FAIL_UNLESS("malformed entries skipped", msgs->len == 5);
+  if (msgs->len == 5) {
+    m = g_ptr_array_index(msgs, 0);
+    FAIL_UNLESS("truncated last record kept", !strcmp(owl_message_get_body(m), "truncated bo"));
+    FAIL_UNLESS("class log opcode", !strcmp(owl_message_get_opcode(m), "auto"));
+    FAIL_UNLESS("class log not private", !owl_message_is_private(m));
+    FAIL_UNLESS("class log sender gets realm", !strcmp(owl_message_get_sender(m), "eve@EXAMPLE.COM"));
+
+    m = g_ptr_array_index(msgs, 1);
+    FAIL_UNLESS("generic type", !strcmp(owl_message_get_type(m), "generic"));
+    FAIL_UNLESS("generic sender", !strcmp(owl_message_get_sender(m), "aim:bob"));
+    FAIL_UNLESS("generic recipient", !strcmp(owl_message_get_recipient(m), "aim:me"));
+    FAIL_UNLESS("generic body", !strcmp(owl_message_get_body(m), "hi there"));
+    since = m->time;
+
+    m = g_ptr_array_index(msgs, 2);
+    FAIL_UNLESS("outgoing", owl_message_is_direction_out(m));
+    FAIL_UNLESS("malformed header not in body", !strcmp(owl_message_get_body(m), "sent"));
+
+    m = g_ptr_array_index(msgs, 3);
+    FAIL_UNLESS("personal class", !strcmp(owl_message_get_class(m), "message"));
+    FAIL_UNLESS("personal instance", !strcmp(owl_message_get_instance(m), "personal"));
+    FAIL_UNLESS("personal is private", owl_message_is_private(m));
+    FAIL_UNLESS("personal recipient", !strcmp(owl_message_get_recipient(m), "me@EXAMPLE.COM"));
+    FAIL_UNLESS("personal host", !strcmp(owl_message_get_hostname(m), "a.example.com"));
+    FAIL_UNLESS("multi-line body",
+                !strcmp(owl_message_get_body(m), "first line\n\nFrom: the second paragraph"));
+
+    m = g_ptr_array_index(msgs, 4);
+    FAIL_UNLESS("class log class", !strcmp(owl_message_get_class(m), "help"));
+    FAIL_UNLESS("multi-line zsig", !strcmp(owl_message_get_zsig(m), "Dave Zsig\nsecond zsig line"));
+    FAIL_UNLESS("sender keeps its realm", !strcmp(owl_message_get_sender(m), "dave@OTHER.ORG"));
+    FAIL_UNLESS("class log body", !strcmp(owl_message_get_body(m), "printer on fire"));
+  }
+  g_ptr_array_foreach(msgs, (GFunc)owl_message_delete, NULL);
+  g_ptr_array_free(msgs, TRUE);
+
+  if (since) {
+    msgs = owl_loghistory_read(dirname, classdir, "me@EXAMPLE.COM", "EXAMPLE.COM", since);
+    FAIL_UNLESS("only entries since", msgs->len == 2);
+    g_ptr_array_foreach(msgs, (GFunc)owl_message_delete, NULL);
+    g_ptr_array_free(msgs, TRUE);
+  }
+
+  unlink(allpath);
+  unlink(classpath);
+  rmdir(classdir);
+  rmdir(dirname);
+  g_free(allpath);
+  g_free(classpath);
+  g_free(classdir);
+
+  printf("# END testing owl_loghistory (%d failures)\n", numfailed);
+  return numfailed;
+}
+
+int owl_searchindex_regtest(void) {
+  int numfailed = 0;
+  owl_message m, other;
+  owl_regex re;
+  GArray *candidates;
+
+  printf("# BEGIN testing owl_searchindex\n");
+
+  owl_message_create_admin(&m, "header", "a Needle.in the haystack");
+  owl_searchindex_add_message(&m);
+  FAIL_UNLESS("message indexed", owl_message_is_searchindexed(&m));
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "needle.IN");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("unformatted message may match",
+              owl_searchindex_may_match(candidates, &m));
+  if (candidates) g_array_free(candidates, TRUE);
+
+  owl_searchindex_note_format(&m, "From: <bob>\n  a Needle.in the haystack\n");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("literal narrows", candidates != NULL);
+  if (candidates) {
+    FAIL_UNLESS("match is a candidate", owl_searchindex_may_match(candidates, &m));
+    g_array_free(candidates, TRUE);
+  }
+  owl_regex_cleanup(&re);
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "<bob>");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("formatted-only text is a candidate",
+              owl_searchindex_may_match(candidates, &m));
+  if (candidates) g_array_free(candidates, TRUE);
+  owl_regex_cleanup(&re);
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "zzqqxx");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("absent literal has no candidates", candidates && candidates->len == 0);
+  if (candidates) g_array_free(candidates, TRUE);
+  owl_regex_cleanup(&re);
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "in");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("short literal does not narrow", candidates == NULL);
+  owl_regex_cleanup(&re);
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "haybale");
+  owl_message_set_attribute(&m, "extra", "haybale");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("changed message may match", owl_searchindex_may_match(candidates, &m));
+  if (candidates) g_array_free(candidates, TRUE);
+
+  owl_searchindex_note_format(&m, "a haybale");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("reformatted text indexed",
+              candidates && owl_searchindex_contains(candidates, owl_message_get_id(&m)));
+  if (candidates) g_array_free(candidates, TRUE);
+  owl_regex_cleanup(&re);
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "needle");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("old text unindexed", candidates && candidates->len == 0);
+  if (candidates) g_array_free(candidates, TRUE);
+  owl_regex_cleanup(&re);
+
+  owl_searchindex_new_generation();
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "zzqqxx");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("new generation may match", owl_searchindex_may_match(candidates, &m));
+  if (candidates) g_array_free(candidates, TRUE);
+  owl_regex_cleanup(&re);
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "haybale");
+  owl_message_cleanup(&m);
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("cleanup unindexes", candidates && candidates->len == 0);
+  if (candidates) g_array_free(candidates, TRUE);
+  owl_regex_cleanup(&re);
+
+  /* The default style is in C, so messages are indexed as they come,
+   * without being formatted for display */
+  owl_message_create_admin(&m, "header", "a xylophone");
+  owl_message_create_admin(&other, "header", "a kazoo");
+  owl_searchindex_add_message(&m);
+  owl_searchindex_add_message(&other);
+  owl_message_index_format(&m);
+  owl_message_index_format(&other);
+  FAIL_UNLESS("indexed without perl", owl_searchindex_is_current(&other));
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "xylophone");
+  candidates = owl_searchindex_candidates(&re);
+  FAIL_UNLESS("unformatted match is a candidate",
+              owl_searchindex_may_match(candidates, &m));
+  FAIL_UNLESS("unformatted message skipped",
+              !owl_searchindex_may_match(candidates, &other));
+  FAIL_UNLESS("format cache untouched", !m.fmtext && !other.fmtext);
+  if (candidates) g_array_free(candidates, TRUE);
+  owl_regex_cleanup(&re);
+  owl_message_cleanup(&m);
+  owl_message_cleanup(&other);
+
+  printf("# END testing owl_searchindex (%d failures)\n", numfailed);
+  return numfailed;
+}
+
+int owl_regex_regtest(void) {
+  int numfailed = 0;
+  owl_regex re;
+  int start, end;
+
+  printf("# BEGIN testing owl_regex\n");
+
+#define CHECK_REGEX(pattern, kind_, string, matches, so, eo) do {        \
+    owl_regex_init(&re);                                                \
+    owl_regex_create(&re, pattern);                                     \
+    FAIL_UNLESS("kind of " pattern, re.kind == kind_);                  \
+    start = end = -1;                                                   \
+    FAIL_UNLESS(pattern " against " string,                             \
+                (owl_regex_compare(&re, string, &start, &end) == 0) == matches); \
+    if (matches)                                                        \
+      FAIL_UNLESS(pattern " match bounds", start == so && end == eo);   \
+    owl_regex_cleanup(&re);                                             \
+  } while (0)
+
+  CHECK_REGEX("^barnowl$", OWL_REGEX_KIND_EXACT, "BarnOwl", 1, 0, 7);
+  CHECK_REGEX("^barnowl$", OWL_REGEX_KIND_EXACT, "barnowls", 0, 0, 0);
+  CHECK_REGEX("^bar", OWL_REGEX_KIND_PREFIX, "barnowl", 1, 0, 3);
+  CHECK_REGEX("^bar", OWL_REGEX_KIND_PREFIX, "ba", 0, 0, 0);
+  CHECK_REGEX("owl$", OWL_REGEX_KIND_SUFFIX, "barnOWL", 1, 4, 7);
+  CHECK_REGEX("owl$", OWL_REGEX_KIND_SUFFIX, "owls", 0, 0, 0);
+  CHECK_REGEX("nOw", OWL_REGEX_KIND_SUBSTRING, "barnowl", 1, 3, 6);
+  CHECK_REGEX("nOw", OWL_REGEX_KIND_SUBSTRING, "barn owl", 0, 0, 0);
+  CHECK_REGEX("a\\.b", OWL_REGEX_KIND_SUBSTRING, "xa.b", 1, 1, 4);
+  CHECK_REGEX("a\\.b", OWL_REGEX_KIND_SUBSTRING, "xaxb", 0, 0, 0);
+  CHECK_REGEX("", OWL_REGEX_KIND_SUBSTRING, "anything", 1, 0, 0);
+  CHECK_REGEX("a.b", OWL_REGEX_KIND_REGEX, "xaxb", 1, 1, 4);
+  CHECK_REGEX("\\bowl", OWL_REGEX_KIND_REGEX, "barn owl", 1, 5, 8);
+  CHECK_REGEX("caf\xc3\xa9", OWL_REGEX_KIND_REGEX, "caf\xc3\xa9", 1, 0, 5);
+
+#undef CHECK_REGEX
+
+  owl_regex_init(&re);
+  owl_regex_create(&re, "!^barnowl$");
+  FAIL_UNLESS("negated literal", re.negate && re.kind == OWL_REGEX_KIND_EXACT);
+  FAIL_UNLESS("negated literal matches others", owl_regex_compare(&re, "owl", NULL, NULL) == 0);
+  FAIL_UNLESS("negated literal rejects literal", owl_regex_compare(&re, "BARNOWL", NULL, NULL) != 0);
+  owl_regex_cleanup(&re);
+
+  owl_regex_init(&re);
+  owl_regex_create_quoted(&re, "1+1=2?");
+  FAIL_UNLESS("quoted is literal", re.kind == OWL_REGEX_KIND_SUBSTRING);
+  FAIL_UNLESS("quoted matches", owl_regex_compare(&re, "is 1+1=2?", &start, &end) == 0 &&
+              start == 3 && end == 9);
+  owl_regex_cleanup(&re);
+
+  printf("# END testing owl_regex (%d failures)\n", numfailed);
+  return numfailed;
+}
+
+/* Redefines a sub of the default style, so this runs last. */
+int owl_nativestyle_override_regtest(void) {
+  int numfailed = 0;
+  owl_message m;
+  owl_style *s;
+  owl_fmtext fm;
+
+  printf("# BEGIN testing owl_nativestyle overrides\n");
+
+  owl_message_create_admin(&m, "header", "body");
+  s = (owl_style *)owl_global_get_style_by_name(&g, "default");
+
+  owl_fmtext_init_null(&fm);
+  FAIL_UNLESS("stock style formats in C",
+              s && owl_style_get_native_formattext(s, &fm, &m));
+  owl_fmtext_cleanup(&fm);
+
+  eval_pv("no warnings 'redefine';"
+          "sub BarnOwl::Style::Default::format_admin { 'overridden' }", true);
+
+  owl_fmtext_init_null(&fm);
+  FAIL_UNLESS("overridden style does not format in C",
+              s && !owl_style_get_native_formattext(s, &fm, &m));
+  owl_fmtext_cleanup(&fm);
+
+  owl_fmtext_init_null(&fm);
+  if (s)
+    owl_style_get_formattext(s, &fm, &m);
+  FAIL_UNLESS("overridden sub is used",
+              strstr(owl_fmtext_get_text(&fm), "overridden") != NULL);
+  owl_fmtext_cleanup(&fm);
+
+  owl_message_cleanup(&m);
+
+  printf("# END testing owl_nativestyle overrides (%d failures)\n", numfailed);
+  return numfailed;
+}
@@ -93,6 +93,23 @@ static owl_variable variables_to_init[] = {
   OWLVAR_BOOL( "loginsubs" /* %OwlVarStub */, 1,
 	       "load logins from .anyone on startup", "" ),
 
+  OWLVAR_INT(    "loghistorydays" /* %OwlVarStub */, 0,
+		 "days of logged messages to load at startup",
+		 "At startup, messages logged in this many days before\n"
+		 "are read back from the 'all' file in 'logpath' and\n"
+		 "from the class logs in 'classlogpath', newest first,\n"
+		 "and put before any new messages.  At most 20000 are\n"
+		 "loaded.  If this is 0, none are.  This must be set\n"
+		 "in the startup file to take effect.\n"),
+
+  OWLVAR_BOOL( "logstore" /* %OwlVarStub */, 0,
+	       "also keep logged messages in a searchable store",
+	       "If this is set to on, messages that are logged are\n"
+	       "also added to a store in the directory specified by\n"
+	       "the 'logstorepath' variable, which is indexed by time,\n"
+	       "sender, class, instance and the words of the message,\n"
+	       "so that the 'logsearch' command can find them quickly.\n"),
+
   OWLVAR_BOOL( "logging" /* %OwlVarStub */, 0,
 	       "turn personal logging on or off", 
 	       "If this is set to on, personal messages are\n"
@@ -117,6 +134,27 @@ static owl_variable variables_to_init[] = {
 	       "logged.",
 	       "both,in,out"),
 
+  OWLVAR_ENUM( "loggingfsync" /* %OwlVarStub */, OWL_LOGGING_FSYNC_NEVER,
+	       "when to sync log files to disk",
+	       "Log entries are written in batches, to log files which\n"
+	       "are kept open.  If this is 'never', the system decides\n"
+	       "when they reach the disk.  If 'flush', each log file\n"
+	       "is synced after every batch written to it.  If 'close',\n"
+	       "log files are synced when they are closed, which\n"
+	       "happens when too many are open and when BarnOwl exits.",
+	       "never,flush,close"),
+
+  OWLVAR_ENUM( "loggingoverflow" /* %OwlVarStub */, OWL_LOGGING_OVERFLOW_SPILL,
+	       "what to do when log writes fall behind",
+	       "Messages wait in a queue of limited size to be logged.\n"
+	       "If the disk is slow enough for the queue to fill, then\n"
+	       "'block' waits for room, freezing BarnOwl meanwhile,\n"
+	       "'drop-oldest' discards the oldest waiting entry, and\n"
+	       "'spill' keeps further entries in a temporary file until\n"
+	       "the queue has emptied.  'show logging' shows how the\n"
+	       "queue is doing.",
+	       "block,drop-oldest,spill"),
+
   OWLVAR_BOOL( "colorztext" /* %OwlVarStub */, 1,
 	       "allow @color() in zephyrs to change color",
 	       "Note that only messages received after this variable\n"
@@ -183,6 +221,11 @@ static owl_variable variables_to_init[] = {
 	       "Specifies a directory which must exist.\n"
 	       "Files will be created in the directory for each class.\n"),
 
+  OWLVAR_PATH( "logstorepath" /* %OwlVarStub */, "~/zlog/store",
+	       "path for the searchable message store",
+	       "Specifies a directory which must exist.\n"
+	       "See the 'logstore' variable.\n"),
+
   OWLVAR_PATH( "debug_file" /* %OwlVarStub */, OWL_DEBUG_FILE,
 	       "path for logging debug messages when debugging is enabled",
 	       "This file will be logged to if 'debug' is set to 'on'.\n"
@@ -276,6 +319,10 @@ static owl_variable variables_to_init[] = {
 		 "   default  - the default owl formatting\n"
 		 "   oneline  - one line per-message\n"
 		 "   perl     - legacy perl interface\n"
+		 "\nThe default and oneline styles format the built-in message\n"
+		 "types in C.  Redefining a sub of BarnOwl::Style::Default,\n"
+		 "BarnOwl::Style::OneLine or the BarnOwl::Message classes hands\n"
+		 "formatting back to perl; BarnOwl::Style::boldify is not checked.\n"
 		 "\nSEE ALSO: style, show styles, view -s <style>\n"
 		 ),
 
@@ -315,6 +362,34 @@ static owl_variable variables_to_init[] = {
 		   NULL /* use default for get */
 		   ),
 
+  OWLVAR_INT_FULL( "fmtext_cache_bytes" /* %OwlVarStub */,
+		   OWL_FMTEXT_CACHE_BYTES,
+		   "memory to spend on formatted messages",
+		   "Formatted messages are kept in memory so that they\n"
+		   "need not be run through the style again when redrawn.\n"
+		   "This is the number of bytes to keep; the least\n"
+		   "recently displayed messages are dropped first.\n"
+		   "Messages on screen are always kept.\n",
+		   "int >= 0",
+		   owl_variable_int_validate_positive,
+		   NULL /* use default for set */,
+		   NULL /* use default for get */
+		   ),
+
+  OWLVAR_INT_FULL( "redrawinterval" /* %OwlVarStub */,
+		   OWL_REDRAW_INTERVAL,
+		   "minimum milliseconds between screen updates",
+		   "When the screen changes faster than this, for instance\n"
+		   "while many messages arrive, the changes are collected\n"
+		   "and drawn together at most once per this many\n"
+		   "milliseconds.  Typing is always echoed at once.  If this\n"
+		   "is 0, every change is drawn as soon as possible.\n",
+		   "int >= 0",
+		   owl_variable_int_validate_positive,
+		   NULL /* use default for set */,
+		   NULL /* use default for get */
+		   ),
+
   OWLVAR_INT( "typewindelta" /* %OwlVarStub */, 0,
 		  "number of lines to add to the typing window when in use",
 		   "On small screens you may want the typing window to\n"
@@ -23,15 +23,34 @@ void owl_view_consider_message(owl_view *v, owl_message *m)
   }
 }
 
+/* Add those of the 'n' messages of 'msgs', in order of id, that match
+ * the filter, where their ids belong; they must all belong at the same
+ * place, which is put in *at.  Returns how many were added. */
+int owl_view_consider_messages(owl_view *v, owl_message *const *msgs, int n, int *at)
+{
+  owl_message **matches;
+  int i, count = 0;
+
+  matches = g_new(owl_message *, n);
+  for (i = 0; i < n; i++)
+    if (owl_filter_message_match(v->filter, msgs[i]))
+      matches[count++] = msgs[i];
+  *at = owl_messagelist_insert_elements(&(v->ml), matches, count);
+  g_free(matches);
+  return count;
+}
+
 /* remove all messages, add all the global messages that match the
- * filter.
+ * filter.  Only messages the filter's index lookups leave as
+ * candidates are evaluated, and long lists are evaluated in parallel.
  */
 void owl_view_recalculate(owl_view *v)
 {
-  int i, j;
+  int i, j, exact;
   const owl_messagelist *gml;
   owl_messagelist *ml;
   owl_message *m;
+  unsigned long *candidates;
 
   gml=owl_global_get_msglist(&g);
   ml=&(v->ml);
@@ -42,12 +61,15 @@ void owl_view_recalculate(owl_view *v)
 
   /* find all the messages we want */
   j=owl_messagelist_get_size(gml);
+  candidates=owl_filter_candidates(v->filter, gml, &exact);
+  if (!exact)
+    owl_filter_refine_candidates(v->filter, gml, candidates);
   for (i=0; i<j; i++) {
+    if (!OWL_MSGSET_HAS(candidates, i)) continue;
     m=owl_messagelist_get_element(gml, i);
-    if (owl_filter_message_match(v->filter, m)) {
-      owl_messagelist_append_element(ml, m);
-    }
+    owl_messagelist_append_element(ml, m);
   }
+  g_free(candidates);
 }
 
 void owl_view_new_filter(owl_view *v, owl_filter *f)
@@ -526,21 +526,79 @@ void owl_window_resize(owl_window *w, int nlines, int ncols)
 
 /** Redrawing main loop hooks **/
 
+/* Frames are drawn at most once every 'redrawinterval' milliseconds,
+ * unless one is wanted urgently */
+static GTimeVal redraw_last;     /* when the last frame started */
+static int redraw_urgent;
+static int redraw_deferred;      /* the next frame has been held back */
+
+static struct {
+  unsigned long frames;
+  unsigned long urgent;          /* drawn early for input */
+  unsigned long deferred;        /* held back by redrawinterval */
+  double total, max;             /* seconds spent drawing */
+} redraw_stats;
+
+/* Let the next frame be drawn as soon as anything is dirty, however
+ * recently the last one was, so that typing is echoed at once */
+void owl_window_redraw_urgently(void)
+{
+  redraw_urgent = 1;
+}
+
 static bool _owl_window_should_redraw(void) {
   return g.resizepending || owl_window_get_screen()->dirty_subtree;
 }
 
+/* Return how many milliseconds to wait before the next frame */
+static int _owl_window_redraw_wait(GSource *source) {
+  GTimeVal now;
+  long elapsed;
+  int interval = owl_global_get_redrawinterval(&g);
+
+  if (redraw_urgent || g.resizepending || interval <= 0)
+    return 0;
+  g_source_get_current_time(source, &now);
+  elapsed = (now.tv_sec - redraw_last.tv_sec) * 1000 +
+    (now.tv_usec - redraw_last.tv_usec) / 1000;
+  /* a clock that went backwards does not hold up drawing */
+  if (elapsed < 0 || elapsed >= interval)
+    return 0;
+  return interval - elapsed;
+}
+
 static gboolean _owl_window_redraw_prepare(GSource *source, int *timeout) {
+  int wait;
+
   *timeout = -1;
-  return _owl_window_should_redraw();
+  if (!_owl_window_should_redraw())
+    return FALSE;
+  wait = _owl_window_redraw_wait(source);
+  if (wait > 0) {
+    redraw_deferred = 1;
+    *timeout = wait;
+    return FALSE;
+  }
+  return TRUE;
 }
 
 static gboolean _owl_window_redraw_check(GSource *source) {
-  return _owl_window_should_redraw();
+  return _owl_window_should_redraw() && _owl_window_redraw_wait(source) == 0;
 }
 
 static gboolean _owl_window_redraw_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
   owl_colorpair_mgr *cpmgr;
+  GTimeVal done;
+  double elapsed;
+
+  g_get_current_time(&redraw_last);
+  redraw_stats.frames++;
+  if (redraw_urgent)
+    redraw_stats.urgent++;
+  if (redraw_deferred)
+    redraw_stats.deferred++;
+  redraw_urgent = 0;
+  redraw_deferred = 0;
 
   /* if a resize has been scheduled, deal with it */
   owl_global_check_resize(&g);
@@ -558,9 +616,29 @@ static gboolean _owl_window_redraw_dispatch(GSource *source, GSourceFunc callbac
     owl_function_full_redisplay();
     owl_window_redraw_scheduled();
   }
+
+  g_get_current_time(&done);
+  elapsed = (done.tv_sec - redraw_last.tv_sec) +
+    (done.tv_usec - redraw_last.tv_usec) / 1e6;
+  redraw_stats.total += elapsed;
+  if (elapsed > redraw_stats.max)
+    redraw_stats.max = elapsed;
   return TRUE;
 }
 
+/* Append statistics on screen updates to 'fm' */
+void owl_window_redraw_stats_tofmtext(owl_fmtext *fm)
+{
+  owl_fmtext_appendf_normal(fm, "  Frames   : %lu\n", redraw_stats.frames);
+  owl_fmtext_appendf_normal(fm, "  Urgent   : %lu\n", redraw_stats.urgent);
+  owl_fmtext_appendf_normal(fm, "  Deferred : %lu (interval %d ms)\n",
+                            redraw_stats.deferred, owl_global_get_redrawinterval(&g));
+  owl_fmtext_appendf_normal(fm, "  Drawing  : %.3f s total, %.2f ms mean, %.2f ms max\n",
+                            redraw_stats.total,
+                            redraw_stats.frames ? redraw_stats.total * 1000 / redraw_stats.frames : 0.0,
+                            redraw_stats.max * 1000);
+}
+
 static GSourceFuncs redraw_funcs = {
   _owl_window_redraw_prepare,
   _owl_window_redraw_check,
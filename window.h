@@ -72,6 +72,9 @@ void owl_window_move(owl_window *w, int begin_y, int begin_x);
 void owl_window_resize(owl_window *w, int nlines, int ncols);
 
 GSource *owl_window_redraw_source_new(void);
+void owl_window_redraw_urgently(void);
+struct _owl_fmtext;
+void owl_window_redraw_stats_tofmtext(struct _owl_fmtext *fm);
 
 /* Standard callback functions in windowcb.c */
 
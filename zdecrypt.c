@@ -0,0 +1,451 @@
+/* Decrypt incoming zcrypt messages inside barnowl, rather than by
+ * running the zcrypt binary once per message.  This follows the -D
+ * path of zcrypt.c: the key file for a class and instance comes from
+ * ~/.crypt-table, DES messages are decrypted here and AES messages
+ * are handed to gpg.
+ *
+ * Decryption runs on a thread of its own, which alone owns the parsed
+ * crypt-table and the cache of key schedules.  Incoming zephyrs wait
+ * in order behind any message still being decrypted, so they reach
+ * the message queue in the order they arrived.
+ */
+
+#include "owl.h"
+#include <string.h>
+#include <sys/stat.h>
+#include "filterproc.h"
+
+#ifdef OWL_ENABLE_ZCRYPT
+#ifdef HAVE_KERBEROS_IV
+#include <kerberosIV/des.h>
+#else
+#include <openssl/des.h>
+#endif
+#endif
+
+#define OWL_ZDECRYPT_CIPHER_DES  0
+#define OWL_ZDECRYPT_CIPHER_AES  1
+
+#define OWL_ZDECRYPT_MAX_KEY     128
+#define OWL_ZDECRYPT_MAX_BUFF    258
+#define OWL_ZDECRYPT_BASE_CODE   70
+#define OWL_ZDECRYPT_LAST_CODE   (OWL_ZDECRYPT_BASE_CODE + 15)
+
+/* What we know about the key for one class and instance */
+typedef struct _owl_zdecrypt_key { /* noproto */
+  int cipher;
+  char *keyfile;        /* NULL if the crypt-table names none */
+#ifdef OWL_ENABLE_ZCRYPT
+  time_t mtime;         /* of the key file when 'schedule' was built */
+  int scheduled;
+  des_key_schedule schedule;
+#endif
+} owl_zdecrypt_key;
+
+/* A message waiting to reach the message queue */
+typedef struct _owl_zdecrypt_job { /* noproto */
+  owl_message *m;
+  int done;
+  /* Copies for the decryption thread, which never sees 'm' */
+  char *class;
+  char *instance;
+  char *body;
+  char *out;            /* the decrypted body, or NULL */
+} owl_zdecrypt_job;
+
+static GMainContext *zdecrypt_context;
+static GMainLoop *zdecrypt_loop;
+static GThread *zdecrypt_thread;
+
+/* Belongs to the main thread */
+static GQueue *owl_zdecrypt_held;
+
+/* Belong to the decryption thread once it has started */
+static GPtrArray *owl_zdecrypt_table;  /* lines of ~/.crypt-table */
+static time_t owl_zdecrypt_table_mtime;
+static off_t owl_zdecrypt_table_size;
+static GHashTable *owl_zdecrypt_keys;  /* "class\ninstance" -> owl_zdecrypt_key */
+
+static void owl_zdecrypt_key_delete(gpointer data)
+{
+  owl_zdecrypt_key *k = data;
+
+  g_free(k->keyfile);
+  g_free(k);
+}
+
+/* Reread ~/.crypt-table if it has changed since we last read it.  Any
+ * change forgets every key, since each may now come from a different
+ * file.
+ */
+static void owl_zdecrypt_load_table(void)
+{
+  char *filename;
+  char buffer[OWL_ZDECRYPT_MAX_BUFF];
+  struct stat st;
+  FILE *file;
+
+  if (!owl_zdecrypt_keys)
+    owl_zdecrypt_keys = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, owl_zdecrypt_key_delete);
+
+  filename = g_strdup_printf("%s/.crypt-table", getenv("HOME"));
+  if (stat(filename, &st) != 0) {
+    st.st_mtime = 0;
+    st.st_size = 0;
+  }
+  if (owl_zdecrypt_table &&
+      st.st_mtime == owl_zdecrypt_table_mtime &&
+      st.st_size == owl_zdecrypt_table_size) {
+    g_free(filename);
+    return;
+  }
+
+  if (owl_zdecrypt_table)
+    g_ptr_array_free(owl_zdecrypt_table, TRUE);
+  owl_zdecrypt_table = g_ptr_array_new();
+  owl_zdecrypt_table_mtime = st.st_mtime;
+  owl_zdecrypt_table_size = st.st_size;
+  g_hash_table_remove_all(owl_zdecrypt_keys);
+
+  file = fopen(filename, "r");
+  if (file) {
+    while (fgets(buffer, OWL_ZDECRYPT_MAX_BUFF - 3, file))
+      g_ptr_array_add(owl_zdecrypt_table, g_strdup(buffer));
+    fclose(file);
+  }
+  g_free(filename);
+}
+
+/* As GetZephyrVarKeyFile in zcrypt.c, over the table in memory */
+static char *owl_zdecrypt_find_keyfile(const char *class, const char *instance)
+{
+  char *varname[3], *result[3], *keyfile = NULL;
+  const char *line;
+  int i, j, n;
+  size_t len;
+  guint l;
+
+  varname[0] = g_strdup_printf("crypt-%s-%s:", class, instance);
+  varname[1] = g_strdup_printf("crypt-%s:", class);
+  varname[2] = g_strdup("crypt-default:");
+
+  for (i = 0; i < 3; i++) {
+    result[i] = NULL;
+    n = strlen(varname[i]);
+    /* the last matching line wins */
+    for (l = 0; l < owl_zdecrypt_table->len; l++) {
+      line = g_ptr_array_index(owl_zdecrypt_table, l);
+      if (strncasecmp(varname[i], line, n) == 0) {
+        for (j = n; line[j] == ' '; j++)
+          ;
+        g_free(result[i]);
+        result[i] = g_strdup(line + j);
+        len = strlen(result[i]);
+        if (len && result[i][len - 1] == '\n')
+          result[i][len - 1] = '\0';
+      }
+    }
+  }
+
+  for (i = 0; i < 3; i++) {
+    if (!keyfile && result[i] && *result[i])
+      keyfile = g_strdup(result[i]);
+    g_free(result[i]);
+    g_free(varname[i]);
+  }
+  return keyfile;
+}
+
+/* As ParseCryptSpec in zcrypt.c */
+static int owl_zdecrypt_parse_spec(const char *spec, char **keyfile)
+{
+  int cipher = OWL_ZDECRYPT_CIPHER_DES;
+  const char *colon = strchr(spec, ':');
+  const char *rest;
+  char *name;
+
+  *keyfile = g_strdup(spec);
+  if (!colon) return cipher;
+
+  name = g_strndup(spec, colon - spec);
+  g_strchomp(name);
+  rest = colon + 1;
+  while (g_ascii_isspace(*rest)) rest++;
+
+  if (strcmp(name, "AES") == 0) {
+    cipher = OWL_ZDECRYPT_CIPHER_AES;
+    g_free(*keyfile);
+    *keyfile = g_strdup(rest);
+  } else if (strcmp(name, "DES") == 0) {
+    g_free(*keyfile);
+    *keyfile = g_strdup(rest);
+  }
+  g_free(name);
+  return cipher;
+}
+
+static owl_zdecrypt_key *owl_zdecrypt_get_key(const char *class, const char *instance)
+{
+  owl_zdecrypt_key *k;
+  char *id, *spec;
+
+  owl_zdecrypt_load_table();
+
+  spec = g_strdup_printf("%s\n%s", class, instance);
+  id = g_ascii_strdown(spec, -1);
+  g_free(spec);
+  k = g_hash_table_lookup(owl_zdecrypt_keys, id);
+  if (k) {
+    g_free(id);
+    return k;
+  }
+
+  k = g_new0(owl_zdecrypt_key, 1);
+  spec = owl_zdecrypt_find_keyfile(class, instance);
+  if (spec) {
+    k->cipher = owl_zdecrypt_parse_spec(spec, &k->keyfile);
+    g_free(spec);
+  }
+  g_hash_table_insert(owl_zdecrypt_keys, id, k);
+  return k;
+}
+
+#ifdef OWL_ENABLE_ZCRYPT
+/* Make sure k->schedule matches the current contents of its key file */
+static int owl_zdecrypt_schedule(owl_zdecrypt_key *k)
+{
+  char keystring[OWL_ZDECRYPT_MAX_KEY];
+  struct stat st;
+  FILE *fkey;
+#ifdef HAVE_KERBEROS_IV
+  des_cblock key;
+#else
+  des_cblock _key, *key = &_key;
+#endif
+
+  if (stat(k->keyfile, &st) != 0)
+    return 0;
+  if (k->scheduled && st.st_mtime == k->mtime)
+    return 1;
+
+  fkey = fopen(k->keyfile, "r");
+  if (!fkey)
+    return 0;
+  /* Like zcrypt, keep the newline as part of the key string */
+  if (!fgets(keystring, OWL_ZDECRYPT_MAX_KEY - 1, fkey)) {
+    fclose(fkey);
+    return 0;
+  }
+  fclose(fkey);
+
+  des_string_to_key(keystring, key);
+  des_key_sched(key, k->schedule);
+  k->mtime = st.st_mtime;
+  k->scheduled = 1;
+  return 1;
+}
+
+/* Return the next byte encoded in 'in', skipping characters outside
+ * the encoding, or -1 at the end. */
+static int owl_zdecrypt_next_byte(const char **in)
+{
+  int i, c = 0;
+
+  for (i = 0; i < 2; i++) {
+    while (**in && (**in < OWL_ZDECRYPT_BASE_CODE || **in > OWL_ZDECRYPT_LAST_CODE))
+      (*in)++;
+    if (!**in) return -1;
+    c = c * 0x10 + (*(*in)++ - OWL_ZDECRYPT_BASE_CODE);
+  }
+  return c;
+}
+
+/* As do_decrypt_des in zcrypt.c */
+static char *owl_zdecrypt_des(owl_zdecrypt_key *k, const char *in)
+{
+  unsigned char input[8], output[8];
+  char tmp[9];
+  GString *out;
+  int i, c;
+
+  if (!owl_zdecrypt_schedule(k))
+    return NULL;
+
+  memset(tmp, 0, sizeof tmp);
+  out = g_string_new("");
+  while (1) {
+    for (i = 0; i < 8; i++) {
+      if ((c = owl_zdecrypt_next_byte(&in)) < 0) break;
+      input[i] = c;
+    }
+    if (i < 8) break;
+    des_ecb_encrypt(&input, &output, k->schedule, FALSE);
+    memcpy(tmp, output, 8);
+    g_string_append(out, tmp);
+  }
+
+  if (!tmp[0] || tmp[strlen(tmp) - 1] != '\n')
+    g_string_append_c(out, '\n');
+  return g_string_free(out, FALSE);
+}
+#endif /* OWL_ENABLE_ZCRYPT */
+
+/* As do_decrypt_aes in zcrypt.c */
+static char *owl_zdecrypt_aes(owl_zdecrypt_key *k, const char *in)
+{
+  const char *argv[] = {
+    "gpg",
+    "--decrypt",
+    "--batch",
+    "--no-use-agent",
+    "--quiet",
+    "--passphrase-file", k->keyfile,
+    NULL
+  };
+  char *out;
+  int err, status;
+
+  err = call_filter("gpg", argv, in, &out, &status);
+  if (err || status) {
+    g_free(out);
+    return NULL;
+  }
+  return out;
+}
+
+/* Return the decrypted body of a message, or NULL if we cannot decrypt
+ * it.  Runs on the decryption thread. */
+static char *owl_zdecrypt_decrypt(const char *class, const char *instance, const char *body)
+{
+  owl_zdecrypt_key *k;
+
+  k = owl_zdecrypt_get_key(class, instance);
+  if (!k->keyfile)
+    return NULL;
+  if (k->cipher == OWL_ZDECRYPT_CIPHER_AES)
+    return owl_zdecrypt_aes(k, body);
+#ifdef OWL_ENABLE_ZCRYPT
+  return owl_zdecrypt_des(k, body);
+#else
+  return NULL;
+#endif
+}
+
+/* Pass on, in order, every held message that is ready */
+static void owl_zdecrypt_release(void)
+{
+  owl_zdecrypt_job *job;
+
+  while (!g_queue_is_empty(owl_zdecrypt_held)) {
+    job = g_queue_peek_head(owl_zdecrypt_held);
+    if (!job->done) break;
+    g_queue_pop_head(owl_zdecrypt_held);
+    if (job->out)
+      owl_message_set_body(job->m, job->out);
+    owl_global_messagequeue_addmsg(&g, job->m);
+    g_free(job->class);
+    g_free(job->instance);
+    g_free(job->body);
+    g_free(job->out);
+    g_free(job);
+  }
+}
+
+/* Runs on the main thread once a job is decrypted */
+static void owl_zdecrypt_done(void *data)
+{
+  owl_zdecrypt_job *job = data;
+
+  job->done = 1;
+  owl_zdecrypt_release();
+}
+
+/* Runs on the decryption thread */
+static void owl_zdecrypt_run(void *data)
+{
+  owl_zdecrypt_job *job = data;
+
+  job->out = owl_zdecrypt_decrypt(job->class, job->instance, job->body);
+  owl_select_post_task(owl_zdecrypt_done, job, NULL, NULL);
+}
+
+/* Add the incoming zephyr 'm' to the message queue, first decrypting
+ * its body if it is zcrypted and zcrypt is enabled.  Messages reach
+ * the queue in the order they are passed here.
+ */
+void owl_zdecrypt_queue_message(owl_message *m)
+{
+  owl_zdecrypt_job *job;
+  int crypted;
+
+  crypted = owl_global_is_zcrypt(&g) &&
+    !strcasecmp(owl_message_get_opcode(m), "crypt");
+
+  if (!crypted && (!owl_zdecrypt_held || g_queue_is_empty(owl_zdecrypt_held))) {
+    owl_global_messagequeue_addmsg(&g, m);
+    return;
+  }
+
+  if (!owl_zdecrypt_held)
+    owl_zdecrypt_held = g_queue_new();
+
+  job = g_new0(owl_zdecrypt_job, 1);
+  job->m = m;
+  g_queue_push_tail(owl_zdecrypt_held, job);
+
+  if (!crypted) {
+    job->done = 1;
+    return;
+  }
+
+  job->class = g_strdup(owl_message_get_class(m));
+  job->instance = g_strdup(owl_message_get_instance(m));
+  job->body = g_strdup(owl_message_get_body(m));
+  if (zdecrypt_context) {
+    owl_select_post_task(owl_zdecrypt_run, job, NULL, zdecrypt_context);
+  } else {
+    job->out = owl_zdecrypt_decrypt(job->class, job->instance, job->body);
+    job->done = 1;
+    owl_zdecrypt_release();
+  }
+}
+
+static gpointer owl_zdecrypt_thread_func(gpointer data)
+{
+  g_main_loop_run(zdecrypt_loop);
+  return NULL;
+}
+
+void owl_zdecrypt_init(void)
+{
+  GError *error = NULL;
+
+  zdecrypt_context = g_main_context_new();
+  zdecrypt_loop = g_main_loop_new(zdecrypt_context, FALSE);
+  zdecrypt_thread = g_thread_create(owl_zdecrypt_thread_func,
+                                    NULL,
+                                    TRUE,
+                                    &error);
+  if (error) {
+    owl_function_error("Error spawning zcrypt thread: %s", error->message);
+    g_error_free(error);
+    g_main_loop_unref(zdecrypt_loop);
+    g_main_context_unref(zdecrypt_context);
+    zdecrypt_loop = NULL;
+    zdecrypt_context = NULL;
+  }
+}
+
+static void owl_zdecrypt_quit_func(gpointer data)
+{
+  g_main_loop_quit(zdecrypt_loop);
+}
+
+void owl_zdecrypt_shutdown(void)
+{
+  if (!zdecrypt_context) return;
+  owl_select_post_task(owl_zdecrypt_quit_func, NULL,
+                       NULL, zdecrypt_context);
+  g_thread_join(zdecrypt_thread);
+}
@@ -614,6 +614,12 @@ int owl_zephyr_get_num_fields(const void *n)
 #endif
 
 #ifdef HAVE_LIBZEPHYR
+/* Whether 'n' is from MIT Moira, whose body names the host it came from */
+int owl_zephyr_is_moira(const ZNotice_t *n)
+{
+  return !strcasecmp(n->z_default_format, "MOIRA $instance on $fromhost:\n $message\n");
+}
+
 /* return a pointer to the message, place the message length in k
  * caller must free the return
  */
@@ -645,7 +651,7 @@ char *owl_zephyr_get_message(const ZNotice_t *n, const owl_message *m)
                           fields[1], fields[2], fields[3], fields[5], fields[4]);
   }
   /* deal with MIT Moira messages */
-  else if (!strcasecmp(n->z_default_format, "MOIRA $instance on $fromhost:\n $message\n")) {
+  else if (owl_zephyr_is_moira(n)) {
     msg = g_strdup_printf("MOIRA %s on %s: %s",
                           n->z_class_inst,
                           owl_message_get_hostname(m),
@@ -1442,58 +1448,71 @@ void owl_zephyr_buddycheck_timer(owl_timer *t, void *data)
 }
 
 /*
- * Process zephyrgrams from libzephyr's queue. To prevent starvation,
- * process a maximum of OWL_MAX_ZEPHYRGRAMS_TO_PROCESS.
+ * Process zephyrgrams from libzephyr's queue.  To prevent starvation,
+ * stop once the time budget is spent.  The budget grows while a
+ * backlog remains at the end of a pass and shrinks while passes drain
+ * the queue early, between OWL_ZRECEIVE_MIN_BUDGET and
+ * OWL_ZRECEIVE_MAX_BUDGET microseconds.
  *
  * Returns the number of zephyrgrams processed.
  */
 
-#define OWL_MAX_ZEPHYRGRAMS_TO_PROCESS 20
-
 #ifdef HAVE_LIBZEPHYR
+static long owl_zephyr_budget = OWL_ZRECEIVE_MIN_BUDGET;
+
 static int _owl_zephyr_process_events(void)
 {
   int zpendcount=0;
   ZNotice_t notice;
   Code_t code;
-  owl_message *m=NULL;
-
-  while(owl_zephyr_zpending() && zpendcount < OWL_MAX_ZEPHYRGRAMS_TO_PROCESS) {
-    if (owl_zephyr_zpending()) {
-      if ((code = ZReceiveNotice(&notice, NULL)) != ZERR_NONE) {
-        owl_function_debugmsg("Error: %s while calling ZReceiveNotice\n",
-                              error_message(code));
-        continue;
-      }
-      zpendcount++;
-
-      /* is this an ack from a zephyr we sent? */
-      if (owl_zephyr_notice_is_ack(&notice)) {
-        owl_zephyr_handle_ack(&notice);
-        ZFreeNotice(&notice);
-        continue;
-      }
-
-      /* if it's a ping and we're not viewing pings then skip it */
-      if (!owl_global_is_rxping(&g) && !strcasecmp(notice.z_opcode, "ping")) {
-        ZFreeNotice(&notice);
-        continue;
-      }
+  GTimeVal start, now;
+  long elapsed;
+
+  g_get_current_time(&start);
+  while(owl_zephyr_zpending() && owl_zreceive_has_room()) {
+    if (zpendcount > 0) {
+      g_get_current_time(&now);
+      elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+      if (elapsed < 0 || elapsed >= owl_zephyr_budget)
+        break;
+    }
+    if ((code = ZReceiveNotice(&notice, NULL)) != ZERR_NONE) {
+      owl_function_debugmsg("Error: %s while calling ZReceiveNotice\n",
+                            error_message(code));
+      continue;
+    }
+    zpendcount++;
 
-      /* if it is a LOCATE message, it's for pseudologins. */
-      if (strcmp(notice.z_opcode, LOCATE_LOCATE) == 0) {
-        owl_zephyr_process_pseudologin(&notice);
-        ZFreeNotice(&notice);
-        continue;
-      }
+    /* is this an ack from a zephyr we sent? */
+    if (owl_zephyr_notice_is_ack(&notice)) {
+      owl_zephyr_handle_ack(&notice);
+      ZFreeNotice(&notice);
+      continue;
+    }
 
-      /* create the new message */
-      m=g_new(owl_message, 1);
-      owl_message_create_from_znotice(m, &notice);
+    /* if it's a ping and we're not viewing pings then skip it */
+    if (!owl_global_is_rxping(&g) && !strcasecmp(notice.z_opcode, "ping")) {
+      ZFreeNotice(&notice);
+      continue;
+    }
 
-      owl_global_messagequeue_addmsg(&g, m);
+    /* if it is a LOCATE message, it's for pseudologins. */
+    if (strcmp(notice.z_opcode, LOCATE_LOCATE) == 0) {
+      owl_zephyr_process_pseudologin(&notice);
+      ZFreeNotice(&notice);
+      continue;
     }
+
+    /* the rest of the work happens off the main thread */
+    owl_zreceive_queue_notice(&notice);
   }
+
+  g_get_current_time(&now);
+  elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+  if (owl_zephyr_zpending() && owl_zreceive_has_room())
+    owl_zephyr_budget = MIN(owl_zephyr_budget * 2, OWL_ZRECEIVE_MAX_BUDGET);
+  else if (elapsed < owl_zephyr_budget / 2)
+    owl_zephyr_budget = MAX(owl_zephyr_budget / 2, OWL_ZRECEIVE_MIN_BUDGET);
   return zpendcount;
 }
 
@@ -1516,14 +1535,22 @@ static GSource *owl_zephyr_event_source_new(int fd) {
 }
 
 static gboolean owl_zephyr_event_prepare(GSource *source, int *timeout) {
+  owl_zephyr_event_source *event_source = (owl_zephyr_event_source*)source;
   *timeout = -1;
+  /* With nowhere to put them, leave zephyrs unread until the zephyr
+   * thread hands back messages, which wakes us */
+  if (!owl_zreceive_has_room()) {
+    event_source->poll_fd.events = 0;
+    return FALSE;
+  }
+  event_source->poll_fd.events = G_IO_IN | G_IO_HUP | G_IO_PRI | G_IO_ERR;
   return owl_zephyr_zqlength() > 0;
 }
 
 static gboolean owl_zephyr_event_check(GSource *source) {
   owl_zephyr_event_source *event_source = (owl_zephyr_event_source*)source;
   if (event_source->poll_fd.revents & event_source->poll_fd.events)
-    return owl_zephyr_zpending() > 0;
+    return owl_zephyr_zpending() > 0 && owl_zreceive_has_room();
   return FALSE;
 }
 
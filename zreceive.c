@@ -0,0 +1,220 @@
+/* Make incoming zephyrs into messages off the main thread.
+ *
+ * libzephyr is not thread-safe, and sending a zephyr or subscribing
+ * waits on the same queue notices arrive on, so zephyrs are still
+ * received, and acks, pings and locate notices still handled, on the
+ * main thread.  Everything else is passed through a ring to a thread
+ * that parses each notice into an owl_message, and back through a
+ * second ring to the main thread, which finishes the message, giving
+ * it its id and asking the resolver for its host, and queues it.  The
+ * builder does not call into libzephyr at all; even our realm is read
+ * on the main thread and passed along with each notice.
+ *
+ * Each ring has one producer and one consumer and takes no locks.  A
+ * side posts a task to wake the other only when no wakeup is already
+ * pending, and clears that flag before looking for more work, so none
+ * is missed.
+ */
+
+#include "owl.h"
+#include <string.h>
+
+#ifdef HAVE_LIBZEPHYR
+
+typedef struct _owl_zreceive_ring { /* noproto */
+  gpointer slots[OWL_ZRECEIVE_RING_SIZE];
+  int head;             /* next to take; only the consumer moves it */
+  int tail;             /* next to fill; only the producer moves it */
+} owl_zreceive_ring;
+
+typedef struct _owl_zreceive_job { /* noproto */
+  ZNotice_t notice;
+  int newlinestrip;     /* the variable's value when it arrived */
+  const char *realm;    /* ours; zreceive_realm */
+} owl_zreceive_job;
+
+static GMainContext *zreceive_context;
+static GMainLoop *zreceive_loop;
+static GThread *zreceive_thread;
+
+static owl_zreceive_ring zreceive_in;    /* main thread -> builder */
+static owl_zreceive_ring zreceive_out;   /* builder -> main thread */
+static int zreceive_build_posted;
+static int zreceive_deliver_posted;
+static char *zreceive_realm;            /* read once, on the main thread */
+
+static int owl_zreceive_ring_has_room(owl_zreceive_ring *r)
+{
+  int tail = g_atomic_int_get(&r->tail);
+
+  return (tail + 1) % OWL_ZRECEIVE_RING_SIZE != g_atomic_int_get(&r->head);
+}
+
+static int owl_zreceive_ring_is_empty(owl_zreceive_ring *r)
+{
+  return g_atomic_int_get(&r->head) == g_atomic_int_get(&r->tail);
+}
+
+/* Add 'p' to 'r'; only the producer may call this, and only when
+ * there is room */
+static void owl_zreceive_ring_push(owl_zreceive_ring *r, gpointer p)
+{
+  int tail = g_atomic_int_get(&r->tail);
+
+  g_atomic_pointer_set(&r->slots[tail], p);
+  g_atomic_int_set(&r->tail, (tail + 1) % OWL_ZRECEIVE_RING_SIZE);
+}
+
+/* Take the oldest entry of 'r', or NULL if it is empty; only the
+ * consumer may call this */
+static gpointer owl_zreceive_ring_pop(owl_zreceive_ring *r)
+{
+  int head = g_atomic_int_get(&r->head);
+  gpointer p;
+
+  if (head == g_atomic_int_get(&r->tail))
+    return NULL;
+  p = g_atomic_pointer_get(&r->slots[head]);
+  g_atomic_int_set(&r->head, (head + 1) % OWL_ZRECEIVE_RING_SIZE);
+  return p;
+}
+
+static void owl_zreceive_build(void *data);
+static void owl_zreceive_deliver(void *data);
+
+/* Wake the builder, unless it is already awake */
+static void owl_zreceive_kick_builder(void)
+{
+  if (g_atomic_int_compare_and_exchange(&zreceive_build_posted, 0, 1))
+    owl_select_post_task(owl_zreceive_build, NULL, NULL, zreceive_context);
+}
+
+/* Runs on the builder thread */
+static void owl_zreceive_build(void *data)
+{
+  owl_zreceive_job *job;
+  owl_message *m;
+  int built;
+
+  do {
+    built = 0;
+    while (owl_zreceive_ring_has_room(&zreceive_out) &&
+           (job = owl_zreceive_ring_pop(&zreceive_in)) != NULL) {
+      m = g_new(owl_message, 1);
+      owl_message_build_from_znotice(m, &job->notice, job->newlinestrip, job->realm);
+      g_free(job);
+      owl_zreceive_ring_push(&zreceive_out, m);
+      built = 1;
+    }
+    if (built && g_atomic_int_compare_and_exchange(&zreceive_deliver_posted, 0, 1))
+      owl_select_post_task(owl_zreceive_deliver, NULL, NULL, NULL);
+
+    g_atomic_int_set(&zreceive_build_posted, 0);
+    /* A notice may have come just before we cleared the flag.  If the
+     * output ring is full, the main thread wakes us once it has room. */
+  } while (owl_zreceive_ring_has_room(&zreceive_out) &&
+           !owl_zreceive_ring_is_empty(&zreceive_in) &&
+           g_atomic_int_compare_and_exchange(&zreceive_build_posted, 0, 1));
+}
+
+/* Runs on the main thread with messages the builder has made */
+static void owl_zreceive_deliver(void *data)
+{
+  owl_message *m;
+
+  g_atomic_int_set(&zreceive_deliver_posted, 0);
+  while ((m = owl_zreceive_ring_pop(&zreceive_out)) != NULL) {
+    owl_message_finish_from_znotice(m);
+    owl_zdecrypt_queue_message(m);
+  }
+
+  /* The builder may have stopped for want of room */
+  if (!owl_zreceive_ring_is_empty(&zreceive_in))
+    owl_zreceive_kick_builder();
+}
+
+/* Whether owl_zreceive_queue_notice can take another notice now */
+int owl_zreceive_has_room(void)
+{
+  if (!zreceive_context) return 1;
+  return owl_zreceive_ring_has_room(&zreceive_in);
+}
+
+/* Make the received zephyr 'n' into a message and add it to the
+ * message queue, in the order notices are passed here.  The message
+ * takes over the notice.  Call owl_zreceive_has_room first.
+ */
+void owl_zreceive_queue_notice(const ZNotice_t *n)
+{
+  owl_zreceive_job *job;
+  owl_message *m;
+
+  if (!zreceive_context) {
+    m = g_new(owl_message, 1);
+    owl_message_create_from_znotice(m, n);
+    owl_zdecrypt_queue_message(m);
+    return;
+  }
+
+  job = g_new(owl_zreceive_job, 1);
+  job->notice = *n;
+  job->newlinestrip = owl_global_is_newlinestrip(&g);
+  if (!zreceive_realm)
+    zreceive_realm = g_strdup(owl_zephyr_get_realm());
+  job->realm = zreceive_realm;
+  owl_zreceive_ring_push(&zreceive_in, job);
+  owl_zreceive_kick_builder();
+}
+
+static gpointer owl_zreceive_thread_func(gpointer data)
+{
+  g_main_loop_run(zreceive_loop);
+  return NULL;
+}
+
+void owl_zreceive_init(void)
+{
+  GError *error = NULL;
+
+  zreceive_context = g_main_context_new();
+  zreceive_loop = g_main_loop_new(zreceive_context, FALSE);
+  zreceive_thread = g_thread_create(owl_zreceive_thread_func,
+                                    NULL,
+                                    TRUE,
+                                    &error);
+  if (error) {
+    owl_function_error("Error spawning zephyr thread: %s", error->message);
+    g_error_free(error);
+    g_main_loop_unref(zreceive_loop);
+    g_main_context_unref(zreceive_context);
+    zreceive_loop = NULL;
+    zreceive_context = NULL;
+  }
+}
+
+static void owl_zreceive_quit_func(gpointer data)
+{
+  g_main_loop_quit(zreceive_loop);
+}
+
+void owl_zreceive_shutdown(void)
+{
+  if (!zreceive_context) return;
+  owl_select_post_task(owl_zreceive_quit_func, NULL,
+                       NULL, zreceive_context);
+  g_thread_join(zreceive_thread);
+  g_free(zreceive_realm);
+  zreceive_realm = NULL;
+}
+
+#else
+
+void owl_zreceive_init(void)
+{
+}
+
+void owl_zreceive_shutdown(void)
+{
+}
+
+#endif